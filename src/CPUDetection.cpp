@@ -2,6 +2,8 @@
 #include "MSRDriver.h"
 
 CPUDetection::CPUDetection() {
+    hybrid = false;
+    coreType = CORE_ANY;
     DetectVendor();
     DetectFamily();
     DetectScheme();
@@ -28,6 +30,24 @@ void CPUDetection::DetectVendor() {
     }
 
     vendor = (EProcVendor)VendorNum;
+
+    if (vendor == INTEL && CpuIdOutput[0] >= 7) {
+        // Hybrid flag is CPUID leaf 7 EDX bit 15
+        int MaxLeaf = CpuIdOutput[0];
+        Cpuid(CpuIdOutput, 7);
+        hybrid = (CpuIdOutput[3] >> 15) & 1;
+        if (hybrid && MaxLeaf >= 0x1A) coreType = CurrentCoreType();
+    }
+}
+
+ECoreType CPUDetection::CurrentCoreType() {
+    // The core type depends on which processor we are running on.
+    // The caller must lock the thread to a processor to get a meaningful answer
+    int CpuIdOutput[4];
+    Cpuid(CpuIdOutput, 0);
+    if (CpuIdOutput[0] < 0x1A) return CORE_ANY;
+    Cpuid(CpuIdOutput, 0x1A);
+    return ECoreType((unsigned int)CpuIdOutput[0] >> 24);
 }
 
 void CPUDetection::DetectFamily() {
@@ -36,6 +56,7 @@ void CPUDetection::DetectFamily() {
 
     family = P_UNKNOWN;
     model = 0;
+    uncoreScheme = U_NONE;
 
     Cpuid(CpuIdOutput, 0);
     if (CpuIdOutput[0] == 0) return;
@@ -79,8 +100,27 @@ void CPUDetection::DetectFamily() {
             if (model == 0x8C || model == 0x8D)
                 family = INTEL_TIGERLAKE;
 
+            // Server and P-core only models with Golden Cove or later cores
+            if (model == 0x8F || model == 0xCF || model == 0xAD || model == 0xAE)
+                family = INTEL_GOLDENCOVE;
+
+            // E-core only models with Gracemont or later cores
+            if (model == 0xBE || model == 0xAF || model == 0xB6 || model == 0xDD)
+                family = INTEL_GRACEMONT;
+
+            // Hybrid models (Alder Lake, Raptor Lake, Meteor Lake, Arrow Lake, Lunar Lake).
+            // The family depends on the core type we are running on
+            if (model == 0x97 || model == 0x9A || model == 0xB7 || model == 0xBA || model == 0xBF
+            || model == 0xAA || model == 0xAC || model == 0xC5 || model == 0xC6 || model == 0xBD) {
+                family = coreType == CORE_ATOM ? INTEL_GRACEMONT : INTEL_GOLDENCOVE;
+            }
+
             if (family == INTEL_P23 && model >= 0x3F)
                 family = INTEL_HASW;
+
+            // Client models with the Skylake uncore. Servers have other uncore counters
+            if (model == 0x4E || model == 0x5E || model == 0x8E || model == 0x9E || model == 0xA5 || model == 0xA6)
+                uncoreScheme = U_INTEL;
         }
     }
     else if (vendor == AMD) {
@@ -88,6 +128,10 @@ void CPUDetection::DetectFamily() {
         if (Family == 6)    family = AMD_ATHLON;
         if (Family >= 0x0F && Family <= 0x14) family = AMD_ATHLON64;
         if (Family >= 0x15) family = AMD_BULLD;
+        if (Family == 0x17) family = AMD_ZEN;
+        if (Family >= 0x19) family = AMD_ZEN3;
+        if (Family == 0x17) uncoreScheme = U_ZEN;
+        if (Family >= 0x19) uncoreScheme = U_ZEN3;
     }
     else if (vendor == VIA) {
         if (Family == 6 && model >= 0x0F) family = VIA_NANO;
@@ -96,9 +140,31 @@ void CPUDetection::DetectFamily() {
 
 void CPUDetection::DetectScheme() {
     scheme = S_UNKNOWN;
+    perfMonV2 = false;
+    numAMDCounters = 0;
 
     if (vendor == AMD) {
+        int CpuIdOutput[4];
         scheme = S_AMD;
+        numAMDCounters = 4;
+        Cpuid(CpuIdOutput, (int)0x80000000);
+        unsigned int MaxExtLeaf = CpuIdOutput[0];
+        if (MaxExtLeaf >= 0x80000001) {
+            Cpuid(CpuIdOutput, (int)0x80000001);
+            if (CpuIdOutput[2] & (1 << 23)) {
+                // PerfCtrExtCore: six core counters at 0xC0010200
+                scheme = S_AMD2;
+                numAMDCounters = 6;
+            }
+        }
+        if (scheme == S_AMD2 && MaxExtLeaf >= 0x80000022) {
+            Cpuid(CpuIdOutput, (int)0x80000022);
+            if (CpuIdOutput[0] & 1) {
+                // PerfMonV2: counters must also be enabled in PerfCntrGlobalCtl
+                perfMonV2 = true;
+                numAMDCounters = CpuIdOutput[1] & 0x0F;
+            }
+        }
     }
     else if (vendor == VIA) {
         scheme = S_VIA;
@@ -109,7 +175,11 @@ void CPUDetection::DetectScheme() {
         if (CpuIdOutput[0] >= 0x0A) {
             Cpuid(CpuIdOutput, 0x0A);
             int pmc_version = CpuIdOutput[0] & 0xFF;
-            if (pmc_version > 0 && pmc_version <= 4) {
+            if (pmc_version >= 3) {
+                // Later versions are backwards compatible with version 3
+                scheme = S_ID3;
+            }
+            else if (pmc_version > 0) {
                 scheme = EPMCScheme(S_ID1 << (pmc_version - 1));
             }
         }
@@ -122,7 +192,7 @@ void CPUDetection::DetectScheme() {
             case INTEL_CORE2: scheme = S_ID2; break;
             case INTEL_7: case INTEL_IVY: case INTEL_HASW: case INTEL_BROADWELL:
             case INTEL_SKYLAKE: case INTEL_KABYLAKE: case INTEL_ICELAKE: case INTEL_TIGERLAKE:
-            case INTEL_ATOM:
+            case INTEL_GOLDENCOVE: case INTEL_GRACEMONT: case INTEL_ATOM:
                 scheme = S_ID3; break;
             default: break;
             }
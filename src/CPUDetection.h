@@ -9,13 +9,26 @@ public:
     EPMCScheme GetScheme() const { return scheme; }
     EProcFamily GetFamily() const { return family; }
     EProcVendor GetVendor() const { return vendor; }
+    EUncoreScheme GetUncoreScheme() const { return uncoreScheme; }
     int GetModel() const { return model; }
+    bool HasPerfMonV2() const { return perfMonV2; }         // AMD global counter control
+    int GetNumAMDCounters() const { return numAMDCounters; } // AMD core counters
+    bool IsHybrid() const { return hybrid; }                // Intel processor with P-cores and E-cores
+    ECoreType GetCoreType() const { return coreType; }      // core type of the processor we were running on
+
+    // Core type of the processor the calling thread is running on. Lock the thread first
+    static ECoreType CurrentCoreType();
 
 private:
     EProcVendor vendor;
     EProcFamily family;
     EPMCScheme scheme;
+    EUncoreScheme uncoreScheme;
     int model;
+    bool perfMonV2;
+    int numAMDCounters;
+    bool hybrid;
+    ECoreType coreType;
 
     void DetectVendor();
     void DetectFamily();
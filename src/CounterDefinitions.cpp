@@ -172,6 +172,7 @@ SCounterDefinition CounterDefinitions[] = {
     {24,  S_ID3,  INTEL_HASW, 0,  3,     0,   0xA8,     0x01, "Loop uops"  }, // uops from loop stream detector
     {25,  S_ID3,  INTEL_HASW, 0,  3,     0,   0x79,     0x04, "Dec uops"   }, // uops from decoders. (MITE = Micro-instruction Translation Engine)
     {26,  S_ID3,  INTEL_HASW, 0,  3,     0,   0x79,     0x08, "Cach uops"  }, // uops from uop cache. (DSB = Decoded Stream Buffer)
+    {27,  S_ID3,  INTEL_HASW, 0,  3,     0,   0xab,     0x02, "DSB2MITE"   }, // penalty cycles switching from uop cache to decoders
     {100, S_ID3,  INTEL_HASW, 0,  3,     0,   0xc2,     0x01, "Uops"       }, // uops retired, unfused domain
     {104, S_ID3,  INTEL_HASW, 0,  3,     0,   0x0e,     0x01, "uops RAT"   }, // uops from RAT to RS
     {111, S_ID3,  INTEL_HASW, 0,  3,     0,   0xa2,     0x01, "res.stl."   }, // any resource stall
@@ -268,29 +269,183 @@ SCounterDefinition CounterDefinitions[] = {
     {641, S_ID3, INTEL_ATOM,  0,   1,     0,   0x13,     0x81, "div"        }, // Int and FP divide and sqrt operations
     {651, S_ID3, INTEL_ATOM,  0,   1,     0,   0x10,     0x81, "fp uop"     }, // Floating point uops
 
+    // Top-down analysis, used by CCounters::DefineTopDown:
+    // Slots for PERF_METRICS on Ice Lake and Tiger Lake (Golden Cove below).
+    // Events for the classic level 1 formulas on Sandy Bridge to Comet Lake.
+    // EventMask bits 16-23 are the counter mask (cmask).
+    //  id   scheme  cpu               countregs eventreg event  mask   name
+    {3,   S_ID3, INTEL_ICELAKE,    0x40000003, 0,0,   0,      0,   "Slots"      }, // TOPDOWN.SLOTS
+    {3,   S_ID3, INTEL_TIGERLAKE,  0x40000003, 0,0,   0,      0,   "Slots"      }, // TOPDOWN.SLOTS
+    {700, S_ID3, EProcFamily(INTEL_7I | INTEL_HASW | INTEL_BROADWELL | INTEL_SKYLAKE | INTEL_KABYLAKE),
+                                   0,   3,     0,   0x9c,     0x01, "NotDeliv"   }, // IDQ_UOPS_NOT_DELIVERED.CORE
+    {701, S_ID3, EProcFamily(INTEL_7I | INTEL_HASW | INTEL_BROADWELL | INTEL_SKYLAKE | INTEL_KABYLAKE),
+                                   0,   3,     0,   0x0e,     0x01, "Uops iss"   }, // UOPS_ISSUED.ANY
+    {702, S_ID3, EProcFamily(INTEL_7I | INTEL_HASW | INTEL_BROADWELL | INTEL_SKYLAKE | INTEL_KABYLAKE),
+                                   0,   3,     0,   0xc2,     0x02, "RetSlots"   }, // UOPS_RETIRED.RETIRE_SLOTS
+    {703, S_ID3, EProcFamily(INTEL_7I | INTEL_HASW | INTEL_BROADWELL),
+                                   0,   3,     0,   0x0d, 0x010003, "Recovery"   }, // INT_MISC.RECOVERY_CYCLES
+    {703, S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE),
+                                   0,   3,     0,   0x0d,     0x01, "Recovery"   }, // INT_MISC.RECOVERY_CYCLES
+
+    // Hardware interrupts, used by CCounters::DefineInterruptCheck:
+    //  id   scheme  cpu               countregs eventreg event  mask   name
+    {710, S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE | INTEL_GOLDENCOVE),
+                                   0,   3,     0,   0xcb,     0x01, "HwIntr"     }, // HW_INTERRUPTS.RECEIVED
+    {710, S_AMD2, AMD_ZENALL,      0,   5,     0,  0x02c,        0, "HwIntr"     }, // interrupts taken
+
+    // TLB misses of loads and instruction fetches that hit the second level TLB or walk the page
+    // tables, as in tests/tlb.py. "Walk cyc" adds the cycles of all pending walks, so divided by
+    // "DTLB Walk" it gives the latency of a walk. Golden Cove, Gracemont and Zen entries are below.
+    //  id   scheme  cpu               countregs eventreg event  mask   name
+    {350, S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0x08,     0x20, "STLB Hit"   }, // DTLB_LOAD_MISSES.STLB_HIT
+    {351, S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0x08,     0x0e, "DTLB Walk"  }, // DTLB_LOAD_MISSES.WALK_COMPLETED
+    {352, S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0x08,     0x10, "Walk cyc"   }, // DTLB_LOAD_MISSES.WALK_PENDING
+    {353, S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0x85,     0x20, "ITLB Hit"   }, // ITLB_MISSES.STLB_HIT
+    {354, S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0x85,     0x0e, "ITLB Walk"  }, // ITLB_MISSES.WALK_COMPLETED
+
+    // Mispredicted calls, returns and indirect branches, as in tests/indirect.py, where the
+    // processor counts them. Golden Cove, Gracemont and Zen entries are below.
+    //  id   scheme  cpu               countregs eventreg event  mask   name
+    {211, S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0xc5,     0x02, "CallMisp"   }, // BR_MISP_RETIRED.NEAR_CALL
+    {220, S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE),
+                                   0,   3,     0,   0x89,     0xe4, "IndirMisp"  }, // BR_MISP_EXEC.INDIRECT
+    {220, S_ID3, EProcFamily(INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0xc5,     0x80, "IndirMisp"  }, // BR_MISP_RETIRED.INDIRECT
+
+    // Loads blocked by a store they can't take their data from, loads held back by a store to an
+    // address 4K apart, and machine clears from loads that ran ahead of a store to the same address,
+    // as in tests/store_forward.py. Golden Cove, Gracemont and Zen entries are below.
+    //  id   scheme  cpu               countregs eventreg event  mask   name
+    {120, S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0x03,     0x02, "Forwfail"   }, // LD_BLOCKS.STORE_FORWARD
+    {125, S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0x07,     0x01, "4K alias"   }, // LD_BLOCKS_PARTIAL.ADDRESS_ALIAS
+    {413, S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0xc3,     0x02, "MemOrdClr"  }, // MACHINE_CLEARS.MEMORY_ORDERING
+
+    // Where the front end gets its uops from, as in tests/uop_cache.py, and the cycles lost
+    // switching from the uop cache to the decoders. Golden Cove and Zen entries are below.
+    //  id   scheme  cpu               countregs eventreg event  mask   name
+    {24,  S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0xa8,     0x01, "Loop uops"  }, // LSD.UOPS
+    {25,  S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0x79,     0x04, "Dec uops"   }, // IDQ.MITE_UOPS
+    {26,  S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0x79,     0x08, "Cach uops"  }, // IDQ.DSB_UOPS
+    {27,  S_ID3, EProcFamily(INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE),
+                                   0,   3,     0,   0xab,     0x02, "DSB2MITE"   }, // DSB2MITE_SWITCHES.PENALTY_CYCLES
+
+    // Intel Golden Cove and later P-cores (Alder Lake, Raptor Lake, Sapphire Rapids):
+    // Four fixed counters and eight general counters.
+    // On hybrid processors these entries apply to the P-cores only.
+    //  id   scheme  cpu               countregs eventreg event  mask   name
+    {1,   S_ID3, INTEL_GOLDENCOVE, 0x40000001, 0,0,   0,      0,   "Core cyc"   }, // CPU_CLK_UNHALTED.THREAD
+    {2,   S_ID3, INTEL_GOLDENCOVE, 0x40000002, 0,0,   0,      0,   "Ref cyc"    }, // CPU_CLK_UNHALTED.REF_TSC
+    {3,   S_ID3, INTEL_GOLDENCOVE, 0x40000003, 0,0,   0,      0,   "Slots"      }, // TOPDOWN.SLOTS
+    {9,   S_ID3, INTEL_GOLDENCOVE, 0x40000000, 0,0,   0,      0,   "Instruct"   }, // INST_RETIRED.ANY
+    {10,  S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0xc0,     0x00, "Instr"      }, // INST_RETIRED.ANY_P
+    {24,  S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0xa8,     0x01, "Loop uops"  }, // LSD.UOPS
+    {25,  S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0x79,     0x04, "Dec uops"   }, // IDQ.MITE_UOPS
+    {26,  S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0x79,     0x08, "Cach uops"  }, // IDQ.DSB_UOPS
+    {27,  S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0x61,     0x02, "DSB2MITE"   }, // DSB2MITE_SWITCHES.PENALTY_CYCLES
+    {100, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0xc2,     0x02, "Uops"       }, // UOPS_RETIRED.SLOTS
+    {201, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0xc4,     0x00, "BrTaken"    }, // BR_INST_RETIRED.ALL_BRANCHES
+    {207, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0xc5,     0x00, "BrMispred"  }, // BR_MISP_RETIRED.ALL_BRANCHES
+    {311, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0x51,     0x01, "L1D Miss"   }, // L1D.REPLACEMENT
+    {320, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0x24,     0x3f, "L2 Miss"    }, // L2_RQSTS.MISS
+    {410, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0x60,     0x01, "BaClrAny"   }, // BACLEARS.ANY
+    {411, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0xad,     0x80, "ClrRestr"   }, // INT_MISC.CLEAR_RESTEER_CYCLES
+    {350, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0x12,     0x20, "STLB Hit"   }, // DTLB_LOAD_MISSES.STLB_HIT
+    {351, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0x12,     0x0e, "DTLB Walk"  }, // DTLB_LOAD_MISSES.WALK_COMPLETED
+    {352, S_ID3, INTEL_GOLDENCOVE, 0,   3,     0,   0x12,     0x10, "Walk cyc"   }, // DTLB_LOAD_MISSES.WALK_PENDING
+    {353, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0x11,     0x20, "ITLB Hit"   }, // ITLB_MISSES.STLB_HIT
+    {354, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0x11,     0x0e, "ITLB Walk"  }, // ITLB_MISSES.WALK_COMPLETED
+    {211, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0xc5,     0x02, "CallMisp"   }, // BR_MISP_RETIRED.INDIRECT_CALL
+    {212, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0xc5,     0x08, "RetMisp"    }, // BR_MISP_RETIRED.RET
+    {220, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0xc5,     0x80, "IndirMisp"  }, // BR_MISP_RETIRED.INDIRECT
+    {120, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0x03,     0x82, "Forwfail"   }, // LD_BLOCKS.STORE_FORWARD
+    {125, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0x03,     0x04, "4K alias"   }, // LD_BLOCKS.ADDRESS_ALIAS
+    {413, S_ID3, INTEL_GOLDENCOVE, 0,   7,     0,   0xc3,     0x02, "MemOrdClr"  }, // MACHINE_CLEARS.MEMORY_ORDERING
+
+    // Intel Gracemont and later E-cores (Alder Lake, Raptor Lake, Sierra Forest):
+    // Three fixed counters and six general counters.
+    // On hybrid processors these entries apply to the E-cores only.
+    //  id   scheme  cpu               countregs eventreg event  mask   name
+    {1,   S_ID3, INTEL_GRACEMONT,  0x40000001, 0,0,   0,      0,   "Core cyc"   }, // CPU_CLK_UNHALTED.CORE
+    {2,   S_ID3, INTEL_GRACEMONT,  0x40000002, 0,0,   0,      0,   "Ref cyc"    }, // CPU_CLK_UNHALTED.REF_TSC
+    {9,   S_ID3, INTEL_GRACEMONT,  0x40000000, 0,0,   0,      0,   "Instruct"   }, // INST_RETIRED.ANY
+    {10,  S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0xc0,     0x00, "Instr"      }, // INST_RETIRED.ANY_P
+    {100, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0xc2,     0x00, "Uops"       }, // UOPS_RETIRED.ALL
+    {201, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0xc4,     0x00, "BrTaken"    }, // BR_INST_RETIRED.ALL_BRANCHES
+    {207, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0xc5,     0x00, "BrMispred"  }, // BR_MISP_RETIRED.ALL_BRANCHES
+    {310, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0x80,     0x02, "CodeMiss"   }, // ICACHE.MISSES
+    {410, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0xe6,     0x01, "BaClrAny"   }, // BACLEARS.ANY
+    {351, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0x08,     0x0e, "DTLB Walk"  }, // DTLB_LOAD_MISSES.WALK_COMPLETED
+    {354, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0x85,     0x0e, "ITLB Walk"  }, // ITLB_MISSES.WALK_COMPLETED
+    {211, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0xc5,     0xfb, "CallMisp"   }, // BR_MISP_RETIRED.IND_CALL
+    {212, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0xc5,     0xf7, "RetMisp"    }, // BR_MISP_RETIRED.RETURN
+    {220, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0xc5,     0xeb, "IndirMisp"  }, // BR_MISP_RETIRED.INDIRECT
+    {120, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0x03,     0x02, "Forwfail"   }, // LD_BLOCKS.STORE_FORWARD
+    {125, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0x03,     0x04, "4K alias"   }, // LD_BLOCKS.4K_ALIAS
+    {413, S_ID3, INTEL_GRACEMONT,  0,   5,     0,   0xc3,     0x02, "MemOrdClr"  }, // MACHINE_CLEARS.MEMORY_ORDERING
+
+
+    // AMD Zen (Family 17h and later):
+    // Six general counters with the core performance counter extensions. Event codes
+    // have 12 bits; bits 11:8 are placed in PERF_CTL bits 35:32 by DefineCounter.
+    // These entries come first so that they take precedence over the generic AMD entries below.
+    //  id   scheme  cpu         countregs eventreg event  mask   name
+    {  1, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x076,      0,  "Core cyc" }, // cycles not in halt
+    {  9, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x0c0,      0,  "Instruct" }, // retired instructions
+    { 25, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x0aa,   0x01,  "Dec uops" }, // ops dispatched from the decoder
+    { 26, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x0aa,   0x02,  "Cach uops"}, // ops dispatched from the op cache
+    {100, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x0c1,      0,  "Uops"     }, // retired macro-ops
+    {200, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x0c2,      0,  "Branch"   }, // retired branch instructions
+    {201, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x0c4,      0,  "BrTaken"  }, // retired taken branch instructions
+    {204, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x0c3,      0,  "BrMispred"}, // retired branch instructions mispredicted
+    {207, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x0c3,      0,  "BrMispred"}, // same as 204, id used by the Intel tables
+    {212, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x0c9,      0,  "RetMisp"  }, // retired near returns mispredicted
+    {220, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x0ca,      0,  "IndirMisp"}, // retired indirect branches mispredicted
+    {310, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x18e,   0x18,  "CodeMiss" }, // instruction cache tag misses
+    {311, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x041,   0x03,  "L1D Miss" }, // miss address buffer allocations, loads and stores
+    {320, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x064,   0x09,  "L2 Miss"  }, // L2 misses for instruction and data fetches
+    {420, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x08a,      0,  "L1BTBCorr"}, // L1 BTB corrections (prediction overridden by L2 BTB)
+    {421, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x08b,      0,  "L2BTBCorr"}, // L2 BTB corrections (prediction overridden by decoder)
+    {350, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x045,   0x0f,  "STLB Hit" }, // L1 DTLB misses that hit the L2 DTLB
+    {351, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x045,   0xf0,  "DTLB Walk"}, // L1 DTLB misses that miss the L2 DTLB (page walks)
+    {353, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x084,      0,  "ITLB Hit" }, // L1 ITLB misses that hit the L2 ITLB
+    {354, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x085,   0x07,  "ITLB Walk"}, // L1 ITLB misses that miss the L2 ITLB
+    {601, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x035,      0,  "st.forw"  }, // store-to-load forwards
+    {120, S_AMD2, AMD_ZENALL,  0,   5,     0,  0x024,   0x02,  "Forwfail" }, // loads blocked by a store they can't forward from
 
     //  id   scheme  cpu         countregs eventreg event  mask   name
-    {  9, S_AMD, AMD_ALL,      0,   3,     0,   0xc0,      0,  "Instruct" }, // x86 instructions executed
-    {100, S_AMD, AMD_ALL,      0,   3,     0,   0xc1,      0,  "Uops"     }, // microoperations
-    {204, S_AMD, AMD_ALL,      0,   3,     0,   0xc3,      0,  "BrMispred"}, // mispredicted branches
-    {201, S_AMD, AMD_BULLD,    0,   3,     0,   0xc4,   0x00,  "BrTaken"  }, // branches taken
-    {209, S_AMD, AMD_BULLD,    0,   3,     0,   0xc2,   0x00,  "RSBovfl"  }, // return stack buffer overflow
-    {310, S_AMD, AMD_ALL,      0,   3,     0,   0x81,      0,  "CodeMiss" }, // instruction cache misses
-    {311, S_AMD, AMD_ALL,      0,   3,     0,   0x41,      0,  "L1D Miss" }, // L1 data cache misses
-    {320, S_AMD, AMD_ALL,      0,   3,     0,   0x43,   0x1f,  "L2 Miss"  }, // L2 cache misses
-    {150, S_AMD, AMD_ATHLON64, 0,   3,     0,   0x00,   0x3f,  "UopsFP"   }, // microoperations in FP pipe
-    {151, S_AMD, AMD_ATHLON64, 0,   3,     0,   0x00,   0x09,  "FPADD"    }, // microoperations in FP ADD unit
-    {152, S_AMD, AMD_ATHLON64, 0,   3,     0,   0x00,   0x12,  "FPMUL"    }, // microoperations in FP MUL unit
-    {153, S_AMD, AMD_ATHLON64, 0,   3,     0,   0x00,   0x24,  "FPMISC"   }, // microoperations in FP Store unit
-    {150, S_AMD, AMD_BULLD,    3,   3,     0,   0x00,   0x01,  "UopsFP0"  }, // microoperations in FP pipe 0
-    {151, S_AMD, AMD_BULLD,    3,   3,     0,   0x00,   0x02,  "UopsFP1"  }, // microoperations in FP pipe 1
-    {152, S_AMD, AMD_BULLD,    3,   3,     0,   0x00,   0x04,  "UopsFP2"  }, // microoperations in FP pipe 2
-    {153, S_AMD, AMD_BULLD,    3,   3,     0,   0x00,   0x08,  "UopsFP3"  }, // microoperations in FP pipe 3
-    {110, S_AMD, AMD_BULLD,    0,   3,     0,   0x04,   0x0a,  "UopsElim" }, // move eliminations and scalar op optimizations
-    {120, S_AMD, AMD_BULLD,    0,   3,     0,   0x2A,   0x01,  "Forwfail" }, // load-to-store forwarding failed
-    {160, S_AMD, AMD_BULLD,    0,   3,     0,   0xCB,   0x01,  "x87"      }, // FP x87 instructions
-    {161, S_AMD, AMD_BULLD,    0,   3,     0,   0xCB,   0x02,  "MMX"      }, // MMX instructions
-    {162, S_AMD, AMD_BULLD,    0,   3,     0,   0xCB,   0x04,  "XMM"      }, // XMM and YMM instructions
+    {  9, S_AMDA, AMD_ALL,     0,   3,     0,   0xc0,      0,  "Instruct" }, // x86 instructions executed
+    {100, S_AMDA, AMD_ALL,     0,   3,     0,   0xc1,      0,  "Uops"     }, // microoperations
+    {204, S_AMDA, AMD_ALL,     0,   3,     0,   0xc3,      0,  "BrMispred"}, // mispredicted branches
+    {201, S_AMDA, AMD_BULLD,   0,   3,     0,   0xc4,   0x00,  "BrTaken"  }, // branches taken
+    {209, S_AMDA, AMD_BULLD,   0,   3,     0,   0xc2,   0x00,  "RSBovfl"  }, // return stack buffer overflow
+    {310, S_AMDA, AMD_ALL,     0,   3,     0,   0x81,      0,  "CodeMiss" }, // instruction cache misses
+    {311, S_AMDA, AMD_ALL,     0,   3,     0,   0x41,      0,  "L1D Miss" }, // L1 data cache misses
+    {320, S_AMDA, AMD_ALL,     0,   3,     0,   0x43,   0x1f,  "L2 Miss"  }, // L2 cache misses
+    {150, S_AMDA, AMD_ATHLON64,0,   3,     0,   0x00,   0x3f,  "UopsFP"   }, // microoperations in FP pipe
+    {151, S_AMDA, AMD_ATHLON64,0,   3,     0,   0x00,   0x09,  "FPADD"    }, // microoperations in FP ADD unit
+    {152, S_AMDA, AMD_ATHLON64,0,   3,     0,   0x00,   0x12,  "FPMUL"    }, // microoperations in FP MUL unit
+    {153, S_AMDA, AMD_ATHLON64,0,   3,     0,   0x00,   0x24,  "FPMISC"   }, // microoperations in FP Store unit
+    {150, S_AMDA, AMD_BULLD,   3,   3,     0,   0x00,   0x01,  "UopsFP0"  }, // microoperations in FP pipe 0
+    {151, S_AMDA, AMD_BULLD,   3,   3,     0,   0x00,   0x02,  "UopsFP1"  }, // microoperations in FP pipe 1
+    {152, S_AMDA, AMD_BULLD,   3,   3,     0,   0x00,   0x04,  "UopsFP2"  }, // microoperations in FP pipe 2
+    {153, S_AMDA, AMD_BULLD,   3,   3,     0,   0x00,   0x08,  "UopsFP3"  }, // microoperations in FP pipe 3
+    {110, S_AMDA, AMD_BULLD,   0,   3,     0,   0x04,   0x0a,  "UopsElim" }, // move eliminations and scalar op optimizations
+    {120, S_AMDA, AMD_BULLD,   0,   3,     0,   0x2A,   0x01,  "Forwfail" }, // load-to-store forwarding failed
+    {160, S_AMDA, AMD_BULLD,   0,   3,     0,   0xCB,   0x01,  "x87"      }, // FP x87 instructions
+    {161, S_AMDA, AMD_BULLD,   0,   3,     0,   0xCB,   0x02,  "MMX"      }, // MMX instructions
+    {162, S_AMDA, AMD_BULLD,   0,   3,     0,   0xCB,   0x04,  "XMM"      }, // XMM and YMM instructions
 
     // VIA Nano counters are undocumented
     // These are the ones I have found that counts. Most have unknown purpose
@@ -364,3 +519,25 @@ SCounterDefinition CounterDefinitions[] = {
     //  end of list   
     {0, S_UNKNOWN, P_UNKNOWN, 0,  0,     0,      0,     0,    0     }  // list must end with a record of all 0
 };
+
+// Uncore counters, counting for the whole socket. See CUncoreCounters
+SUncoreDefinition UncoreDefinitions[] = {
+    //  id    scheme    box       event  mask   name
+    // Intel client, Skylake to Comet Lake
+    {2000, U_INTEL,  BOX_CBO,   0x34,  0x8F,  "L3 Lookup"}, // L3 lookups, any request
+    {2001, U_INTEL,  BOX_CBO,   0x34,  0x88,  "L3 Miss"  }, // L3 lookups that found the line invalid
+    {2010, U_INTEL,  BOX_CBO,   0x22,  0x44,  "XSnp Hit" }, // snoops of other cores that hit a clean line
+    {2011, U_INTEL,  BOX_CBO,   0x22,  0x48,  "XSnp HitM"}, // snoops of other cores that hit a modified line
+    {2020, U_INTEL,  BOX_ARB,   0x81,  0x01,  "Mem Req"  }, // requests to the memory controller
+    {2021, U_INTEL,  BOX_ARB,   0x81,  0x20,  "Mem Write"}, // writes to the memory controller
+    {2030, U_INTEL,  BOX_UCLK,     0,     0,  "Unc Clock"}, // uncore clock cycles
+
+    // AMD Zen
+    {2000, U_ZENALL, BOX_L3,    0x04,  0xFF,  "L3 Lookup"}, // L3 lookups, all request types
+    {2001, U_ZENALL, BOX_L3,    0x06,  0x01,  "L3 Miss"  }, // L3 lookups that missed
+    {2040, U_ZEN,    BOX_DF,    0x07,  0x38,  "DRAM Ch0" }, // 64-byte transfers of DRAM channel 0
+    {2041, U_ZEN,    BOX_DF,    0x47,  0x38,  "DRAM Ch1" }, // 64-byte transfers of DRAM channel 1
+
+    //  end of list
+    {0, U_NONE, BOX_CBO, 0, 0, 0}  // list must end with a record of all 0
+};
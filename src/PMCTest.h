@@ -24,9 +24,15 @@
 // maximum number of performance counters used
 const int MAXCOUNTERS = 6;
 
+// maximum number of uncore counters used
+const int MAXUNCORE = 4;
+
 // maximum number of repetitions
 const int MAXREPEAT = 128;
 
+// maximum number of iterations of the test code in each repetition when calibrated
+const int MAX_INNER_ITERATIONS = 1000000;
+
 // max name length of counters
 const int COUNTERNAMELEN = 10; 
 
@@ -80,15 +86,27 @@ enum EProcFamily {
     INTEL_ATOM   = 0x1000,                  // Intel Atom
     INTEL_ICELAKE = 0x2000,                 // Intel Ice Lake (10th gen, 10nm)
     INTEL_TIGERLAKE = 0x4000,               // Intel Tiger Lake (11th gen)
+    INTEL_GOLDENCOVE = 0x8000,              // Intel Golden Cove and later P-cores (Alder Lake, Sapphire Rapids)
+    INTEL_GRACEMONT = 0x400000,             // Intel Gracemont and later E-cores (Alder Lake, Sierra Forest)
 
     AMD_ATHLON   = 0x10000,                 // AMD Athlon
     AMD_ATHLON64 = 0x20000,                 // AMD Athlon 64 or Opteron
+    AMD_ZEN      = 0x40000,                 // AMD Family 17h (Zen, Zen+, Zen 2)
     AMD_BULLD    = 0x80000,                 // AMD Family 15h (Bulldozer)
-    AMD_ALL      = 0xF0000,                 // AMD any processor
+    AMD_ZEN3     = 0x200000,                // AMD Family 19h and later (Zen 3, Zen 4, Zen 5)
+    AMD_ZENALL   = 0x240000,                // AMD any Zen processor
+    AMD_ALL      = 0x2F0000,                // AMD any processor
 
     VIA_NANO     = 0x100000,                 // VIA Nano (Centaur)
 };
 
+// codes for core type on hybrid processors, as reported by CPUID leaf 1AH
+enum ECoreType {
+    CORE_ANY   = 0,                          // not hybrid, or no preference
+    CORE_ATOM  = 0x20,                       // E-core (Intel Atom microarchitecture)
+    CORE_CORE  = 0x40                        // P-core (Intel Core microarchitecture)
+};
+
 // codes for PMC scheme
 enum EPMCScheme {
     S_UNKNOWN = 0,                           // unknown. can't do performance monitoring
@@ -101,8 +119,29 @@ enum EPMCScheme {
     S_P2MC = 0x0030,                         // Intel Pentium 2, Pentium M, Core solo/duo
     S_ID23 = 0x00C0,                         // Intel Core 2 and later
     S_INTL = 0x00F0,                         // Most Intel schemes
-    S_AMD  = 0x1000,                         // AMD processors
-    S_VIA  = 0x2000                          // VIA Nano processor and later
+    S_AMD  = 0x1000,                         // AMD processors, legacy counters
+    S_VIA  = 0x2000,                         // VIA Nano processor and later
+    S_AMD2 = 0x4000,                         // AMD with core performance counter extensions (Family 15h and later)
+    S_AMDA = 0x5000                          // Any AMD scheme
+};
+
+// codes for uncore counter scheme (counters outside the cores, for the whole socket)
+enum EUncoreScheme {
+    U_NONE   = 0,                            // no uncore counters
+    U_INTEL  = 0x01,                         // Intel client Skylake to Comet Lake: C-Box, ARB and clock MSRs
+    U_ZEN    = 0x10,                         // AMD Family 17h: L3 and data fabric counters
+    U_ZEN3   = 0x20,                         // AMD Family 19h and later
+    U_ZENALL = 0x30                          // Any AMD Zen
+};
+
+// kinds of uncore counter boxes
+enum EUncoreBox {
+    BOX_CBO  = 0,                            // Intel L3 slice (C-Box), one for each core. Counts are added
+    BOX_ARB  = 1,                            // Intel system agent arbitration (requests to memory)
+    BOX_UCLK = 2,                            // Intel fixed uncore clock counter
+    BOX_L3   = 3,                            // AMD L3 of this core complex
+    BOX_DF   = 4,                            // AMD data fabric
+    NUM_UNCORE_BOXES = 5
 };
 
 
@@ -118,6 +157,16 @@ struct SCounterDefinition {
     char         Description[COUNTERNAMELEN];// name of counter. length must be < COUNTERNAMELEN
 };
 
+// record specifying how to count a particular event in the uncore
+struct SUncoreDefinition {
+    int           CounterType;               // ID identifying what to count. 2000 and up
+    EUncoreScheme UncoreScheme;              // uncore scheme. values may be OR'ed
+    EUncoreBox    Box;                       // kind of counter box
+    int           Event;                     // event code
+    int           EventMask;                 // unit mask
+    char          Description[COUNTERNAMELEN];// name of counter. length must be < COUNTERNAMELEN
+};
+
 
 // class CCounters defines, starts and stops MSR counters
 class CCounters {
@@ -133,12 +182,21 @@ public:
     void CleanUp();                          // Any required cleanup of driver etc
     CMSRDriver msr;                          // interface to MSR access driver
     char * CounterNames[MAXCOUNTERS];        // name of each counter
+    int CounterMSR[MAXCOUNTERS];             // register of each counter, for MSR_READ. 0 if unknown
+    int PmiIndex;                            // index of counter that interrupts on overflow for PmiPeriod. -1 if none
     void Put1 (int num_threads,              // put record into multiple start queues
         EMSR_COMMAND msr_command, unsigned int register_number,
         unsigned int value_lo, unsigned int value_hi = 0);
     void Put2 (int num_threads,              // put record into multiple stop queues
         EMSR_COMMAND msr_command, unsigned int register_number,
         unsigned int value_lo, unsigned int value_hi = 0);
+    const char * DefineTopDown();            // define counters for top-down analysis. return error message
+    int  TopDownColumns();                   // number of top-down output columns. 0 if none
+    const char * TopDownName(int Column);    // heading of top-down output column
+    double TopDownValue(int Thread, int Repetition, int Column); // fraction of pipeline slots
+    const char * DefineInterruptCheck();     // count SMIs and hardware interrupts. return error message
+    bool HasSMICount() {return SMIStopIndex >= 0;}   // SMI count of each repetition is known
+    int  SMICount(int Thread, int Repetition); // number of SMIs during repetition
 protected:
     CMSRInOutQue queue1[MAXTHREADS];         // que of MSR commands to do by StartCounters()
     CMSRInOutQue queue2[MAXTHREADS];         // que of MSR commands to do by StopCounters()
@@ -150,7 +208,261 @@ protected:
     EPMCScheme  MScheme;                     // PMC monitoring scheme
     int NumPMCs;                             // Number of general PMCs
     int NumFixedPMCs;                        // Number of fixed function PMCs
+    bool AMDPerfMonV2;                       // AMD counters need enabling in PerfCntrGlobalCtl
     int ProcessorNumber;                     // main thread processor number in multiprocessor systems
+    enum ETopDownMode {
+        TD_NONE     = 0,                     // no top-down analysis
+        TD_METRICS  = 1,                     // level 1 from PERF_METRICS (Ice Lake, Tiger Lake)
+        TD_METRICS2 = 2,                     // level 1 and 2 from PERF_METRICS (Golden Cove and later)
+        TD_EVENTS   = 3                      // level 1 calculated from events (Sandy Bridge to Comet Lake)
+    };
+    ETopDownMode TopDownMode;
+    int TopDownValueIndex;                   // index of PERF_METRICS value in repetition queues
+    int TopDownCounters[5];                  // index into Counters[] of core cycles and classic top-down events
+    int SMIStartIndex, SMIStopIndex;         // index of MSR_SMI_COUNT values in repetition queues. -1 if none
+};
+
+
+// class CSampler reads the counters of the first thread's processor at fixed intervals
+// while the test runs. A helper thread on another processor sends the driver a queue
+// that does the reads on the first thread's processor (PROC_SET). This shows how the
+// counts change within a long test. The samples go in a ring buffer that keeps the
+// last MAXSAMPLES, and are saved with the time and the counts since StartCounters.
+class CSampler {
+public:
+    CSampler();                              // constructor
+    ~CSampler();                             // destructor
+    const char * Setup(int Interval, CCounters & Counters); // make read queue. return error message
+    void Start();                            // start sampling in helper thread
+    void Stop();                             // stop sampling and wait for helper thread
+    int  Save(const char * FileName);        // write samples to csv file. return error code
+    void Run();                              // sampling loop of helper thread
+    enum {MAXSAMPLES = 100000};              // size of ring buffer
+protected:
+    CMSRInOutQue Queue;                      // driver commands for one sample
+    CMSRDriver * Driver;                     // driver of the counters
+    const char * Names[MAXCOUNTERS];         // name of each counter sampled
+    int NumSampled;                          // number of counters sampled
+    int Interval;                            // time between samples (microseconds)
+    int Processor;                           // processor of helper thread
+    int64 * Samples;                         // ring buffer. time (ns) and counts of each sample
+    int64 NumSamples;                        // number of samples taken
+    volatile int StopFlag;                   // tells helper thread to stop
+    HelperThread Thread;                     // helper thread
+};
+
+
+// class CPmiSamples gets the instruction pointers that the driver sampled on
+// overflow of counter PmiCounterType in each thread (PMI_START), and writes them
+// as offsets into the test code or placed code for annotating the listings
+class CPmiSamples {
+public:
+    CPmiSamples();                           // constructor
+    ~CPmiSamples();                          // destructor
+    int  Save(const char * FileName, CMSRDriver & Driver); // write samples to csv file. return error code
+protected:
+    int64 * Buffer;                          // samples of one thread
+};
+
+
+// class CRepetitionQueues holds driver queues that TestLoop processes before and
+// after each repetition of the test code, for things that must be set up or read
+// for each repetition. The same commands are used for all threads and repetitions.
+// The values read by the stop commands are kept for each thread and repetition.
+class CRepetitionQueues {
+public:
+    CRepetitionQueues();                     // constructor
+    ~CRepetitionQueues();                    // destructor
+    int  PutStart(EMSR_COMMAND msr_command, unsigned int register_number, int64 value = 0); // command before each repetition
+    int  PutStop (EMSR_COMMAND msr_command, unsigned int register_number, int64 value = 0); // command after each repetition. return index for Value()
+    void Build(int Threads, int Repetitions);// make queues for all threads and repetitions and tell TestLoop
+    int64 Value(int Thread, int Repetition, int Index); // value read by stop command number Index
+    int64 StartValue(int Thread, int Repetition, int Index); // value read by start command number Index
+protected:
+    enum {MAXCOMMANDS = 256};
+    SMSRInOut StartCommands[MAXCOMMANDS];    // commands before each repetition
+    SMSRInOut StopCommands[MAXCOMMANDS];     // commands after each repetition
+    int NumStart, NumStop;                   // number of commands
+    int StartQueues, StopQueues;             // number of queues per repetition
+    int Repetitions;
+    CMSRInOutQue * Queues;                   // all queues, grouped by thread and repetition
+    CMSRInOutQue * QueueSet(int Thread, int Repetition) {
+        return Queues + (Thread * Repetitions + Repetition) * (StartQueues + StopQueues);
+    }
+};
+
+
+// class CUncoreCounters counts events outside the cores, such as L3 lookups and
+// memory traffic, in the counter boxes of the socket (UncoreDefinitions). The
+// counters are set up by the first thread's StartCounters, and read before and
+// after each repetition. With one thread they are unfrozen just before and frozen
+// just after each repetition. The counts of all boxes of a kind, e.g. all L3
+// slices, are added. Other processes on the socket add to the counts.
+class CUncoreCounters {
+public:
+    CUncoreCounters();                       // constructor
+    void FindBoxes(CMSRDriver & Driver);     // read number of L3 slices, before Define
+    const char * Define(int CounterType);    // request a counter. return error message
+    const char * Queue(CRepetitionQueues & Queues); // put reads in queues, after Define. return error message
+    void Start(CMSRDriver & Driver);         // set up counters, before the test threads start
+    void Stop(CMSRDriver & Driver);          // clear counters, after the test threads stop
+    int  Columns() {return NumCounters;}     // number of output columns
+    const char * Name(int Column) {return Names[Column];} // heading of output column
+    int64 Value(int Thread, int Repetition, int Column, CRepetitionQueues & Queues); // count in repetition
+protected:
+    void Registers(EUncoreBox Box, int BoxNum, int Counter, unsigned int & Ctl, unsigned int & Ctr);
+    int  Freeze(SMSRInOut * Commands, bool Frozen); // commands to (un)freeze all counters. return number
+    void Send(CMSRDriver & Driver, SMSRInOut * Commands, int Num); // do commands on first thread's processor
+    enum {MAXSETUP = 256};                   // maximum number of setup commands
+    SMSRInOut SetupCommands[MAXSETUP];       // commands for Start
+    SMSRInOut CleanupCommands[MAXSETUP];     // commands for Stop
+    int NumSetup, NumCleanup;                // number of commands
+    EUncoreScheme Scheme;                    // uncore scheme of this processor
+    int NumCounters;                         // number of uncore counters defined
+    const char * Names[MAXUNCORE];           // name of each counter
+    EUncoreBox Boxes[MAXUNCORE];             // kind of box of each counter
+    int CounterNum[MAXUNCORE];               // number of each counter in its box
+    int64 Config[MAXUNCORE];                 // event select value of each counter, without enable bit
+    int NumBoxes[MAXUNCORE];                 // number of boxes counting for each counter
+    int StartIndex[MAXUNCORE];               // index of first value read before each repetition
+    int StopIndex[MAXUNCORE];                // index of first value read after each repetition
+    int Used[NUM_UNCORE_BOXES];              // number of counters used in each kind of box
+    int NumCBoxes;                           // number of Intel L3 slices
+    int Bits;                                // width of counters
+};
+
+
+// class CEnergy reads the RAPL energy counters (package, cores, DRAM) before and
+// after each repetition, and the time stamp counter with them for the average power.
+// The counters are updated about every millisecond, so repetitions must be much
+// longer than that for precise results
+class CEnergy {
+public:
+    CEnergy();                               // constructor
+    const char * Setup(CRepetitionQueues & Queues); // put reads in queues. return error message
+    void Start(CMSRDriver & Driver);         // read energy unit, before the test threads start
+    void Stop();                             // after the test threads stop
+    int  Columns() {return NumDomains ? NumDomains + 1 : 0;} // number of output columns
+    const char * Name(int Column);           // heading of output column
+    double Value(int Thread, int Repetition, int Column, CRepetitionQueues & Queues); // mJ or W in repetition
+protected:
+    double Joules(int Thread, int Repetition, int Domain, CRepetitionQueues & Queues); // energy of domain
+    enum {MAXDOMAINS = 3};
+    int NumDomains;                          // number of energy domains read
+    const char * Names[MAXDOMAINS];          // column heading of each domain
+    unsigned int Registers[MAXDOMAINS];      // energy status MSR of each domain
+    bool FixedUnit[MAXDOMAINS];              // domain counts in units of 15.3 uJ (server DRAM)
+    int StartIndex[MAXDOMAINS];              // index of value read before each repetition
+    int StopIndex[MAXDOMAINS];               // index of value read after each repetition
+    int TscStartIndex, TscStopIndex;         // index of time stamp counter values
+    unsigned int UnitRegister;               // power unit MSR
+    double Unit;                             // joules per count
+    int64 StartTsc, StartNanoTime;           // time at Start, for the time stamp counter frequency
+    double TscHz;                            // time stamp counter frequency
+};
+
+
+// class CLastBranchRecords captures the last branch records (LBR) of the test code.
+// The start commands clear and enable LBR, the stop commands disable it and read
+// the records, so nothing is lost between repetitions.
+class CLastBranchRecords {
+public:
+    CLastBranchRecords();                    // constructor
+    const char * Setup(EProcFamily Family, CRepetitionQueues & Queues); // put commands in queues. return error message
+    int  Save(const char * FileName, CRepetitionQueues & Queues); // write records of the test code to a CSV file
+protected:
+    enum ELBRFormat {
+        LBR_NONE   = 0,                      // not supported
+        LBR_FLAGS  = 1,                      // legacy LBR, mispredict flag in bit 63 of FROM (Haswell, Broadwell)
+        LBR_INFO   = 2,                      // legacy LBR with LBR_INFO registers (Skylake and later)
+        LBR_ARCH   = 3                       // architectural LBR (Alder Lake, Sapphire Rapids and later)
+    };
+    ELBRFormat Format;
+    int Depth;                               // number of records in LBR stack
+    int FirstValue;                          // index of first value read by stop commands
+};
+
+
+// class CCodePlacement copies pieces of test code to fixed virtual addresses, so that
+// branches can be put at addresses far from the test program, e.g. to find which
+// address bits the branch target buffer uses. Each piece is a flat binary assembled
+// for its address. The list file has a line with address (hex) and file name for each.
+// Pieces are numbered in the order of the list.
+class CCodePlacement {
+public:
+    enum {TEST_CODE = -1, OTHER_CODE = -2};  // pieces of Locate that aren't placed
+    CCodePlacement();                        // constructor
+    ~CCodePlacement();                       // destructor
+    const char * Load(const char * ListFile);// place all pieces in list. return error message
+    int  Locate(int64 Address, int64 & Offset); // piece that Address is in, and offset into it
+protected:
+    const char * Place(uint64 Address, const char * FileName); // place one piece. return error message
+    bool IsMapped(uint64 Page);              // page has been mapped by Place
+    uint64 * Pages;                          // addresses of mapped pages
+    int NumPages, MaxPages;
+    struct SPiece {uint64 Address, Size;};
+    SPiece * Pieces;                         // placed pieces, in the order of the list
+    int NumPieces, MaxPieces;
+    int PageSize;
+    char Message[1200];                      // error message with address or file name
+};
+
+
+// class CMetrics evaluates metrics derived from the other columns in each repetition, e.g.
+// "IPC = Instruct / Core cyc" or "MPKI = 1000 * L1D Miss / Instruct", as extra columns.
+// They are read from metrics.txt, one "Name = expression" per line. Expressions have
+// numbers, column names, earlier metrics, Iterations (InnerIterations), + - * / and
+// parentheses. Names may contain spaces; the longest name that matches is used.
+// Division by zero gives 0. RatioOut and TempOut (PMCTestB64.nasm) are metrics too
+class CMetrics {
+public:
+    CMetrics();                              // constructor
+    const char * Load(const char * FileName, int Columns); // read metrics, after Columns columns. return error message
+    const char * Define(const char * Name, const char * Expression); // define one metric. return error message
+    int  Columns() {return NumMetrics;}      // number of output columns
+    const char * Name(int Column) {return Names[Column];} // heading of output column
+    int  IsFraction(int Column) {return Fraction[Column];} // 0 if values are integers
+    bool IsHex(int Column);                  // TempOut column printed in hexadecimal
+    double Value(int Row, int Column);       // value in one row of results
+protected:
+    enum EOp {OP_NUMBER, OP_COLUMN, OP_ITERATIONS, OP_TEMP, OP_NEG, OP_ADD, OP_SUB, OP_MUL, OP_DIV};
+    struct SOp {
+        EOp    Op;
+        int    Column;                       // column of OP_COLUMN, type of OP_TEMP (TempOut)
+        double Number;                       // value of OP_NUMBER
+    };
+    enum {MAXMETRICS = 16, MAXOPS = 64, NAMELEN = 64};
+    const char * Put(EOp Op, int Column = 0, double Number = 0); // add operation to program. return error message
+    const char * ParseSum(const char * & p); // compile expression at p. return error message
+    const char * ParseProduct(const char * & p);
+    const char * ParseFactor(const char * & p);
+    int  MatchName(const char * p, int & Column); // length of longest column name at p, 0 if none
+    double TempValue(int Thread, int Repetition, int Type); // value that the test code left in CountTemp
+    int NumColumns;                          // columns before the metrics
+    int NumMetrics;                          // number of metrics defined
+    char Names[MAXMETRICS][NAMELEN];         // name of each metric
+    int Fraction[MAXMETRICS];                // metric is a fraction rather than an integer
+    SOp Program[MAXMETRICS][MAXOPS];         // operations of each metric in reverse polish order
+    int NumOps[MAXMETRICS];                  // number of operations of each metric
+    char Message[1200];                      // error message with expression
+};
+
+
+// class CKernelRun runs the test code in the driver instead of TestLoop, if KernelMode.
+// kernel.bin is the test loop assembled from PMCTestK64.nasm as a flat binary, which is built
+// into the code of the MSRrun module. The driver runs it on the thread's processor with preemption
+// and interrupts disabled (KERNEL_RUN), if it is the same as the loaded module's code. The counts
+// come back in the SKernelRun structure
+class CKernelRun {
+public:
+    CKernelRun();                            // constructor
+    ~CKernelRun();                           // destructor
+    const char * Load(const char * FileName);// read test code. return error message
+    int  Run(int Thread, CMSRDriver & Driver); // run test code, and put counts in ThreadData. return repetitions done
+protected:
+    SKernelRun * Params;                     // test code and results, shared with driver
+    char * Code;                             // test code
+    char Message[1200];                      // error message with file name
 };
 
 
@@ -163,6 +475,26 @@ extern "C" {
 }
 
 
+//////////////////////////////////////////////////////////////////////////////
+//    Running tests without the main program, for libpmctest.so
+//////////////////////////////////////////////////////////////////////////////
+
+extern "C" {
+
+    int  PMCTestSetup(const char * Directory); // set up counters and driver. Directory has placement.txt. return error code
+    int  PMCTestRun();                      // run test code in all threads. may be repeated. return error code
+    int  PMCTestColumns();                  // number of result columns
+    const char * PMCTestColumnName(int Column); // column heading
+    int  PMCTestColumnIsFraction(int Column); // 1 if column is a fraction (top-down), 0 if a count
+    int  PMCTestRows();                     // number of result rows: repetitions of all threads
+    double PMCTestValue(int Row, int Column); // one result
+    void PMCTestValues(double * Values);    // all results, PMCTestRows() * PMCTestColumns(), row by row
+    int  PMCTestInnerIterations();          // iterations of test code in each repetition
+    int  PMCTestProcessor(int Thread);      // processor number of thread
+
+}
+
+
 //////////////////////////////////////////////////////////////////////////////
 //    Global variables imported from PMCTestBxx module
 //////////////////////////////////////////////////////////////////////////////
@@ -170,13 +502,41 @@ extern "C" {
 extern "C" {
 
     extern SCounterDefinition CounterDefinitions[];
+    extern SUncoreDefinition UncoreDefinitions[];
 
     extern int NumThreads;                  // number of threads
+    extern int CoreTypeDesired;             // run only on this core type on hybrid processors (ECoreType)
+    extern int ProcessorList[];             // processor of each thread chosen by the test, -1 if not chosen
+    extern int NumRepetitions;              // number of repetitions of test code
+    extern int InnerIterations;             // iterations of test code in each repetition, 0 = calibrate
+    extern int TargetClocks;                // clock count of each repetition to calibrate InnerIterations for
+
+    extern int UseLBR;                      // 1 if last branch records are captured
+    extern int TopDown;                     // 1 if top-down analysis
+    extern int CheckInterrupts;             // 1 if hardware interrupts are counted, 3 if SMIs too, +4 to warn
+    extern int SampleInterval;              // microseconds between counter samples, 0 = no sampling
+    extern int PmiPeriod;                   // events between instruction pointer samples, 0 = no sampling
+    extern int PmiCounterType;              // counter to sample instruction pointer on overflow of
+    extern int UseEnergy;                   // 1 if RAPL energy is read before and after each repetition
+    extern int KernelMode;                  // 1 if the test code runs in the driver (CKernelRun)
+    extern volatile int ThreadsDone;        // number of threads that have finished TestLoop
+    extern volatile int ThreadsInitialized; // number of threads that have done their initializations in TestLoop
+    extern int ThreadsRunning;              // number of threads running TestLoop together
+
+    // driver queues for each repetition, made by CRepetitionQueues
+    extern void * RepQueues;                // address of first queue
+    extern int RepQueueSize;                // size of each queue (bytes)
+    extern int RepStartQueues;              // number of queues before each repetition
+    extern int RepStopQueues;               // number of queues after each repetition
+    extern int DriverHandle;                // file handle of driver, for driver calls from TestLoop
+    extern char TestCodeStart[];            // address range of test code
+    extern char TestCodeEnd[];
     // performance counters used
     extern int NumCounters;                // Number of PMC counters defined Counters[]
     extern int MaxNumCounters;             // Maximum number of PMC counters
     extern int UsePMC;                     // 0 if no PMC counters used
     extern int CounterTypesDesired[MAXCOUNTERS];// list of desired counter types
+    extern int UncoreTypesDesired[MAXUNCORE];   // list of desired uncore counter types, 0 if unused
     extern int EventRegistersUsed[MAXCOUNTERS]; // index of counter registers used
     extern int Counters[MAXCOUNTERS];      // PMC register numbers
 
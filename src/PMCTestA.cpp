@@ -16,6 +16,9 @@
 
 #include "PMCTest.h"
 #include "CPUDetection.h"
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 
 
 //////////////////////////////////////////////////////////////////////
@@ -37,201 +40,1753 @@ volatile USync TSync = {0};
 // processornumber for each thread
 int ProcNum[MAXTHREADS] = {0};
 
+// core type of the processor for each thread (hybrid processors only)
+int ProcCoreType[MAXTHREADS] = {0};
+
 // number of repetitions in each thread
 int repetitions;
 
+// Driver queues for each repetition of test code
+CRepetitionQueues RepetitionQueues;
+
 // Create CCounters instance
 CCounters MSRCounters;
 
+// Test code at fixed addresses
+CCodePlacement CodePlacement;
+
+// Test code run in the driver, if KernelMode
+CKernelRun KernelRun;
+
+// Last branch records, if UseLBR
+CLastBranchRecords LBR;
+
+// Counter samples during the test, if SampleInterval
+CSampler Sampler;
+
+// Instruction pointer samples on counter overflow, if PmiPeriod
+CPmiSamples PmiSamples;
+
+// Counters outside the cores, if UncoreTypesDesired
+CUncoreCounters Uncore;
+
+// RAPL energy counters, if UseEnergy
+CEnergy Energy;
+
+// Metrics derived from the other columns, from metrics.txt, RatioOut and TempOut
+CMetrics Metrics;
+
+
+//////////////////////////////////////////////////////////////////////
+//
+//        Calibration of the number of iterations of the test code
+//
+//////////////////////////////////////////////////////////////////////
+
+// Run the test code of a thread: in TestLoop, or in the driver if KernelMode
+// (return value is number of repetitions done)
+static int RunTestLoop(int thread) {
+    if (KernelMode) return KernelRun.Run(thread, MSRCounters.msr);
+    return TestLoop(thread);
+}
+
+// Find the number of iterations of the test code that makes each repetition take
+// about TargetClocks clock cycles, so that the overhead of reading the counters is small.
+// Runs the test loop with increasing numbers of iterations until the clock count is
+// large enough to scale from, and sets InnerIterations
+void CalibrateInnerIterations(int thread) {
+    int ClockOS = thread * (ThreadDataSize / sizeof(int)) + ClockResultsOS / sizeof(int);
+    InnerIterations = 1;
+    for (;;) {
+        int reps = RunTestLoop(thread);
+        if (reps < 1) return;
+        // the minimum is the least disturbed repetition
+        int clocks = PThreadData[ClockOS];
+        for (int r = 1; r < reps; r++) {
+            if (PThreadData[ClockOS + r] < clocks) clocks = PThreadData[ClockOS + r];
+        }
+        if (clocks >= TargetClocks / 8 || InnerIterations >= MAX_INNER_ITERATIONS) {
+            int64 n = (int64)InnerIterations * TargetClocks / (clocks > 0 ? clocks : 1);
+            if (n < 1) n = 1;
+            if (n > MAX_INNER_ITERATIONS) n = MAX_INNER_ITERATIONS;
+            InnerIterations = (int)n;
+            return;
+        }
+        InnerIterations *= 8;
+        if (InnerIterations > MAX_INNER_ITERATIONS) InnerIterations = MAX_INNER_ITERATIONS;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////
+//
+//        Thread procedure
+//
+//////////////////////////////////////////////////////////////////////
+
+ThreadProcedureDeclaration(ThreadProc1) {
+    //DWORD WINAPI ThreadProc1(LPVOID parm) {
+    // check thread number
+    unsigned int threadnum = *(unsigned int*)parm;
+
+    if (threadnum >= (unsigned int)NumThreads) {
+        printf("\nThread number out of range %i", threadnum);
+        return NULL;
+    }
+
+    // get desired processornumber
+    int ProcessorNumber = ProcNum[threadnum];
+
+    // Lock process to this processor number
+    SyS::SetProcessMask(ProcessorNumber);
+
+    // Start MSR counters
+    MSRCounters.StartCounters(threadnum);
+
+    // The first thread finds the number of iterations before the other threads start
+    if (threadnum == 0 && InnerIterations == 0) {
+        // This thread runs the calibration alone. The other threads wait below
+        ThreadsRunning = 1;
+        CalibrateInnerIterations(threadnum);
+        ThreadsRunning = NumThreads;
+        ThreadsDone = ThreadsInitialized = 0;
+    }
+
+    // Wait for rest of timeslice
+    SyS::Sleep0();
+
+    // wait for other threads
+    // Initialize synchronizer
+    USync WaitTo;
+    WaitTo.allflags = 0;
+    for (int t = 0; t < NumThreads; t++) WaitTo.flag[t] = 1;
+    // flag for this thead ready
+    TSync.flag[threadnum] = 1;
+    // wait for other threads to be ready
+    while (TSync.allflags != WaitTo.allflags) {} // Note: will wait forever if a thread is not created
+
+    // Run the test code
+    repetitions = RunTestLoop(threadnum);
+
+    // Wait for rest of timeslice
+    SyS::Sleep0();
+
+    // Start MSR counters
+    MSRCounters.StopCounters(threadnum);
+
+    return NULL;
+};
+
+
+// Make the name of a file in the directory of the executable
+static void ProgramDirectoryFile(char * Name, int Size, const char * Program, const char * FileName) {
+    const char * slash = strrchr(Program, '/');
+    int dirlen = slash ? int(slash - Program) + 1 : 0;
+    snprintf(Name, Size, "%.*s%s", dirlen, Program, FileName);
+}
+
+
+//////////////////////////////////////////////////////////////////////
+//
+//        Setting up and running the test
+//
+//////////////////////////////////////////////////////////////////////
+
+// Test runs on a hybrid processor. Results then have a CoreType column
+static bool Hybrid = false;
+
+// Directory for placement.txt and the files of results (lbr.csv etc.), with trailing '/'
+static char FileDirectory[1024];
+
+static int BaseColumns();
+
+// Choose processors, define counters and load driver. Call once before PMCTestRun
+// (return value is error code)
+int PMCTestSetup(const char * Directory) {
+    int i;                              // loop counter
+    int t;                              // thread counter
+    int e;                              // error number
+    int procthreads;                    // number of threads supported by processor
+    int p;                              // processor number
+    const char * err;                   // error message
+
+    snprintf(FileDirectory, sizeof(FileDirectory), "%s", Directory);
+
+    // Limit number of threads
+    if (NumThreads > MAXTHREADS) {
+        NumThreads = MAXTHREADS;
+        printf("\nToo many threads");
+    }
+    if (NumThreads < 1) NumThreads = 1;
+
+    // Get mask of possible CPU cores
+    SyS::ProcMaskType ProcessAffMask = SyS::GetProcessMask();
+    // Count possible threads
+    for (procthreads = i = 0; i < MAXTHREADS; i++) {
+        if (SyS::TestProcessMask(i, &ProcessAffMask)) procthreads++;
+    }
+
+    CPUDetection cpuDetect;
+    Hybrid = cpuDetect.IsHybrid();
+
+    if (ProcessorList[0] >= 0) {
+        // Processors chosen by the test, e.g. from the processor topology
+        for (t = 0; t < NumThreads; t++) {
+            ProcNum[t] = ProcessorList[t];
+            if (ProcNum[t] < 0 || !SyS::TestProcessMask(ProcNum[t], &ProcessAffMask)) {
+                printf("\nProcessor %i for thread %i not available\n", ProcNum[t], t);
+                return 1;
+            }
+        }
+    }
+    else if (CoreTypeDesired != CORE_ANY && Hybrid) {
+        // Use only processors of the desired core type.
+        // Lock to each available processor in turn to find its core type
+        int nproc = SyS::NumProcessors();
+        for (t = 0, p = 0; p < nproc && t < NumThreads; p++) {
+            if (!SyS::TestProcessMask(p, &ProcessAffMask)) continue;
+            SyS::SetProcessMask(p);
+            if (CPUDetection::CurrentCoreType() == CoreTypeDesired) ProcNum[t++] = p;
+        }
+        if (t < NumThreads) {
+            printf("\nOnly %i processors of core type 0x%X available\n", t, CoreTypeDesired);
+            return 1;
+        }
+    }
+    else {
+        // Fix a processornumber for each thread
+        for (t = 0, i = NumThreads-1; t < NumThreads; t++, i--) {
+            // make processornumbers different, and last thread = MainThreadProcNum:
+            // ProcNum[t] = MainThreadProcNum ^ i;
+            if (procthreads < 4) {        
+                ProcNum[t] = i;
+            }
+            else {        
+                ProcNum[t] = (i % 2) * (procthreads/2) + i / 2;
+            }
+            if (!SyS::TestProcessMask(ProcNum[t], &ProcessAffMask)) {
+                // this processor core is not available
+                printf("\nProcessor %i not available. Processors available:\n", ProcNum[t]);
+                for (p = 0; p < MAXTHREADS; p++) {
+                    if (SyS::TestProcessMask(p, &ProcessAffMask)) printf("%i  ", p);
+                }
+                printf("\n");
+                return 1;
+            }
+        }
+    }
+
+    if (Hybrid) {
+        // Find the core type of each thread's processor
+        for (t = 0; t < NumThreads; t++) {
+            SyS::SetProcessMask(ProcNum[t]);
+            ProcCoreType[t] = CPUDetection::CurrentCoreType();
+        }
+        for (t = 1; t < NumThreads; t++) {
+            if (ProcCoreType[t] != ProcCoreType[0]) {
+                fprintf(stderr, "\nWarning: threads run on different core types. "
+                    "Counters are defined for the core type of thread 0\n");
+                break;
+            }
+        }
+        // Counter definitions depend on the core type. Detect it on the first thread's processor
+        SyS::SetProcessMask(ProcNum[0]);
+    }
+
+    // Make program and driver use the same processor number
+    MSRCounters.LockProcessor();
+
+    // Find counter defitions and put them in queue for driver
+    MSRCounters.QueueCounters();
+    if (TopDown && !MSRCounters.TopDownColumns()) return 1;
+
+    // Install and load driver
+    e = MSRCounters.StartDriver();
+    if (e) return e;
+    DriverHandle = MSRCounters.msr.GetDriverHandle();
+
+    // Uncore counters, read before and after each repetition
+    if (UsePMC && UncoreTypesDesired[0]) Uncore.FindBoxes(MSRCounters.msr);
+    for (i = 0; UsePMC && i < MAXUNCORE && UncoreTypesDesired[i]; i++) {
+        err = Uncore.Define(UncoreTypesDesired[i]);
+        if (err) {
+            printf("\nCannot make uncore counter %i. %s\n", UncoreTypesDesired[i], err);
+        }
+    }
+    err = Uncore.Queue(RepetitionQueues);
+    if (err) {
+        printf("\nCannot read uncore counters. %s\n", err);
+        return 1;
+    }
+
+    // Energy counters, read before and after each repetition
+    if (UseEnergy) {
+        err = Energy.Setup(RepetitionQueues);
+        if (err) {
+            printf("\nCannot measure energy. %s\n", err);
+            return 1;
+        }
+    }
+
+    if (PmiPeriod && MSRCounters.PmiIndex < 0) {
+        printf("\nCannot sample instruction pointer on counter %i\n", PmiCounterType);
+        return 1;
+    }
+
+    // Make driver queues for last branch records
+    if (UseLBR) {
+        err = LBR.Setup(CPUDetection().GetFamily(), RepetitionQueues);
+        if (err) {
+            printf("\nCannot capture last branch records. %s\n", err);
+            return 1;
+        }
+    }
+    RepetitionQueues.Build(NumThreads, NumRepetitions);
+
+    // Copy test code to the addresses listed in placement.txt
+    char PlacementFile[1100];
+    snprintf(PlacementFile, sizeof(PlacementFile), "%splacement.txt", FileDirectory);
+    err = CodePlacement.Load(PlacementFile);
+    if (err) {
+        printf("\nCannot place test code. %s\n", err);
+        return 1;
+    }
+
+    // Read the test code to run in the driver
+    if (KernelMode) {
+        if (NumThreads > 1 || RepStartQueues || RepStopQueues || TopDown || CheckInterrupts || SampleInterval) {
+            printf("\nTest code in the driver runs in one thread, without last branch records, "
+                "top-down analysis, interrupt checks, uncore counters, energy or sampling\n");
+            return 1;
+        }
+        if (NumRepetitions > MAX_KERNEL_REPETITIONS) {
+            printf("\nTest code in the driver can have at most %i repetitions\n", MAX_KERNEL_REPETITIONS);
+            return 1;
+        }
+        char KernelFile[1100];
+        snprintf(KernelFile, sizeof(KernelFile), "%skernel.bin", FileDirectory);
+        err = KernelRun.Load(KernelFile);
+        if (err) {
+            printf("\nCannot run test code in the driver. %s\n", err);
+            return 1;
+        }
+    }
+
+    // Helper thread for sampling the counters during the test
+    if (SampleInterval) {
+        err = Sampler.Setup(SampleInterval, MSRCounters);
+        if (err) {
+            printf("\nCannot sample counters. %s\n", err);
+            return 1;
+        }
+    }
+
+    // Metrics of the columns, now that all columns are known
+    char MetricsFile[1100];
+    snprintf(MetricsFile, sizeof(MetricsFile), "%smetrics.txt", FileDirectory);
+    err = Metrics.Load(MetricsFile, BaseColumns());
+    if (err) {
+        printf("\nCannot define metric. %s\n", err);
+        return 1;
+    }
+    return 0;
+}
+
+// Run the test code in all threads. May be called repeatedly after PMCTestSetup
+// (return value is error code)
+int PMCTestRun() {
+    // Threads wait for each other again
+    TSync.allflags = 0;
+    ThreadsDone = ThreadsInitialized = 0;
+
+    // Set high priority to minimize risk of interrupts during test
+    SyS::SetProcessPriorityHigh();
+
+    // Start sampling before the test threads, as the last test thread is this thread
+    Uncore.Start(MSRCounters.msr);
+    if (UseEnergy) Energy.Start(MSRCounters.msr);
+    if (SampleInterval) Sampler.Start();
+
+    // Make multiple threads
+    ThreadHandler Threads;
+    Threads.Start(NumThreads);
+
+    // Stop threads
+    Threads.Stop();
+    if (SampleInterval) Sampler.Stop();
+    if (UseEnergy) Energy.Stop();
+    Uncore.Stop(MSRCounters.msr);
+
+    // Set priority back normal
+    SyS::SetProcessPriorityNormal();
+
+    // Clean up
+    MSRCounters.CleanUp();
+
+    if (UseLBR) {
+        // Write last branch records to lbr.csv
+        char LBRFile[1100];
+        snprintf(LBRFile, sizeof(LBRFile), "%slbr.csv", FileDirectory);
+        if (LBR.Save(LBRFile, RepetitionQueues)) {
+            printf("\nCannot write file %s\n", LBRFile);
+            return 1;
+        }
+    }
+
+    if (PmiPeriod) {
+        // Write instruction pointer samples to pmi.csv
+        char PmiFile[1100];
+        snprintf(PmiFile, sizeof(PmiFile), "%spmi.csv", FileDirectory);
+        if (PmiSamples.Save(PmiFile, MSRCounters.msr)) {
+            printf("\nCannot write file %s\n", PmiFile);
+            return 1;
+        }
+    }
+
+    if (SampleInterval) {
+        // Write counter samples to samples.csv
+        char SampleFile[1100];
+        snprintf(SampleFile, sizeof(SampleFile), "%ssamples.csv", FileDirectory);
+        if (Sampler.Save(SampleFile)) {
+            printf("\nCannot write file %s\n", SampleFile);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////
+//
+//        Results of the test
+//
+//////////////////////////////////////////////////////////////////////
+
+// Results have one row for each repetition of each thread, with these columns:
+// Thread and Processor (if more than one thread), CoreType (hybrid processors), Clock,
+// the counters, the top-down fractions, the uncore counters, energy, SMI (if counted)
+// and the metrics
+static int FirstCounterColumn() {
+    return (NumThreads > 1) * 2 + Hybrid + 1;
+}
+
+// Columns before the metrics
+static int BaseColumns() {
+    return FirstCounterColumn() + (UsePMC ? NumCounters : 0) + MSRCounters.TopDownColumns()
+        + Uncore.Columns() + Energy.Columns() + MSRCounters.HasSMICount();
+}
+
+int PMCTestColumns() {
+    return BaseColumns() + Metrics.Columns();
+}
+
+const char * PMCTestColumnName(int Column) {
+    if (Column >= BaseColumns()) return Metrics.Name(Column - BaseColumns());
+    if (NumThreads > 1 && Column-- == 0) return "Thread";
+    if (NumThreads > 1 && Column-- == 0) return "Processor";
+    if (Hybrid && Column-- == 0) return "CoreType";
+    if (Column-- == 0) return "Clock";
+    if (UsePMC) {
+        if (Column < NumCounters) return MSRCounters.CounterNames[Column];
+        Column -= NumCounters;
+    }
+    if (Column < MSRCounters.TopDownColumns()) return MSRCounters.TopDownName(Column);
+    Column -= MSRCounters.TopDownColumns();
+    if (Column < Uncore.Columns()) return Uncore.Name(Column);
+    Column -= Uncore.Columns();
+    if (Column < Energy.Columns()) return Energy.Name(Column);
+    return "SMI";
+}
+
+// Column is a fraction rather than a count: top-down fractions, energy and most metrics
+int PMCTestColumnIsFraction(int Column) {
+    if (Column >= BaseColumns()) return Metrics.IsFraction(Column - BaseColumns());
+    int First = FirstCounterColumn() + (UsePMC ? NumCounters : 0);
+    if (Column >= First && Column < First + MSRCounters.TopDownColumns()) return 1;
+    First += MSRCounters.TopDownColumns() + Uncore.Columns();
+    return Column >= First && Column < First + Energy.Columns();
+}
+
+int PMCTestRows() {
+    return NumThreads * repetitions;
+}
+
+double PMCTestValue(int Row, int Column) {
+    int t = Row / repetitions, repi = Row % repetitions;
+    // offsets into ThreadData[]
+    int TOffset = t * (ThreadDataSize / sizeof(int));
+    int ClockOS = ClockResultsOS / sizeof(int);
+    int PMCOS   = PMCResultsOS / sizeof(int);
+
+    if (Column >= BaseColumns()) return Metrics.Value(Row, Column - BaseColumns());
+    if (NumThreads > 1 && Column-- == 0) return t;
+    if (NumThreads > 1 && Column-- == 0) return ProcNum[t];
+    if (Hybrid && Column-- == 0) return ProcCoreType[t];
+    if (Column-- == 0) return PThreadData[repi+TOffset+ClockOS];
+    if (UsePMC) {
+        if (Column < NumCounters) return PThreadData[repi+Column*NumRepetitions+TOffset+PMCOS];
+        Column -= NumCounters;
+    }
+    if (Column < MSRCounters.TopDownColumns()) return MSRCounters.TopDownValue(t, repi, Column);
+    Column -= MSRCounters.TopDownColumns();
+    if (Column < Uncore.Columns()) return (double)Uncore.Value(t, repi, Column, RepetitionQueues);
+    Column -= Uncore.Columns();
+    if (Column < Energy.Columns()) return Energy.Value(t, repi, Column, RepetitionQueues);
+    return MSRCounters.SMICount(t, repi);
+}
+
+// All values, row by row
+void PMCTestValues(double * Values) {
+    int Columns = PMCTestColumns();
+    for (int r = 0; r < PMCTestRows(); r++) {
+        for (int c = 0; c < Columns; c++) Values[r * Columns + c] = PMCTestValue(r, c);
+    }
+}
+
+int PMCTestInnerIterations() {
+    return InnerIterations;
+}
+
+int PMCTestProcessor(int Thread) {
+    return ProcNum[Thread];
+}
+
+
+//////////////////////////////////////////////////////////////////////
+//
+//        Main
+//
+//////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[]) {
+    int t, r, c, e;
+
+    // Files are in the directory of the executable
+    char Directory[1024];
+    ProgramDirectoryFile(Directory, sizeof(Directory), argv[0], "");
+    e = PMCTestSetup(Directory);
+    if (!e) e = PMCTestRun();
+    if (e) return e;
+
+    // Report the number of iterations used. Counts are for all iterations of each repetition
+    printf("# InnerIterations: %i\n", PMCTestInnerIterations());
+    printf("# Processors: ");
+    for (t = 0; t < NumThreads; t++) printf(t ? ",%i" : "%i", PMCTestProcessor(t));
+    printf("\n");
+
+    // print column headings
+    int Columns = PMCTestColumns();
+    for (c = 0; c < Columns; c++) printf(c ? ",%s" : "%s", PMCTestColumnName(c));
+    printf("\n");
+
+    // Print results
+    for (r = 0; r < PMCTestRows(); r++) {
+        for (c = 0; c < Columns; c++) {
+            if (c) printf(",");
+            if (PMCTestColumnIsFraction(c)) printf("%.4f", PMCTestValue(r, c));
+            else if (c >= BaseColumns() && Metrics.IsHex(c - BaseColumns())) {
+                printf("0x%llX", (long long)PMCTestValue(r, c));
+            }
+            else printf("%lli", (long long)PMCTestValue(r, c));
+        }
+        printf("\n");
+    }
+
+    // Exit
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//        CMSRInOutQue class member functions
+//
+//////////////////////////////////////////////////////////////////////////////
+
+// Constructor
+CMSRInOutQue::CMSRInOutQue() {
+    n = 0;
+    for (int i = 0; i < MAX_QUE_ENTRIES+1; i++) {
+        queue[i].msr_command = MSR_STOP;
+    }
+}
+
+// Put data record in queue
+int CMSRInOutQue::put (EMSR_COMMAND msr_command, unsigned int register_number,
+                       unsigned int value_lo, unsigned int value_hi) {
+
+                           if (n >= MAX_QUE_ENTRIES) return -10;
+
+                           queue[n].msr_command = msr_command;
+                           queue[n].register_number = register_number;
+                           queue[n].val[0] = value_lo;
+                           queue[n].val[1] = value_hi;
+                           n++;
+                           return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//        CRepetitionQueues class member functions
+//
+//////////////////////////////////////////////////////////////////////////////
+
+// Leave room for MSR_STOP at the end of each queue
+const int REP_QUE_ENTRIES = MAX_QUE_ENTRIES - 2;
+
+// Constructor
+CRepetitionQueues::CRepetitionQueues() {
+    NumStart = NumStop = StartQueues = StopQueues = Repetitions = 0;
+    Queues = 0;
+}
+
+// Destructor
+CRepetitionQueues::~CRepetitionQueues() {
+    delete[] Queues;
+}
+
+// Put command to do before each repetition
+int CRepetitionQueues::PutStart(EMSR_COMMAND msr_command, unsigned int register_number, int64 value) {
+    if (NumStart >= MAXCOMMANDS) return -10;
+    StartCommands[NumStart].msr_command = msr_command;
+    StartCommands[NumStart].register_number = register_number;
+    StartCommands[NumStart].value = value;
+    return NumStart++;
+}
+
+// Put command to do after each repetition
+int CRepetitionQueues::PutStop(EMSR_COMMAND msr_command, unsigned int register_number, int64 value) {
+    if (NumStop >= MAXCOMMANDS) return -10;
+    StopCommands[NumStop].msr_command = msr_command;
+    StopCommands[NumStop].register_number = register_number;
+    StopCommands[NumStop].value = value;
+    return NumStop++;
+}
+
+// Make queues for all threads and repetitions and tell TestLoop where they are
+void CRepetitionQueues::Build(int Threads, int Reps) {
+    int t, r, i;
+    StartQueues = (NumStart + REP_QUE_ENTRIES - 1) / REP_QUE_ENTRIES;
+    StopQueues  = (NumStop  + REP_QUE_ENTRIES - 1) / REP_QUE_ENTRIES;
+    Repetitions = Reps;
+    if (StartQueues + StopQueues == 0) return;
+    Queues = new CMSRInOutQue[Threads * Repetitions * (StartQueues + StopQueues)];
+
+    for (t = 0; t < Threads; t++) {
+        for (r = 0; r < Repetitions; r++) {
+            CMSRInOutQue * q = QueueSet(t, r);
+            for (i = 0; i < NumStart; i++) {
+                q[i / REP_QUE_ENTRIES].put(StartCommands[i].msr_command, StartCommands[i].register_number,
+                    StartCommands[i].val[0], StartCommands[i].val[1]);
+            }
+            q += StartQueues;
+            for (i = 0; i < NumStop; i++) {
+                q[i / REP_QUE_ENTRIES].put(StopCommands[i].msr_command, StopCommands[i].register_number,
+                    StopCommands[i].val[0], StopCommands[i].val[1]);
+            }
+        }
+    }
+
+    RepQueues = Queues[0].queue;
+    RepQueueSize = int((char*)&Queues[1] - (char*)&Queues[0]);
+    RepStartQueues = StartQueues;
+    RepStopQueues = StopQueues;
+}
+
+// Get value read by stop command number Index after repetition
+int64 CRepetitionQueues::Value(int Thread, int Repetition, int Index) {
+    CMSRInOutQue * q = QueueSet(Thread, Repetition) + StartQueues + Index / REP_QUE_ENTRIES;
+    return q->queue[Index % REP_QUE_ENTRIES].value;
+}
+
+// Get value read by start command number Index before repetition
+int64 CRepetitionQueues::StartValue(int Thread, int Repetition, int Index) {
+    CMSRInOutQue * q = QueueSet(Thread, Repetition) + Index / REP_QUE_ENTRIES;
+    return q->queue[Index % REP_QUE_ENTRIES].value;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//        CLastBranchRecords class member functions
+//
+//////////////////////////////////////////////////////////////////////////////
+
+// Constructor
+CLastBranchRecords::CLastBranchRecords() {
+    Format = LBR_NONE;
+    Depth = FirstValue = 0;
+}
+
+// Find LBR format and put commands in queues
+// (return value is error message)
+const char * CLastBranchRecords::Setup(EProcFamily Family, CRepetitionQueues & Queues) {
+    int CpuIdOutput[4], i;
+
+    Cpuid(CpuIdOutput, 0);
+    if (CpuIdOutput[0] >= 0x1C) {
+        Cpuid(CpuIdOutput, 7);
+        if (CpuIdOutput[3] & (1 << 19)) {
+            // Architectural LBR. Use the biggest depth supported
+            Cpuid(CpuIdOutput, 0x1C);
+            for (i = 0; i < 8; i++) {
+                if (CpuIdOutput[0] & (1 << i)) Depth = 8 * (i + 1);
+            }
+            if (Depth) Format = LBR_ARCH;
+        }
+    }
+    if (Format == LBR_NONE) {
+        // Legacy LBR. Only enable it on known processors. A wrong MSR number will crash the driver
+        switch (Family) {
+        case INTEL_HASW: case INTEL_BROADWELL:
+            Format = LBR_FLAGS;  Depth = 16;
+            break;
+        case INTEL_SKYLAKE: case INTEL_KABYLAKE: case INTEL_ICELAKE: case INTEL_TIGERLAKE:
+            Format = LBR_INFO;  Depth = 32;
+            break;
+        default:
+            return "Not supported for this microprocessor family";
+        }
+    }
+
+    if (Format == LBR_ARCH) {
+        // Start: writing IA32_LBR_DEPTH clears the records.
+        // IA32_LBR_CTL: enable, user mode only, all near branch types
+        Queues.PutStart(MSR_WRITE, 0x14CF, Depth);
+        Queues.PutStart(MSR_WRITE, 0x14CE, 0x3F0005);
+        // Stop: disable, then read FROM, TO and INFO. Record 0 is the newest
+        Queues.PutStop(MSR_WRITE, 0x14CE, 0);
+        FirstValue = Queues.PutStop(MSR_READ, 0x1500);
+        Queues.PutStop(MSR_READ, 0x1600);
+        Queues.PutStop(MSR_READ, 0x1200);
+        for (i = 1; i < Depth; i++) {
+            Queues.PutStop(MSR_READ, 0x1500 + i);
+            Queues.PutStop(MSR_READ, 0x1600 + i);
+            Queues.PutStop(MSR_READ, 0x1200 + i);
+        }
+    }
+    else {
+        // Start: clear FROM registers so that old records can be recognized.
+        // MSR_LBR_SELECT: suppress kernel mode and far branches. IA32_DEBUGCTL: enable LBR
+        for (i = 0; i < Depth; i++) Queues.PutStart(MSR_WRITE, 0x680 + i, 0);
+        Queues.PutStart(MSR_WRITE, 0x1C8, 0x101);
+        Queues.PutStart(MSR_WRITE, 0x1D9, 1);
+        // Stop: disable, then read top of stack index, FROM, TO and INFO
+        Queues.PutStop(MSR_WRITE, 0x1D9, 0);
+        FirstValue = Queues.PutStop(MSR_READ, 0x1C9);
+        for (i = 0; i < Depth; i++) {
+            Queues.PutStop(MSR_READ, 0x680 + i);
+            Queues.PutStop(MSR_READ, 0x6C0 + i);
+            if (Format == LBR_INFO) Queues.PutStop(MSR_READ, 0xDC0 + i);
+        }
+    }
+    return 0;
+}
+
+// Write the records that come from the test code or the placed code, oldest first.
+// Addresses are given as the piece of code (see CCodePlacement::Locate) and the offset
+// into it, or the address itself in other code. Cycles is -1 when not known.
+// (return value is nonzero on error)
+int CLastBranchRecords::Save(const char * FileName, CRepetitionQueues & Queues) {
+    FILE * f = fopen(FileName, "w");
+    if (!f) return 1;
+    fprintf(f, "Thread,Repetition,Record,FromPiece,From,ToPiece,To,Mispredicted,Cycles\n");
+
+    for (int t = 0; t < NumThreads; t++) {
+        for (int r = 0; r < NumRepetitions; r++) {
+            int v = FirstValue;
+            int tos = 0;
+            if (Format != LBR_ARCH) tos = int(Queues.Value(t, r, v++));
+            int stride = Format == LBR_FLAGS ? 2 : 3;
+
+            int record = 0;
+            for (int i = 0; i < Depth; i++) {
+                // Index of i'th oldest record
+                int e = Format == LBR_ARCH ? Depth - 1 - i : (tos + 1 + i) % Depth;
+                int64 From = Queues.Value(t, r, v + e * stride);
+                int64 To   = Queues.Value(t, r, v + e * stride + 1);
+                if (From == 0) continue;      // Cleared. Not used in this repetition
+                int mispredicted = 0, cycles = -1;
+                if (Format == LBR_FLAGS) {
+                    mispredicted = int((uint64)From >> 63);
+                }
+                else {
+                    int64 Info = Queues.Value(t, r, v + e * stride + 2);
+                    mispredicted = int((uint64)Info >> 63);
+                    if (Format == LBR_INFO || ((Info >> 60) & 1)) cycles = int(Info & 0xFFFF);
+                }
+                // Remove flags by sign extending from bit 47
+                From = (int64)((uint64)From << 16) >> 16;
+                To   = (int64)((uint64)To   << 16) >> 16;
+                int64 FromOffset, ToOffset;
+                int FromPiece = CodePlacement.Locate(From, FromOffset);
+                if (FromPiece == CCodePlacement::OTHER_CODE) continue;  // Not in test code
+                int ToPiece = CodePlacement.Locate(To, ToOffset);
+                fprintf(f, "%i,%i,%i,%i,%lli,%i,%lli,%i,%i\n", t, r, record++, FromPiece, FromOffset, ToPiece, ToOffset,
+                    mispredicted, cycles);
+            }
+        }
+    }
+    return fclose(f) != 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//        CSampler class member functions
+//
+//////////////////////////////////////////////////////////////////////////////
+
+// Constructor
+CSampler::CSampler() {
+    Driver = 0;
+    NumSampled = Interval = 0;
+    Processor = -1;
+    Samples = 0;
+    NumSamples = 0;
+    StopFlag = 0;
+}
+
+// Destructor
+CSampler::~CSampler() {
+    Stop();
+    if (Samples) delete[] Samples;
+}
+
+// Choose a processor for the helper thread and make the queue that reads the counters
+// (return value is error message)
+const char * CSampler::Setup(int Interval, CCounters & Counters) {
+    this->Interval = Interval;
+    Driver = &Counters.msr;
+
+    // The helper thread must not disturb any test thread
+    SyS::ProcMaskType ProcessAffMask = SyS::GetProcessMask();
+    int nproc = SyS::NumProcessors();
+    for (int p = 0; p < nproc && Processor < 0; p++) {
+        if (!SyS::TestProcessMask(p, &ProcessAffMask)) continue;
+        int t;
+        for (t = 0; t < NumThreads; t++) {
+            if (ProcNum[t] == p) break;
+        }
+        if (t == NumThreads) Processor = p;
+    }
+    if (Processor < 0) return "No processor left for sampling";
+
+    // Do the reads on the processor of the first thread
+    Queue.put(PROC_SET, 0, ProcNum[0]);
+    for (int i = 0; i < NumCounters; i++) {
+        if (!Counters.CounterMSR[i]) continue;
+        Queue.put(MSR_READ, Counters.CounterMSR[i], 0);
+        Names[NumSampled++] = Counters.CounterNames[i];
+    }
+    if (NumSampled == 0) return "No counters to sample";
+
+    Samples = new int64[MAXSAMPLES * (NumSampled + 1)];
+    return NULL;
+}
+
+// Start sampling in helper thread
+void CSampler::Start() {
+    NumSamples = 0;
+    StopFlag = 0;
+    Thread.Start(SamplerProc, this);
+}
+
+// Stop sampling and wait for helper thread
+void CSampler::Stop() {
+    StopFlag = 1;
+    Thread.Stop();
+}
+
+// Sampling loop of helper thread. Starts when the first thread has started its counters
+void CSampler::Run() {
+    SyS::SetProcessMask(Processor);
+    while (!TSync.flag[0]) {
+        if (StopFlag) return;
+    }
+    int64 Start = SyS::NanoTime();
+    int64 Next = Start;
+    while (!StopFlag) {
+        // Wait for next sample time. Spinning is more accurate than sleeping for short intervals
+        Next += Interval * (int64)1000;
+        while (SyS::NanoTime() < Next) {
+            if (StopFlag) return;
+        }
+        Queue.queue[0].value = ProcNum[0];
+        Driver->AccessRegisters(Queue);
+        if (Queue.queue[0].value == -1) {
+            printf("\nCannot read counters of processor %i\n", ProcNum[0]);
+            return;
+        }
+        int64 * Sample = Samples + (NumSamples % MAXSAMPLES) * (NumSampled + 1);
+        Sample[0] = SyS::NanoTime() - Start;
+        for (int i = 0; i < NumSampled; i++) Sample[i+1] = Queue.queue[i+1].value;
+        NumSamples++;
+    }
+}
+
+// Write samples, oldest first. Time is in nanoseconds from the first thread starting
+// its counters. Counts are since StartCounters, so the test code is in the differences
+// (return value is nonzero on error)
+int CSampler::Save(const char * FileName) {
+    FILE * f = fopen(FileName, "w");
+    if (!f) return 1;
+    fprintf(f, "Time");
+    for (int i = 0; i < NumSampled; i++) fprintf(f, ",%s", Names[i]);
+    fprintf(f, "\n");
+
+    int64 First = NumSamples > MAXSAMPLES ? NumSamples - MAXSAMPLES : 0;
+    for (int64 n = First; n < NumSamples; n++) {
+        int64 * Sample = Samples + (n % MAXSAMPLES) * (NumSampled + 1);
+        fprintf(f, "%lli", Sample[0]);
+        for (int i = 0; i < NumSampled; i++) fprintf(f, ",%lli", Sample[i+1]);
+        fprintf(f, "\n");
+    }
+    return fclose(f) != 0;
+}
+
+// Thread procedure of sampler helper thread
+ThreadProcedureDeclaration(SamplerProc) {
+    ((CSampler*)parm)->Run();
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//        CUncoreCounters class member functions
+//
+//////////////////////////////////////////////////////////////////////////////
+
+// Constructor
+CUncoreCounters::CUncoreCounters() {
+    Scheme = CPUDetection().GetUncoreScheme();
+    NumCounters = NumSetup = NumCleanup = 0;
+    for (int i = 0; i < NUM_UNCORE_BOXES; i++) Used[i] = 0;
+    Bits = Scheme == U_INTEL ? 44 : 48;
+    NumCBoxes = 0;
+}
+
+// Read the number of Intel L3 slices, before Define
+void CUncoreCounters::FindBoxes(CMSRDriver & Driver) {
+    if (Scheme != U_INTEL) return;
+    CMSRInOutQue Queue;
+    Queue.put(PROC_SET, 0, ProcNum[0]);
+    Queue.put(MSR_READ, 0x396, 0);           // MSR_UNC_CBO_CONFIG
+    Driver.AccessRegisters(Queue);
+    // Bits 3:0 give the number of C-boxes
+    NumCBoxes = int(Queue.queue[1].value & 0x0F);
+}
+
+// Event select and counter register of a counter in a box
+void CUncoreCounters::Registers(EUncoreBox Box, int BoxNum, int Counter, unsigned int & Ctl, unsigned int & Ctr) {
+    switch (Box) {
+    case BOX_CBO:                            // MSR_UNC_CBO_n_PERFEVTSELm, MSR_UNC_CBO_n_PERFCTRm
+        Ctl = 0x700 + 0x10 * BoxNum + Counter;
+        Ctr = 0x706 + 0x10 * BoxNum + Counter;
+        break;
+    case BOX_ARB:                            // MSR_UNC_ARB_PERFEVTSELm, MSR_UNC_ARB_PERFCTRm
+        Ctl = 0x3B2 + Counter;
+        Ctr = 0x3B0 + Counter;
+        break;
+    case BOX_UCLK:                           // MSR_UNC_PERF_FIXED_CTRL, MSR_UNC_PERF_FIXED_CTR
+        Ctl = 0x394;
+        Ctr = 0x395;
+        break;
+    case BOX_L3:                             // ChL3PmcCfg, ChL3Pmc
+        Ctl = 0xC0010230 + 2 * Counter;
+        Ctr = 0xC0010231 + 2 * Counter;
+        break;
+    default:                                 // DF_PERF_CTL, DF_PERF_CTR
+        Ctl = 0xC0010240 + 2 * Counter;
+        Ctr = 0xC0010241 + 2 * Counter;
+        break;
+    }
+}
+
+// Request an uncore counter
+// (return value is error message)
+const char * CUncoreCounters::Define(int CounterType) {
+    // Number of counters in each kind of box
+    static const int BoxCounters[NUM_UNCORE_BOXES] = {2, 2, 1, 6, 4};
+    SUncoreDefinition * p;
+
+    if (NumCounters >= MAXUNCORE) return "Too many uncore counters";
+    for (p = UncoreDefinitions; p->CounterType; p++) {
+        if (p->CounterType == CounterType && (p->UncoreScheme & Scheme)) break;
+    }
+    if (!p->CounterType) return "No matching uncore counter definition found";
+    if (Used[p->Box] >= BoxCounters[p->Box]) return "Uncore counter registers are already in use";
+    if (p->Box == BOX_CBO && NumCBoxes == 0) return "Cannot find the number of L3 slices";
+
+    // Event select value. Intel counters are enabled here and frozen by MSR_UNC_PERF_GLOBAL_CTRL,
+    // AMD counters are frozen by clearing their enable bit (22)
+    int64 c = (p->Event & 0xFF) | (p->EventMask << 8);
+    switch (p->Box) {
+    case BOX_CBO: case BOX_ARB:
+        c |= 1 << 22;
+        break;
+    case BOX_UCLK:
+        c = 1 << 22;
+        break;
+    case BOX_L3:
+        if (Scheme == U_ZEN) {
+            c |= (int64)0xFF << 56 | (int64)0x0F << 48;                  // all threads and slices
+        }
+        else {
+            c |= (int64)3 << 56 | (int64)1 << 47 | (int64)1 << 46;      // all threads, cores and slices
+        }
+        break;
+    case BOX_DF:
+        c |= (int64)((p->Event >> 8) & 0x0F) << 32;                      // event bits 11:8
+        break;
+    default:
+        break;
+    }
+
+    int n = NumCounters++;
+    Names[n] = p->Description;
+    Boxes[n] = p->Box;
+    CounterNum[n] = Used[p->Box]++;
+    Config[n] = c;
+    NumBoxes[n] = p->Box == BOX_CBO ? NumCBoxes : 1;
+
+    // Program the counters in all boxes, and clear them after the test
+    for (int b = 0; b < NumBoxes[n]; b++) {
+        unsigned int Ctl, Ctr;
+        Registers(Boxes[n], b, CounterNum[n], Ctl, Ctr);
+        if (NumSetup + 2 > MAXSETUP) return "Too many uncore boxes";
+        SetupCommands[NumSetup].msr_command = MSR_WRITE;
+        SetupCommands[NumSetup].register_number = Ctl;
+        SetupCommands[NumSetup++].value = c;
+        SetupCommands[NumSetup].msr_command = MSR_WRITE;
+        SetupCommands[NumSetup].register_number = Ctr;
+        SetupCommands[NumSetup++].value = 0;
+        CleanupCommands[NumCleanup].msr_command = MSR_WRITE;
+        CleanupCommands[NumCleanup].register_number = Ctl;
+        CleanupCommands[NumCleanup++].value = 0;
+    }
+    return NULL;
+}
+
+// Commands to freeze or unfreeze all counters
+// (return value is number of commands)
+int CUncoreCounters::Freeze(SMSRInOut * Commands, bool Frozen) {
+    int n = 0;
+    if (Scheme == U_INTEL) {
+        // MSR_UNC_PERF_GLOBAL_CTRL bit 29 enables all counters
+        Commands[n].msr_command = MSR_WRITE;
+        Commands[n].register_number = 0xE01;
+        Commands[n++].value = Frozen ? 0 : 1 << 29;
+        return n;
+    }
+    for (int i = 0; i < NumCounters; i++) {
+        unsigned int Ctl, Ctr;
+        Registers(Boxes[i], 0, CounterNum[i], Ctl, Ctr);
+        Commands[n].msr_command = MSR_WRITE;
+        Commands[n].register_number = Ctl;
+        Commands[n++].value = Frozen ? Config[i] : Config[i] | 1 << 22;
+    }
+    return n;
+}
+
+// Read the counters before and after each repetition. With one thread the counters
+// only run during the repetitions. With more threads they run all the time, as the
+// threads' repetitions overlap
+// (return value is error message)
+const char * CUncoreCounters::Queue(CRepetitionQueues & Queues) {
+    SMSRInOut Commands[MAXUNCORE];
+    int i, b, n;
+    if (NumCounters == 0) return NULL;
+
+    for (i = 0; i < NumCounters; i++) {
+        for (b = 0; b < NumBoxes[i]; b++) {
+            unsigned int Ctl, Ctr;
+            Registers(Boxes[i], b, CounterNum[i], Ctl, Ctr);
+            n = Queues.PutStart(MSR_READ, Ctr);
+            if (n < 0) return "Too many commands in repetition queues";
+            if (b == 0) StartIndex[i] = n;
+        }
+    }
+    if (NumThreads == 1) {
+        n = Freeze(Commands, false);
+        for (i = 0; i < n; i++) {
+            if (Queues.PutStart(MSR_WRITE, Commands[i].register_number, Commands[i].value) < 0) {
+                return "Too many commands in repetition queues";
+            }
+        }
+        n = Freeze(Commands, true);
+        for (i = 0; i < n; i++) {
+            if (Queues.PutStop(MSR_WRITE, Commands[i].register_number, Commands[i].value) < 0) {
+                return "Too many commands in repetition queues";
+            }
+        }
+    }
+    else {
+        // Unfreeze at start and freeze at stop
+        NumSetup += Freeze(SetupCommands + NumSetup, false);
+        NumCleanup += Freeze(CleanupCommands + NumCleanup, true);
+    }
+    for (i = 0; i < NumCounters; i++) {
+        for (b = 0; b < NumBoxes[i]; b++) {
+            unsigned int Ctl, Ctr;
+            Registers(Boxes[i], b, CounterNum[i], Ctl, Ctr);
+            n = Queues.PutStop(MSR_READ, Ctr);
+            if (n < 0) return "Too many commands in repetition queues";
+            if (b == 0) StopIndex[i] = n;
+        }
+    }
+    return NULL;
+}
+
+// Do commands in driver queues. The AMD L3 counters are those of the core complex of the
+// processor that sets them up, so use the first thread's processor
+void CUncoreCounters::Send(CMSRDriver & Driver, SMSRInOut * Commands, int Num) {
+    for (int i = 0; i < Num; ) {
+        CMSRInOutQue Queue;
+        Queue.put(PROC_SET, 0, ProcNum[0]);
+        // Leave room for MSR_STOP at the end of the queue
+        for (; i < Num && Queue.GetSize() < MAX_QUE_ENTRIES - 1; i++) {
+            Queue.put(Commands[i].msr_command, Commands[i].register_number, Commands[i].val[0], Commands[i].val[1]);
+        }
+        Driver.AccessRegisters(Queue);
+    }
+}
+
+// Set up the counters before the test threads start
+void CUncoreCounters::Start(CMSRDriver & Driver) {
+    SMSRInOut Commands[MAXUNCORE];
+    if (NumCounters == 0) return;
+    // Frozen until the first repetition, if one thread
+    if (NumThreads == 1) Send(Driver, Commands, Freeze(Commands, true));
+    Send(Driver, SetupCommands, NumSetup);
+}
+
+// Clear the counters after the test threads stop
+void CUncoreCounters::Stop(CMSRDriver & Driver) {
+    Send(Driver, CleanupCommands, NumCleanup);
+}
+
+// Count of all boxes in a repetition
+int64 CUncoreCounters::Value(int Thread, int Repetition, int Column, CRepetitionQueues & Queues) {
+    uint64 Mask = ((uint64)1 << Bits) - 1, Sum = 0;
+    for (int b = 0; b < NumBoxes[Column]; b++) {
+        uint64 Before = Queues.StartValue(Thread, Repetition, StartIndex[Column] + b);
+        uint64 After  = Queues.Value(Thread, Repetition, StopIndex[Column] + b);
+        Sum += (After - Before) & Mask;
+    }
+    return (int64)Sum;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//        CEnergy class member functions
+//
+//////////////////////////////////////////////////////////////////////////////
+
+// Constructor
+CEnergy::CEnergy() {
+    NumDomains = 0;
+    TscStartIndex = TscStopIndex = -1;
+    UnitRegister = 0;
+    Unit = TscHz = 0;
+    StartTsc = StartNanoTime = 0;
+}
+
+// Find the energy domains of this processor and read them before and after each repetition.
+// The MSRs don't exist on other processors, and reading them would crash the driver
+// (return value is error message)
+const char * CEnergy::Setup(CRepetitionQueues & Queues) {
+    CPUDetection cpu;
+    int Model = cpu.GetModel();
+    NumDomains = 0;
+    if (cpu.GetVendor() == INTEL && (cpu.GetFamily() & (INTEL_7I | INTEL_HASW | INTEL_BROADWELL | INTEL_SKYLAKE
+        | INTEL_KABYLAKE | INTEL_ICELAKE | INTEL_TIGERLAKE | INTEL_GOLDENCOVE | INTEL_GRACEMONT))) {
+        // Nehalem and Westmere have no RAPL
+        static const int Nehalem[] = {0x1A, 0x1E, 0x1F, 0x25, 0x2C, 0x2E, 0x2F, 0};
+        // Servers have DRAM but no core domain. DRAM counts in units of 15.3 uJ from Haswell-EP
+        static const int Server[] = {0x2D, 0x3E, 0x3F, 0x4F, 0x55, 0x56, 0x6A, 0x6C, 0x8F, 0xAD, 0xAE, 0xCF, 0};
+        int i;
+        for (i = 0; Nehalem[i]; i++) {
+            if (Model == Nehalem[i]) return "Processor has no RAPL energy counters";
+        }
+        for (i = 0; Server[i] && Model != Server[i]; i++);
+        UnitRegister = 0x606;                        // MSR_RAPL_POWER_UNIT
+        Names[NumDomains] = "Pkg mJ";
+        FixedUnit[NumDomains] = false;
+        Registers[NumDomains++] = 0x611;             // MSR_PKG_ENERGY_STATUS
+        if (Server[i]) {
+            Names[NumDomains] = "DRAM mJ";
+            FixedUnit[NumDomains] = Model >= 0x3F;
+            Registers[NumDomains++] = 0x619;         // MSR_DRAM_ENERGY_STATUS
+        }
+        else {
+            Names[NumDomains] = "Core mJ";
+            FixedUnit[NumDomains] = false;
+            Registers[NumDomains++] = 0x639;         // MSR_PP0_ENERGY_STATUS
+        }
+    }
+    else if (cpu.GetVendor() == AMD && (cpu.GetFamily() & AMD_ZENALL)) {
+        UnitRegister = 0xC0010299;                   // RAPL_PWR_UNIT
+        Names[NumDomains] = "Pkg mJ";
+        FixedUnit[NumDomains] = false;
+        Registers[NumDomains++] = 0xC001029B;        // PKG_ENERGY_STAT
+        Names[NumDomains] = "Core mJ";               // the core of the thread
+        FixedUnit[NumDomains] = false;
+        Registers[NumDomains++] = 0xC001029A;        // CORE_ENERGY_STAT
+    }
+    else {
+        return "Processor has no RAPL energy counters";
+    }
+
+    for (int d = 0; d < NumDomains; d++) StartIndex[d] = Queues.PutStart(MSR_READ, Registers[d]);
+    TscStartIndex = Queues.PutStart(MSR_READ, 0x10);  // IA32_TIME_STAMP_COUNTER
+    TscStopIndex  = Queues.PutStop(MSR_READ, 0x10);
+    for (int d = 0; d < NumDomains; d++) StopIndex[d] = Queues.PutStop(MSR_READ, Registers[d]);
+    return NULL;
+}
+
+// Read the energy unit, and note the time for the time stamp counter frequency
+void CEnergy::Start(CMSRDriver & Driver) {
+    CMSRInOutQue Queue;
+    Queue.put(MSR_READ, UnitRegister, 0);
+    Driver.AccessRegisters(Queue);
+    // Energy status unit in bits 12:8, in units of 1/2^ESU joules
+    Unit = 1.0 / (1 << ((Queue.queue[0].value >> 8) & 0x1F));
+    StartNanoTime = SyS::NanoTime();
+    StartTsc = Readtsc();
+}
+
+// Time stamp counter frequency, measured over the whole run
+void CEnergy::Stop() {
+    int64 Nanoseconds = SyS::NanoTime() - StartNanoTime;
+    if (Nanoseconds > 0) TscHz = (double)(int64)(Readtsc() - StartTsc) * 1E9 / Nanoseconds;
+}
+
+// Heading of output column. The energy of each domain, then the average power of the package
+const char * CEnergy::Name(int Column) {
+    if (Column < NumDomains) return Names[Column];
+    return "Pkg W";
+}
+
+// Energy of a domain in a repetition. The counters are 32 bits and wrap around
+double CEnergy::Joules(int Thread, int Repetition, int Domain, CRepetitionQueues & Queues) {
+    uint64 Before = Queues.StartValue(Thread, Repetition, StartIndex[Domain]);
+    uint64 After  = Queues.Value(Thread, Repetition, StopIndex[Domain]);
+    return ((After - Before) & 0xFFFFFFFF) * (FixedUnit[Domain] ? 1.0 / (1 << 16) : Unit);
+}
+
+// Energy (mJ) of a domain in a repetition, or average power (W) of the package
+double CEnergy::Value(int Thread, int Repetition, int Column, CRepetitionQueues & Queues) {
+    if (Column < NumDomains) return Joules(Thread, Repetition, Column, Queues) * 1000.;
+    uint64 Ticks = Queues.Value(Thread, Repetition, TscStopIndex)
+        - Queues.StartValue(Thread, Repetition, TscStartIndex);
+    if (Ticks == 0 || TscHz == 0) return 0;
+    return Joules(Thread, Repetition, 0, Queues) * TscHz / (double)Ticks;
+}
 
-//////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
 //
-//        Thread procedure
+//        CPmiSamples class member functions
 //
-//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
 
-ThreadProcedureDeclaration(ThreadProc1) {
-    //DWORD WINAPI ThreadProc1(LPVOID parm) {
-    // check thread number
-    unsigned int threadnum = *(unsigned int*)parm;
+// Constructor
+CPmiSamples::CPmiSamples() {
+    Buffer = 0;
+}
 
-    if (threadnum >= (unsigned int)NumThreads) {
-        printf("\nThread number out of range %i", threadnum);
-        return NULL;
-    }
+// Destructor
+CPmiSamples::~CPmiSamples() {
+    if (Buffer) delete[] Buffer;
+}
 
-    // get desired processornumber
-    int ProcessorNumber = ProcNum[threadnum];
+// Write the samples of each thread as the piece of code (see CCodePlacement::Locate) and
+// the offset into it. Samples in other code have offset -1. The instruction pointer is that
+// of the instruction after the one that made the counter overflow, or a few later (skid)
+// (return value is nonzero on error)
+int CPmiSamples::Save(const char * FileName, CMSRDriver & Driver) {
+    if (!Buffer) Buffer = new int64[MAX_PMI_SAMPLES];
+    FILE * f = fopen(FileName, "w");
+    if (!f) return 1;
+    fprintf(f, "Thread,Piece,Offset\n");
+
+    for (int t = 0; t < NumThreads; t++) {
+        // The driver keeps the samples of each processor until sampling starts again
+        CMSRInOutQue Queue;
+        Queue.put(PMI_READ, ProcNum[t], 0);
+        Queue.queue[0].value = (int64)Buffer;
+        Driver.AccessRegisters(Queue);
+        int64 n = Queue.queue[0].value;
+        if (n < 0) {
+            fclose(f);
+            return 1;
+        }
+        if (n > MAX_PMI_SAMPLES) {
+            printf("\nThread %i took %lli samples. Only the first %i are kept\n", t, n, MAX_PMI_SAMPLES);
+            n = MAX_PMI_SAMPLES;
+        }
+        for (int i = 0; i < n; i++) {
+            int64 Offset;
+            int Piece = CodePlacement.Locate(Buffer[i], Offset);
+            if (Piece == CCodePlacement::OTHER_CODE) Offset = -1;
+            fprintf(f, "%i,%i,%lli\n", t, Piece, Offset);
+        }
+    }
+    return fclose(f) != 0;
+}
 
-    // Lock process to this processor number
-    SyS::SetProcessMask(ProcessorNumber);
 
-    // Start MSR counters
-    MSRCounters.StartCounters(threadnum);
+//////////////////////////////////////////////////////////////////////////////
+//
+//        CCodePlacement class member functions
+//
+//////////////////////////////////////////////////////////////////////////////
 
-    // Wait for rest of timeslice
-    SyS::Sleep0();
+// Constructor
+CCodePlacement::CCodePlacement() {
+    Pages = 0;
+    Pieces = 0;
+    NumPages = MaxPages = NumPieces = MaxPieces = 0;
+    PageSize = SyS::PageSize();
+    Message[0] = 0;
+}
 
-    // wait for other threads
-    // Initialize synchronizer
-    USync WaitTo;
-    WaitTo.allflags = 0;
-    for (int t = 0; t < NumThreads; t++) WaitTo.flag[t] = 1;
-    // flag for this thead ready
-    TSync.flag[threadnum] = 1;
-    // wait for other threads to be ready
-    while (TSync.allflags != WaitTo.allflags) {} // Note: will wait forever if a thread is not created
+// Destructor. Unmap the pages, so that libpmctest.so can be loaded again with code at the same addresses
+CCodePlacement::~CCodePlacement() {
+    for (int i = 0; i < NumPages; i++) SyS::UnmapMemory(Pages[i], PageSize);
+    delete[] Pages;
+    delete[] Pieces;
+}
 
-    // Run the test code
-    repetitions = TestLoop(threadnum);
+// Place all pieces in the list file, then make them executable.
+// No list file means there is nothing to place
+// (return value is error message)
+const char * CCodePlacement::Load(const char * ListFile) {
+    FILE * list = fopen(ListFile, "r");
+    if (!list) return 0;
+    char line[1100];
+    const char * err = 0;
+    while (!err && fgets(line, sizeof(line), list)) {
+        unsigned long long Address;
+        int n = 0;
+        if (sscanf(line, "%llx %n", &Address, &n) < 1 || n == 0) continue;
+        char * name = line + n;
+        name[strcspn(name, "\r\n")] = 0;
+        err = Place(Address, name);
+    }
+    fclose(list);
+    for (int i = 0; !err && i < NumPages; i++) {
+        if (!SyS::MakeExecutable(Pages[i], PageSize)) {
+            snprintf(Message, sizeof(Message), "Cannot make code at %llX executable", (unsigned long long)Pages[i]);
+            err = Message;
+        }
+    }
+    return err;
+}
 
-    // Wait for rest of timeslice
-    SyS::Sleep0();
+// Map the pages that a piece needs and copy it there. Pieces may share pages
+// (return value is error message)
+const char * CCodePlacement::Place(uint64 Address, const char * FileName) {
+    FILE * f = fopen(FileName, "rb");
+    if (!f) {
+        snprintf(Message, sizeof(Message), "Cannot read %s", FileName);
+        return Message;
+    }
+    fseek(f, 0, SEEK_END);
+    long Size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    for (uint64 Page = Address & ~uint64(PageSize - 1); Page < Address + Size; Page += PageSize) {
+        if (IsMapped(Page)) continue;
+        if (!SyS::MapMemoryAt(Page, PageSize)) {
+            fclose(f);
+            snprintf(Message, sizeof(Message), "Cannot map memory at %llX for %s. Address is in use",
+                (unsigned long long)Page, FileName);
+            return Message;
+        }
+        if (NumPages == MaxPages) {
+            MaxPages = MaxPages ? MaxPages * 2 : 64;
+            uint64 * p = new uint64[MaxPages];
+            for (int i = 0; i < NumPages; i++) p[i] = Pages[i];
+            delete[] Pages;
+            Pages = p;
+        }
+        Pages[NumPages++] = Page;
+    }
+    bool ok = Size == 0 || fread((void*)Address, Size, 1, f) == 1;
+    fclose(f);
+    if (!ok) {
+        snprintf(Message, sizeof(Message), "Cannot read %s", FileName);
+        return Message;
+    }
+    if (NumPieces == MaxPieces) {
+        MaxPieces = MaxPieces ? MaxPieces * 2 : 64;
+        SPiece * p = new SPiece[MaxPieces];
+        for (int i = 0; i < NumPieces; i++) p[i] = Pieces[i];
+        delete[] Pieces;
+        Pieces = p;
+    }
+    Pieces[NumPieces].Address = Address;
+    Pieces[NumPieces].Size = Size;
+    NumPieces++;
+    return 0;
+}
 
-    // Start MSR counters
-    MSRCounters.StopCounters(threadnum);
+// Find the code that Address is in: the test code (TEST_CODE), with Offset from TestCodeStart,
+// or a placed piece, with Offset from its start. Other code gives OTHER_CODE and the address
+// (return value is piece number)
+int CCodePlacement::Locate(int64 Address, int64 & Offset) {
+    if (Address >= (int64)TestCodeStart && Address < (int64)TestCodeEnd) {
+        Offset = Address - (int64)TestCodeStart;
+        return TEST_CODE;
+    }
+    for (int i = 0; i < NumPieces; i++) {
+        if ((uint64)Address - Pieces[i].Address < Pieces[i].Size) {
+            Offset = (int64)((uint64)Address - Pieces[i].Address);
+            return i;
+        }
+    }
+    Offset = Address;
+    return OTHER_CODE;
+}
 
-    return NULL;
-};
+// Tell if a page has been mapped by Place
+bool CCodePlacement::IsMapped(uint64 Page) {
+    for (int i = 0; i < NumPages; i++) {
+        if (Pages[i] == Page) return true;
+    }
+    return false;
+}
 
 
-//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
 //
-//        Main
+//        CMetrics class member functions
 //
-//////////////////////////////////////////////////////////////////////
-int main(int argc, char* argv[]) {
-    int repi;                           // repetition counter
-    int i;                              // loop counter
-    int t;                              // thread counter
-    int e;                              // error number
-    int procthreads;                    // number of threads supported by processor
-
-    // Limit number of threads
-    if (NumThreads > MAXTHREADS) {
-        NumThreads = MAXTHREADS;
-        printf("\nToo many threads");
-    }
-    if (NumThreads < 1) NumThreads = 1;
+//////////////////////////////////////////////////////////////////////////////
 
-    // Get mask of possible CPU cores
-    SyS::ProcMaskType ProcessAffMask = SyS::GetProcessMask();
-    // Count possible threads
-    for (procthreads = i = 0; i < MAXTHREADS; i++) {
-        if (SyS::TestProcessMask(i, &ProcessAffMask)) procthreads++;
-    }
+// Constructor
+CMetrics::CMetrics() {
+    NumColumns = NumMetrics = 0;
+    Message[0] = 0;
+}
 
-    // Fix a processornumber for each thread
-    for (t = 0, i = NumThreads-1; t < NumThreads; t++, i--) {
-        // make processornumbers different, and last thread = MainThreadProcNum:
-        // ProcNum[t] = MainThreadProcNum ^ i;
-        if (procthreads < 4) {        
-            ProcNum[t] = i;
+// Define RatioOut and TempOut, then the metrics in the list file, as columns after the
+// first Columns columns. No list file means there are no metrics besides those
+// (return value is error message)
+const char * CMetrics::Load(const char * FileName, int Columns) {
+    NumColumns = Columns;
+    NumMetrics = 0;
+    const char * err = 0;
+
+    if (RatioOut[0]) {
+        // Numerator and denominator: 0 = clock, 1 = first PMC, etc., -1 = none
+        int First = FirstCounterColumn() - 1;
+        NumOps[NumMetrics] = 0;
+        for (int i = 1; i <= 2 && !err; i++) {
+            if (RatioOut[i] < -1 || RatioOut[i] > (UsePMC ? NumCounters : 0)) {
+                snprintf(Message, sizeof(Message), "RatioOut[%i] = %i is not a counter", i, RatioOut[i]);
+                return Message;
+            }
+            err = RatioOut[i] < 0 ? Put(OP_NUMBER, 0, 1) : Put(OP_COLUMN, First + RatioOut[i]);
         }
-        else {        
-            ProcNum[t] = (i % 2) * (procthreads/2) + i / 2;
+        float FloatFactor;
+        memcpy(&FloatFactor, &RatioOut[3], sizeof(FloatFactor));
+        if (!err) err = Put(OP_DIV);
+        if (!err) err = Put(OP_NUMBER, 0, RatioOut[0] == 2 ? FloatFactor : RatioOut[3]);
+        if (!err) err = Put(OP_MUL);
+        if (err) return err;
+        snprintf(Names[NumMetrics], NAMELEN, "%s", RatioOutTitle ? RatioOutTitle : "Ratio");
+        Fraction[NumMetrics++] = RatioOut[0] == 2;
+    }
+    if (TempOut) {
+        if (TempOut < 2 || TempOut > 7) {
+            snprintf(Message, sizeof(Message), "TempOut = %i is not a type of output", TempOut);
+            return Message;
         }
-        if (!SyS::TestProcessMask(ProcNum[t], &ProcessAffMask)) {
-            // this processor core is not available
-            printf("\nProcessor %i not available. Processors available:\n", ProcNum[t]);
-            for (int p = 0; p < MAXTHREADS; p++) {
-                if (SyS::TestProcessMask(p, &ProcessAffMask)) printf("%i  ", p);
+        if (NumMetrics == MAXMETRICS) return "Too many metrics";
+        NumOps[NumMetrics] = 0;
+        err = Put(OP_TEMP, TempOut);
+        if (err) return err;
+        snprintf(Names[NumMetrics], NAMELEN, "%s", TempOutTitle ? TempOutTitle : "Temp");
+        Fraction[NumMetrics++] = TempOut >= 6;
+    }
+
+    FILE * list = fopen(FileName, "r");
+    if (!list) return 0;
+    char line[1100];
+    while (!err && fgets(line, sizeof(line), list)) {
+        line[strcspn(line, "#\r\n")] = 0;
+        char * equal = strchr(line, '=');
+        if (!equal) {
+            if (line[strspn(line, " \t")]) {
+                snprintf(Message, sizeof(Message), "Expected name = expression: %s", line);
+                err = Message;
             }
-            printf("\n");
-            return 1;
+            continue;
         }
+        // Trim the name
+        *equal = 0;
+        char * name = line + strspn(line, " \t");
+        for (char * end = equal; end > name && (end[-1] == ' ' || end[-1] == '\t'); ) *--end = 0;
+        err = Define(name, equal + 1);
     }
+    fclose(list);
+    return err;
+}
 
-    // Make program and driver use the same processor number
-    MSRCounters.LockProcessor();
-
-    // Find counter defitions and put them in queue for driver
-    MSRCounters.QueueCounters();
+// Compile an expression into a new metric
+// (return value is error message)
+const char * CMetrics::Define(const char * Name, const char * Expression) {
+    if (NumMetrics == MAXMETRICS) return "Too many metrics";
+    if (!Name[0] || strlen(Name) >= NAMELEN) {
+        snprintf(Message, sizeof(Message), "Bad metric name '%s'", Name);
+        return Message;
+    }
+    NumOps[NumMetrics] = 0;
+    const char * p = Expression;
+    const char * err = ParseSum(p);
+    p += strspn(p, " \t");
+    if (!err && *p) {
+        snprintf(Message, sizeof(Message), "Unexpected '%s' in %s", p, Name);
+        err = Message;
+    }
+    if (err) return err;
+    snprintf(Names[NumMetrics], NAMELEN, "%s", Name);
+    Fraction[NumMetrics++] = 1;
+    return 0;
+}
 
-    // Install and load driver
-    e = MSRCounters.StartDriver();
-    if (e) return e;
+// Add an operation to the program of the metric being defined
+// (return value is error message)
+const char * CMetrics::Put(EOp Op, int Column, double Number) {
+    if (NumOps[NumMetrics] == MAXOPS) return "Expression is too long";
+    SOp & o = Program[NumMetrics][NumOps[NumMetrics]++];
+    o.Op = Op;
+    o.Column = Column;
+    o.Number = Number;
+    return 0;
+}
 
-    // Set high priority to minimize risk of interrupts during test
-    SyS::SetProcessPriorityHigh();
+// sum = product {(+|-) product}
+const char * CMetrics::ParseSum(const char * & p) {
+    const char * err = ParseProduct(p);
+    while (!err) {
+        p += strspn(p, " \t");
+        if (*p != '+' && *p != '-') break;
+        EOp Op = *p++ == '+' ? OP_ADD : OP_SUB;
+        err = ParseProduct(p);
+        if (!err) err = Put(Op);
+    }
+    return err;
+}
 
-    // Make multiple threads
-    ThreadHandler Threads;
-    Threads.Start(NumThreads);
+// product = factor {(*|/) factor}
+const char * CMetrics::ParseProduct(const char * & p) {
+    const char * err = ParseFactor(p);
+    while (!err) {
+        p += strspn(p, " \t");
+        if (*p != '*' && *p != '/') break;
+        EOp Op = *p++ == '*' ? OP_MUL : OP_DIV;
+        err = ParseFactor(p);
+        if (!err) err = Put(Op);
+    }
+    return err;
+}
 
-    // Stop threads
-    Threads.Stop();
+// factor = -factor | (sum) | name | number
+const char * CMetrics::ParseFactor(const char * & p) {
+    const char * err;
+    p += strspn(p, " \t");
+    if (*p == '-') {
+        p++;
+        err = ParseFactor(p);
+        return err ? err : Put(OP_NEG);
+    }
+    if (*p == '(') {
+        p++;
+        err = ParseSum(p);
+        if (err) return err;
+        p += strspn(p, " \t");
+        if (*p != ')') {
+            if (!*p) return "Missing ')' at end of expression";
+            snprintf(Message, sizeof(Message), "Missing ')' before '%s'", p);
+            return Message;
+        }
+        p++;
+        return 0;
+    }
+    // A name that starts with a digit, like "4K alias", comes before a number
+    int Column, n = MatchName(p, Column);
+    if (n) {
+        p += n;
+        return Column < 0 ? Put(OP_ITERATIONS) : Put(OP_COLUMN, Column);
+    }
+    char * end;
+    double Number = strtod(p, &end);
+    if (end == p) {
+        if (!*p) return "Expression ends early";
+        snprintf(Message, sizeof(Message), "Unknown column at '%s'", p);
+        return Message;
+    }
+    p = end;
+    return Put(OP_NUMBER, 0, Number);
+}
 
-    // Set priority back normal
-    SyS::SetProcessPriorityNormal();
+// Find the longest name of a column, earlier metric or Iterations (Column = -1) at p.
+// It must not be followed by more letters or digits
+// (return value is length of name, 0 if none)
+int CMetrics::MatchName(const char * p, int & Column) {
+    int Longest = 0;
+    for (int c = -1; c < NumColumns + NumMetrics; c++) {
+        const char * name = c < 0 ? "Iterations" : c < NumColumns ? PMCTestColumnName(c) : Names[c - NumColumns];
+        int n = (int)strlen(name);
+        if (n <= Longest || strncmp(p, name, n) || isalnum((unsigned char)p[n])) continue;
+        Longest = n;
+        Column = c;
+    }
+    return Longest;
+}
 
-    // Clean up
-    MSRCounters.CleanUp();
+// TempOut column printed in hexadecimal
+bool CMetrics::IsHex(int Column) {
+    SOp & o = Program[Column][0];
+    return o.Op == OP_TEMP && (o.Column == 4 || o.Column == 5);
+}
 
-    // print column headings
-    if (NumThreads > 1) printf("Processor,");
-    printf("Clock,");
-    if (UsePMC) {
-        for (i = 0; i < NumCounters; i++) {
-            printf("%s", MSRCounters.CounterNames[i]);
-            if (i != NumCounters - 1) printf(",");
-        }
+// Value that the test code left for a repetition in CountTemp, at the start of the thread's data
+// block (possibly extended into CountOverhead). Element Repetition of an array of Type
+double CMetrics::TempValue(int Thread, int Repetition, int Type) {
+    // One value for each repetition, 64 bits for types 3, 5 and 7
+    int Size = (Type & 1) ? 8 : 4;
+    const char * Temp = (const char *)(PThreadData + Thread * (ThreadDataSize / sizeof(int))) + Repetition * Size;
+    int i; int64 l; float f; double d;
+    switch (Type) {
+    case 2: memcpy(&i, Temp, sizeof(i)); return i;
+    case 4: memcpy(&i, Temp, sizeof(i)); return (unsigned int)i;
+    case 3: case 5: memcpy(&l, Temp, sizeof(l)); return (double)l;
+    case 6: memcpy(&f, Temp, sizeof(f)); return f;
+    default: memcpy(&d, Temp, sizeof(d)); return d;
     }
-    printf("\n");
-    // TODO: support RatioOut/TempOut?
+}
 
-    // Print results
-    for (t = 0; t < NumThreads; t++) {
-        // calculate offsets into ThreadData[]
-        int TOffset = t * (ThreadDataSize / sizeof(int));
-        int ClockOS = ClockResultsOS / sizeof(int);
-        int PMCOS   = PMCResultsOS / sizeof(int);
-
-        if (NumThreads > 1) printf("%i,", ProcNum[t]);
-        // print counter outputs
-        for (repi = 0; repi < repetitions; repi++) {
-            printf("%i,", PThreadData[repi+TOffset+ClockOS]);
-            if (UsePMC) {
-                for (i = 0; i < NumCounters; i++) {         
-                    printf("%i", PThreadData[repi+i*repetitions+TOffset+PMCOS]);
-                    if (i != NumCounters - 1) printf(",");
-                }
-            }
-            printf("\n");
+// Evaluate a metric in one row of results
+double CMetrics::Value(int Row, int Column) {
+    double Stack[MAXOPS];
+    int n = 0;
+    for (int i = 0; i < NumOps[Column]; i++) {
+        SOp & o = Program[Column][i];
+        switch (o.Op) {
+        case OP_NUMBER:
+            Stack[n++] = o.Number;  break;
+        case OP_COLUMN:
+            Stack[n++] = PMCTestValue(Row, o.Column);  break;
+        case OP_ITERATIONS:
+            Stack[n++] = InnerIterations;  break;
+        case OP_TEMP:
+            Stack[n++] = TempValue(Row / repetitions, Row % repetitions, o.Column);  break;
+        case OP_NEG:
+            Stack[n-1] = -Stack[n-1];  break;
+        case OP_ADD:
+            n--;  Stack[n-1] += Stack[n];  break;
+        case OP_SUB:
+            n--;  Stack[n-1] -= Stack[n];  break;
+        case OP_MUL:
+            n--;  Stack[n-1] *= Stack[n];  break;
+        case OP_DIV:
+            n--;  Stack[n-1] = Stack[n] != 0 ? Stack[n-1] / Stack[n] : 0;  break;
         }
     }
-
-    // Exit
-    return 0;
+    return n ? Stack[0] : 0;
 }
 
 
 //////////////////////////////////////////////////////////////////////////////
 //
-//        CMSRInOutQue class member functions
+//        CKernelRun class member functions
 //
 //////////////////////////////////////////////////////////////////////////////
 
 // Constructor
-CMSRInOutQue::CMSRInOutQue() {
-    n = 0;
-    for (int i = 0; i < MAX_QUE_ENTRIES+1; i++) {
-        queue[i].msr_command = MSR_STOP;
-    }
+CKernelRun::CKernelRun() {
+    Params = 0;
+    Code = 0;
+    Message[0] = 0;
 }
 
-// Put data record in queue
-int CMSRInOutQue::put (EMSR_COMMAND msr_command, unsigned int register_number,
-                       unsigned int value_lo, unsigned int value_hi) {
+// Destructor
+CKernelRun::~CKernelRun() {
+    delete Params;
+    delete[] Code;
+}
 
-                           if (n >= MAX_QUE_ENTRIES) return -10;
+// Read the test code, a flat binary that the driver calls
+// (return value is error message)
+const char * CKernelRun::Load(const char * FileName) {
+    FILE * f = fopen(FileName, "rb");
+    if (!f) {
+        snprintf(Message, sizeof(Message), "Cannot read %s", FileName);
+        return Message;
+    }
+    fseek(f, 0, SEEK_END);
+    long Size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (Size <= 0 || Size > MAX_KERNEL_CODE) {
+        fclose(f);
+        snprintf(Message, sizeof(Message), "%s is larger than %i bytes", FileName, MAX_KERNEL_CODE);
+        return Message;
+    }
+    delete[] Code;
+    Code = new char[Size];
+    bool ok = fread(Code, Size, 1, f) == 1;
+    fclose(f);
+    if (!ok) {
+        snprintf(Message, sizeof(Message), "Cannot read %s", FileName);
+        return Message;
+    }
+    if (!Params) Params = new SKernelRun;
+    memset(Params, 0, sizeof(SKernelRun));
+    Params->code = (int64)Code;
+    Params->code_size = (int)Size;
+    return 0;
+}
 
-                           queue[n].msr_command = msr_command;
-                           queue[n].register_number = register_number;
-                           queue[n].val[0] = value_lo;
-                           queue[n].val[1] = value_hi;
-                           n++;
-                           return 0;
+// Run the test code in the driver on the processor of this thread, and copy its counts to
+// ClockResults and PMCResults like TestLoop. There are fewer repetitions than NumRepetitions
+// if they took longer than MAX_KERNEL_MILLISECONDS
+// (return value is number of repetitions done, 0 on error)
+int CKernelRun::Run(int Thread, CMSRDriver & Driver) {
+    Params->repetitions = NumRepetitions;
+    Params->iterations = InnerIterations;
+    for (int i = 0; i < MAX_KERNEL_COUNTERS; i++) Params->counters[i] = Counters[i];
+
+    CMSRInOutQue Queue;
+    Queue.put(KERNEL_RUN, 0, 0);
+    Queue.queue[0].value = (int64)Params;
+    Driver.AccessRegisters(Queue);
+    // A driver without KERNEL_RUN leaves the value as it was
+    int64 n = Queue.queue[0].value;
+    if (n == -2) {
+        printf("\nA repetition of %i iterations takes longer than %i ms in the driver\n",
+            InnerIterations, MAX_KERNEL_MILLISECONDS);
+        return 0;
+    }
+    if (n <= 0 || n > NumRepetitions) {
+        printf("\nThe driver cannot run this test code. Build and load the driver in driver/ again, "
+            "and the test's MSRrun module\n");
+        return 0;
+    }
+
+    int * ThreadResults = PThreadData + Thread * (ThreadDataSize / sizeof(int));
+    for (int r = 0; r < n; r++) {
+        ThreadResults[ClockResultsOS / sizeof(int) + r] = Params->clocks[r];
+        for (int i = 0; i < NumCounters; i++) {
+            ThreadResults[PMCResultsOS / sizeof(int) + i * NumRepetitions + r] = Params->counts[i][r];
+        }
+    }
+    return (int)n;
 }
 
 
@@ -249,6 +1804,12 @@ CCounters::CCounters() {
     MScheme = S_UNKNOWN;
     NumPMCs = 0;
     NumFixedPMCs = 0;
+    AMDPerfMonV2 = false;
+    TopDownMode = TD_NONE;
+    TopDownValueIndex = 0;
+    for (int i = 0; i < 5; i++) TopDownCounters[i] = 0;
+    SMIStartIndex = SMIStopIndex = -1;
+    PmiIndex = -1;
     ProcessorNumber = 0;
     for (int i = 0; i < MAXCOUNTERS; i++) CounterNames[i] = 0;
 }
@@ -265,12 +1826,13 @@ void CCounters::QueueCounters() {
     MVendor = cpuDetect.GetVendor();
     MFamily = cpuDetect.GetFamily();
     MScheme = cpuDetect.GetScheme();
+    AMDPerfMonV2 = cpuDetect.HasPerfMonV2();
 
     // Get additional PMC information (NumPMCs, NumFixedPMCs)
     NumPMCs = 2;
     NumFixedPMCs = 0;
     if (MVendor == AMD) {
-        NumPMCs = 4;
+        NumPMCs = cpuDetect.GetNumAMDCounters();
     }
     else if (MVendor == INTEL) {
         int CpuIdOutput[4];
@@ -284,16 +1846,34 @@ void CCounters::QueueCounters() {
         }
     }
 
+    if (UsePMC && TopDown) {
+        // Top-down counters first, so that they get the counter registers they need
+        err = DefineTopDown();
+        if (err) {
+            printf("\nCannot do top-down analysis. %s\n", err);
+        }
+    }
+
     if (UsePMC) {   
         // Get all counter requests
         for (int i = 0; i < MaxNumCounters; i++) {
             CounterType = CounterTypesDesired[i];
+            if (TopDownMode == TD_EVENTS && (CounterType == 1 || (CounterType >= 700 && CounterType <= 703))) continue;
+            if (TopDownMode != TD_NONE && TopDownMode != TD_EVENTS && CounterType == 3) continue;
             err = DefineCounter(CounterType);
             if (err) {
                 printf("\nCannot make counter %i. %s\n", i+1, err);
             }
         }  
     }
+
+    if (UsePMC && CheckInterrupts) {
+        // Interrupt counter last, so that it only takes a counter register nobody else wants
+        err = DefineInterruptCheck();
+        if (err && (CheckInterrupts & 4)) {
+            fprintf(stderr, "\nWarning: cannot check for interrupts. %s\n", err);
+        }
+    }
 }
 
 void CCounters::LockProcessor() {
@@ -319,7 +1899,7 @@ int CCounters::StartDriver() {
     // return error code
     int ErrNo = 0;
 
-    if (UsePMC) {
+    if (UsePMC || UseLBR || UseEnergy || KernelMode) {
         // Load driver
         ErrNo = msr.LoadDriver();
     }
@@ -389,6 +1969,8 @@ const char * CCounters::DefineCounter(int CounterType) {
 const char * CCounters::DefineCounter(SCounterDefinition & CDef) {
     int i, counternr, a, b, reg, eventreg, tag;
     static int CountersEnabled = 0, FixedCountersEnabled = 0;
+    // Count in user mode (bit 16), and in the kernel (bit 17) for test code that runs in the driver
+    int usr = KernelMode ? (3 << 16) : (1 << 16);
 
     if ( !(CDef.ProcessorFamily & MFamily)) return "Counter not defined for present microprocessor family";
     if (NumCounters >= MaxNumCounters) return "Too many counters";
@@ -404,6 +1986,10 @@ const char * CCounters::DefineCounter(SCounterDefinition & CDef) {
         }
         if (CDef.CounterLast >= NumPMCs && (MScheme & S_INTL)) {
         }   
+        if (CDef.CounterLast >= NumPMCs && (MScheme & S_AMDA)) {
+            // Fewer counters than the table allows for
+            CDef.CounterLast = NumPMCs - 1;
+        }
 
         // Find vacant counter
         for (counternr = CDef.CounterFirst; counternr <= CDef.CounterLast; counternr++) {
@@ -437,8 +2023,15 @@ const char * CCounters::DefineCounter(SCounterDefinition & CDef) {
         }
     }
 
+    // Sample instruction pointer on overflow of this counter
+    bool Sampled = PmiPeriod && CDef.CounterType == PmiCounterType && PmiIndex < 0;
+    if (Sampled && ((counternr & 0x40000000) || MScheme == S_P1 || MScheme == S_P4)) {
+        return "Can only sample on general purpose counters";
+    }
+
     // Vacant counter found. Save name   
     CounterNames[NumCounters] = CDef.Description;
+    CounterMSR[NumCounters] = 0;
 
     // Put MSR commands for this counter in queues
     switch (MScheme) {
@@ -452,16 +2045,29 @@ const char * CCounters::DefineCounter(SCounterDefinition & CDef) {
         Put1(NumThreads, MSR_WRITE, 0x12+counternr, 0);
         Put2(NumThreads, MSR_WRITE, 0x12+counternr, 0);
         EventRegistersUsed[0] = a;
+        CounterMSR[NumCounters] = 0x12+counternr;
         break;
 
     case S_ID2: case S_ID3:
         // Intel Core 2 and later
+        if (!(CountersEnabled++)) {
+            // Enable counters. Needed also when only fixed function counters are used
+            a = (1 << NumPMCs) - 1;      // one bit for each pmc counter
+            b = (1 << NumFixedPMCs) - 1; // one bit for each fixed counter
+            if (TopDownMode == TD_METRICS || TopDownMode == TD_METRICS2) {
+                b |= 1 << 16;            // bit 48: enable PERF_METRICS
+            }
+            // set MSR_PERF_GLOBAL_CTRL
+            Put1(NumThreads, MSR_WRITE, 0x38F, a, b);
+            Put2(NumThreads, MSR_WRITE, 0x38F, 0);
+        }
         if (counternr & 0x40000000) {
             // This is a fixed function counter
+            CounterMSR[NumCounters] = 0x309 + (counternr & 0xFF); // IA32_FIXED_CTR0,1,..
             if (!(FixedCountersEnabled++)) {
                 // Enable fixed function counters
                 for (a = i = 0; i < NumFixedPMCs; i++) {
-                    b = 2;  // 1=privileged level, 2=user level, 4=any thread
+                    b = KernelMode ? 3 : 2;  // 1=privileged level, 2=user level, 4=any thread
                     a |= b << (4*i);
                 }
                 // Set MSR_PERF_FIXED_CTR_CTRL
@@ -470,22 +2076,15 @@ const char * CCounters::DefineCounter(SCounterDefinition & CDef) {
             }
             break;
         }
-        if (!(CountersEnabled++)) {
-            // Enable counters
-            a = (1 << NumPMCs) - 1;      // one bit for each pmc counter
-            b = (1 << NumFixedPMCs) - 1; // one bit for each fixed counter
-            // set MSR_PERF_GLOBAL_CTRL
-            Put1(NumThreads, MSR_WRITE, 0x38F, a, b);
-            Put2(NumThreads, MSR_WRITE, 0x38F, 0);
-        }
         // All other counters continue in next case:
 
     case S_P2: case S_ID1:
         // Pentium Pro, Pentium II, Pentium III, Pentium M, Core 1, (Core 2 continued):
 
 
-        a = CDef.Event | (CDef.EventMask << 8) | (1 << 16) | (1 << 22);
+        a = CDef.Event | (CDef.EventMask << 8) | usr | (1 << 22);
         if (MScheme == S_ID1) a |= (1 << 14);  // Means this core only
+        if (Sampled) a |= (1 << 20);           // Interrupt on overflow
         //if (MScheme == S_ID3) a |= (1 << 22);  // Means any thread in this core!
 
         eventreg = 0x186 + counternr;             // IA32_PERFEVTSEL0,1,..
@@ -494,6 +2093,7 @@ const char * CCounters::DefineCounter(SCounterDefinition & CDef) {
         Put2(NumThreads, MSR_WRITE, eventreg, 0);
         Put1(NumThreads, MSR_WRITE, reg, 0);
         Put2(NumThreads, MSR_WRITE, reg, 0);
+        CounterMSR[NumCounters] = reg;
         break;
 
     case S_P4:
@@ -515,36 +2115,62 @@ const char * CCounters::DefineCounter(SCounterDefinition & CDef) {
         reg = counternr + 0x300;
         Put1(NumThreads, MSR_WRITE, reg, 0);
         Put2(NumThreads, MSR_WRITE, reg, 0);
+        CounterMSR[NumCounters] = reg;
         // Set high bit for fast readpmc
         counternr |= 0x80000000;
         break;
 
-    case S_AMD:
-        // AMD Athlon, Athlon 64, Opteron
-        a = CDef.Event | (CDef.EventMask << 8) | (1 << 16) | (1 << 22);
-        eventreg = 0xc0010000 + counternr;
-        reg = 0xc0010004 + counternr;
-        Put1(NumThreads, MSR_WRITE, eventreg, a);
+    case S_AMD: case S_AMD2:
+        // AMD Athlon, Athlon 64, Opteron, Bulldozer, Zen
+        // Event select bits 7:0 go in PERF_CTL bits 7:0, bits 11:8 in PERF_CTL bits 35:32
+        a = (CDef.Event & 0xFF) | (CDef.EventMask << 8) | usr | (1 << 22);
+        b = (CDef.Event >> 8) & 0x0F;
+        if (Sampled) a |= (1 << 20);           // Interrupt on overflow
+        if (MScheme == S_AMD2) {
+            // Core performance counter extensions: PERF_CTL and PERF_CTR registers are interleaved
+            if (AMDPerfMonV2 && !(CountersEnabled++)) {
+                // Enable counters in PerfCntrGlobalCtl
+                Put1(NumThreads, MSR_WRITE, 0xc0000301, (1 << NumPMCs) - 1);
+                Put2(NumThreads, MSR_WRITE, 0xc0000301, 0);
+            }
+            eventreg = 0xc0010200 + 2 * counternr;
+            reg = 0xc0010201 + 2 * counternr;
+        }
+        else {
+            eventreg = 0xc0010000 + counternr;
+            reg = 0xc0010004 + counternr;
+        }
+        Put1(NumThreads, MSR_WRITE, eventreg, a, b);
         Put2(NumThreads, MSR_WRITE, eventreg, 0);
         Put1(NumThreads, MSR_WRITE, reg, 0);
         Put2(NumThreads, MSR_WRITE, reg, 0);
+        CounterMSR[NumCounters] = reg;
         break;
 
     case S_VIA:
         // VIA Nano. Undocumented!
-        a = CDef.Event | (1 << 16) | (1 << 22);
+        a = CDef.Event | usr | (1 << 22);
+        if (Sampled) a |= (1 << 20);           // Interrupt on overflow
         eventreg = 0x186 + counternr;
         reg = 0xc1 + counternr;
         Put1(NumThreads, MSR_WRITE, eventreg, a);
         Put2(NumThreads, MSR_WRITE, eventreg, 0);
         Put1(NumThreads, MSR_WRITE, reg, 0);
         Put2(NumThreads, MSR_WRITE, reg, 0);
+        CounterMSR[NumCounters] = reg;
         break;
 
     default:
         return "No counters defined for present microprocessor family";
     }
 
+    if (Sampled) {
+        // Driver samples the instruction pointer each PmiPeriod events, see CPmiSamples
+        Put1(NumThreads, PMI_START, CounterMSR[NumCounters], PmiPeriod);
+        Put2(NumThreads, PMI_STOP, CounterMSR[NumCounters], 0);
+        PmiIndex = NumCounters;
+    }
+
     // Save counter register number in Counters list
     Counters[NumCounters++] = counternr;
 
@@ -552,6 +2178,135 @@ const char * CCounters::DefineCounter(SCounterDefinition & CDef) {
 }
 
 
+// Define counters for top-down analysis.
+// Newer processors give the fractions of pipeline slots directly in PERF_METRICS.
+// Older processors use the classic level 1 formulas with four slots per clock cycle
+// (return value is error message)
+const char * CCounters::DefineTopDown() {
+    const char * err;
+
+    if (MScheme != S_ID3) return "Not supported for this microprocessor";
+    switch (MFamily) {
+    case INTEL_ICELAKE: case INTEL_TIGERLAKE:
+        TopDownMode = TD_METRICS;
+        break;
+    case INTEL_GOLDENCOVE:
+        TopDownMode = TD_METRICS2;
+        break;
+    case INTEL_7: case INTEL_IVY: case INTEL_HASW: case INTEL_BROADWELL:
+    case INTEL_SKYLAKE: case INTEL_KABYLAKE:
+        TopDownMode = TD_EVENTS;
+        break;
+    default:
+        return "Not supported for this microprocessor family";
+    }
+
+    if (TopDownMode == TD_EVENTS) {
+        // Core cycles, uops not delivered, uops issued, retire slots, recovery cycles
+        static const int Types[5] = {1, 700, 701, 702, 703};
+        for (int i = 0; i < 5; i++) {
+            err = DefineCounter(Types[i]);
+            if (err) {
+                TopDownMode = TD_NONE;
+                return err;
+            }
+            TopDownCounters[i] = NumCounters - 1;
+        }
+    }
+    else {
+        // TOPDOWN.SLOTS is fixed counter 3. It may not be included in the count from CPUID
+        if (NumFixedPMCs < 4) NumFixedPMCs = 4;
+        err = DefineCounter(3);
+        if (err) {
+            TopDownMode = TD_NONE;
+            return err;
+        }
+        // PERF_METRICS and the slots counter must be cleared together before each repetition
+        RepetitionQueues.PutStart(MSR_WRITE, 0x30C, 0);
+        RepetitionQueues.PutStart(MSR_WRITE, 0x329, 0);
+        TopDownValueIndex = RepetitionQueues.PutStop(MSR_READ, 0x329);
+    }
+    return NULL;
+}
+
+// Number of top-down output columns
+int CCounters::TopDownColumns() {
+    switch (TopDownMode) {
+    case TD_METRICS: case TD_EVENTS: return 4;
+    case TD_METRICS2: return 8;
+    default: return 0;
+    }
+}
+
+// Heading of top-down output column. Level 2 columns are parts of the level 1 column above them
+const char * CCounters::TopDownName(int Column) {
+    static const char * Names[8] = {
+        "Frontend", "Bad spec", "Backend", "Retiring",
+        "Fetch lat", "Br mispr", "Mem bound", "Heavy ops"};
+    return Names[Column];
+}
+
+// Fraction of pipeline slots for top-down output column
+double CCounters::TopDownValue(int Thread, int Repetition, int Column) {
+    if (TopDownMode == TD_EVENTS) {
+        int * Results = PThreadData + Thread * (ThreadDataSize / sizeof(int)) + PMCResultsOS / sizeof(int);
+        double Count[5];
+        for (int i = 0; i < 5; i++) Count[i] = Results[Repetition + TopDownCounters[i] * NumRepetitions];
+        double Slots = 4. * Count[0];
+        if (Slots <= 0.) return 0.;
+        double Frontend = Count[1] / Slots;
+        double BadSpec  = (Count[2] - Count[3] + 4. * Count[4]) / Slots;
+        double Retiring = Count[3] / Slots;
+        switch (Column) {
+        case 0: return Frontend;
+        case 1: return BadSpec;
+        case 2: return 1. - Frontend - BadSpec - Retiring;
+        default: return Retiring;
+        }
+    }
+    // PERF_METRICS has one byte for each fraction: retiring, bad speculation, frontend bound,
+    // backend bound, heavy operations, branch mispredicts, fetch latency, memory bound
+    static const int Byte[8] = {2, 1, 3, 0, 6, 5, 7, 4};
+    uint64 Metrics = RepetitionQueues.Value(Thread, Repetition, TopDownValueIndex);
+    double Total = 0.;
+    for (int i = 0; i < 4; i++) Total += (Metrics >> (8 * i)) & 0xFF;
+    if (Total <= 0.) return 0.;
+    return ((Metrics >> (8 * Byte[Column])) & 0xFF) / Total;
+}
+
+
+// Count SMIs and hardware interrupts in each repetition.
+// The hardware interrupt counter is an ordinary counter, id 710, if there is a counter register
+// left for it. If CheckInterrupts has bit 1, the SMI count is read from MSR_SMI_COUNT before
+// and after each repetition, which costs two driver calls per repetition. Bit 2 means that the
+// check was asked for explicitly, so the caller warns when it fails
+// (return value is error message if neither can be counted)
+const char * CCounters::DefineInterruptCheck() {
+    const char * err = DefineCounter(710);
+    if ((CheckInterrupts & 2) && MVendor == INTEL && (MFamily & (INTEL_7I | INTEL_HASW | INTEL_BROADWELL
+        | INTEL_SKYLAKE | INTEL_KABYLAKE | INTEL_ATOM | INTEL_ICELAKE | INTEL_TIGERLAKE | INTEL_GOLDENCOVE
+        | INTEL_GRACEMONT))) {
+        // MSR_SMI_COUNT exists from Nehalem and Silvermont. Bonnell and Saltwell Atoms have none
+        static const int Bonnell[] = {0x1C, 0x26, 0x27, 0x35, 0x36, 0};
+        int Model = CPUDetection().GetModel(), i;
+        for (i = 0; Bonnell[i] && Model != Bonnell[i]; i++);
+        if (!(MFamily & INTEL_ATOM) || !Bonnell[i]) {
+            SMIStartIndex = RepetitionQueues.PutStart(MSR_READ, 0x34);
+            SMIStopIndex  = RepetitionQueues.PutStop(MSR_READ, 0x34);
+            if (SMIStartIndex < 0 || SMIStopIndex < 0) SMIStartIndex = SMIStopIndex = -1;
+        }
+    }
+    return HasSMICount() ? NULL : err;
+}
+
+// Number of SMIs during repetition. MSR_SMI_COUNT is 32 bits
+int CCounters::SMICount(int Thread, int Repetition) {
+    uint64 Before = RepetitionQueues.StartValue(Thread, Repetition, SMIStartIndex);
+    uint64 After  = RepetitionQueues.Value(Thread, Repetition, SMIStopIndex);
+    return int((After - Before) & 0xFFFFFFFF);
+}
+
+
 // Translate event select register number to register address for P4 processor
 int CCounters::GetP4EventSelectRegAddress(int CounterNr, int EventSelectNo) {
     // On Pentium 4 processors, the Event Select Control Registers (ESCR) are
@@ -616,6 +2371,8 @@ int CCounters::GetP4EventSelectRegAddress(int CounterNr, int EventSelectNo) {
 //    All other counters:
 //    CounterFirst = 0, CounterLast = 1, 
 //    Event = Event number, EventMask = Unit mask.
+//    This also applies to later Intel processors. The counter mask (cmask)
+//    can be put in bit 16-23 of EventMask.
 //
 // Pentium 4 and Pentium 4 with EM64T (Netburst):
 //    Set ProcessorFamily = INTEL_P4.
@@ -635,4 +2392,9 @@ int CCounters::GetP4EventSelectRegAddress(int CounterNr, int EventSelectNo) {
 //    CounterFirst = 0, CounterLast = 3, Event = Event mask,
 //    EventMask = Unit mask.
 //
+// AMD Zen
+//    Set PMCScheme = S_AMD2, ProcessorFamily = AMD_ZEN, AMD_ZEN3 or AMD_ZENALL.
+//    CounterFirst = 0, CounterLast = 5, Event = 12-bit event select,
+//    EventMask = Unit mask.
+//
 
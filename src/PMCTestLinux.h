@@ -11,10 +11,12 @@
 #include <sched.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <pthread.h>
 #include <linux/unistd.h>  // __NR_gettid
 #include <stdio.h>
@@ -101,9 +103,17 @@ static inline pid_t gettid(void) { return syscall(__NR_gettid); }
 #endif
 
 
+// Fail instead of replacing existing mappings (Linux 4.17 and later). Older kernels
+// treat it as a hint, so the address returned by mmap must be checked
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+
 // Function declaration for thread procedure
 #define ThreadProcedureDeclaration(Name) void* Name(void * parm)
 ThreadProcedureDeclaration(ThreadProc1);
+ThreadProcedureDeclaration(SamplerProc);
 
 namespace SyS {  // system-specific interface functions
 
@@ -129,6 +139,12 @@ namespace SyS {  // system-specific interface functions
         }
     }
 
+    // Get number of configured CPU cores, including cores outside our mask
+    static inline int NumProcessors() {
+        int n = (int)sysconf(_SC_NPROCESSORS_CONF);
+        return n < CPU_SETSIZE ? n : CPU_SETSIZE;
+    }
+
     // Test if specified CPU core is available
     static inline int TestProcessMask(int p, ProcMaskType * m) {
         return CPU_ISSET(p, m);
@@ -149,6 +165,40 @@ namespace SyS {  // system-specific interface functions
         setpriority(PRIO_PROCESS, 0, 0);
     } 
 
+    // Monotonic time in nanoseconds
+    static inline int64 NanoTime() {
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return (int64)t.tv_sec * 1000000000 + t.tv_nsec;
+    }
+
+    // Size of memory pages
+    static inline int PageSize() {
+        return (int)sysconf(_SC_PAGESIZE);
+    }
+
+    // Map writable memory at a fixed address. Fails if anything is mapped there already
+    static inline bool MapMemoryAt(uint64 address, int size) {
+        void * p = mmap((void*)address, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (p == MAP_FAILED) return false;
+        if (p != (void*)address) {
+            munmap(p, size);
+            return false;
+        }
+        return true;
+    }
+
+    // Unmap memory mapped by MapMemoryAt
+    static inline void UnmapMemory(uint64 address, int size) {
+        munmap((void*)address, size);
+    }
+
+    // Make mapped memory executable and read only
+    static inline bool MakeExecutable(uint64 address, int size) {
+        return mprotect((void*)address, size, PROT_READ | PROT_EXEC) == 0;
+    }
+
 }
 
 
@@ -208,6 +258,30 @@ protected:
 };
 
 
+// Class HelperThread: one thread besides the test threads, e.g. for sampling counters
+class HelperThread {
+public:
+    HelperThread() {Running = false;}
+
+    bool Start(ThreadProcedureDeclaration((*Proc)), void * parm) {
+        Running = pthread_create(&hThread, NULL, Proc, parm) == 0;
+        if (!Running) printf("\nFailed to create helper thread");
+        return Running;
+    }
+
+    void Stop() {  // wait for thread to finish
+        if (Running) pthread_join(hThread, NULL);
+        Running = false;
+    }
+
+    ~HelperThread() {Stop();}
+
+protected:
+    bool Running;
+    pthread_t hThread;
+};
+
+
 //////////////////////////////////////////////////////////////////////
 //
 //                         class CMSRDriver
@@ -252,6 +326,10 @@ public:
         return DriverFileName;
     }
 
+    int GetDriverHandle() {    // get file handle, for driver calls made directly by TestLoop
+        return DriverHandle;
+    }
+
     // send commands to driver to read or write MSR registers
     int AccessRegisters(void * pnIn, int nInLen, void * pnOut, int nOutLen) {
         if (!DriverHandle) return -1;
@@ -1,16 +1,171 @@
 from __future__ import annotations
 
+import csv
+import functools
 import os
+import queue
+import re
+import statistics
 import subprocess
 import sys
-from typing import Any, Callable, Protocol
+from concurrent.futures import Future, ThreadPoolExecutor
+from dataclasses import dataclass
+from typing import TYPE_CHECKING, Any, Callable, Protocol, TypeVar
 
 from agner.counters import get_counter_db
+from agner.isolation import measurement_cpus
+from agner.journal import Journal, point_key
+from agner.native import NativeTest
+
+if TYPE_CHECKING:
+    from collections.abc import Mapping, Sequence
 
 THIS_DIR = os.path.dirname(os.path.realpath(__file__))
 
+# Must match MAXCOUNTERS in PMCTest.h
+MAX_COUNTERS = 6
+
+# Must match MAXUNCORE in PMCTest.h
+MAX_UNCORE = 4
+
+# Must match CSampler::MAXSAMPLES in PMCTest.h
+MAX_SAMPLES = 100000
+
+# Directory that run_test builds tests in, relative to src/. TestPipeline builds in directories under it
+OUT_DIR = "out"
+
+# Objects of the harness, shared by the tests built in all directories
+HARNESS_OBJECTS = [
+    f"{OUT_DIR}/{name}.{kind}"
+    for kind in ("o", "pic.o")
+    for name in ("a64", "CounterDefinitions", "CPUDetection")
+]
+
+# Written by pmctest next to itself when last branch records are captured
+LBR_FILE = "lbr.csv"
+
+# Written by pmctest next to itself when the counters are sampled during the test
+SAMPLES_FILE = "samples.csv"
+
+# Written by pmctest next to itself when the instruction pointer is sampled on counter overflow
+PMI_FILE = "pmi.csv"
+
+# nasm listing of the test code, next to pmctest
+LISTING_FILE = "b64.lst"
+
+# A line of a nasm listing: line number, address and code bytes if any (relocated ones in brackets or
+# parentheses, "-" when they continue on the next line), include depth such as "<1>", and source
+LISTING_LINE = re.compile(
+    r"^\s*\d+ (?:([0-9A-F]{8}) ((?:[0-9A-F]{2}|[\[(][0-9A-F]+[\])])*)-?)?\s+(?:<[^>]*>\s*)?(.*)$"
+)
+
+# Width of the counter registers. Sampled counts wrap around at this many bits
+COUNTER_BITS = 48
+
+# Lists the code that pmctest copies to fixed addresses, next to pmctest
+PLACEMENT_FILE = "placement.txt"
+
+# Pieces of code that addresses in lbr.csv and pmi.csv are given in besides the placements, which are
+# numbered from 0 like PLACED_CODE_<n>: the test code, and any other code (kernel, harness, libraries)
+TEST_CODE = -1
+OTHER_CODE = -2
+
+# Core types of hybrid processors, as reported by CPUID leaf 1AH (ECoreType in PMCTest.h)
+CORE_TYPES = {"P": 0x40, "E": 0x20}
+
+# Core type used by run_test when a test doesn't ask for one; set by the --core-type option
+_default_core_type: str | None = None
+
+# Columns added by top-down analysis (fractions of pipeline slots). Level 2 columns are only
+# given by Golden Cove and later, each is part of the level 1 column in the same position
+TOPDOWN_LEVEL1 = ["Frontend", "Bad spec", "Backend", "Retiring"]
+TOPDOWN_LEVEL2 = ["Fetch lat", "Br mispr", "Mem bound", "Heavy ops"]
+TOPDOWN_COLUMNS = TOPDOWN_LEVEL1 + TOPDOWN_LEVEL2
+
+# Do top-down analysis in every run_test; set by the --topdown option
+_default_topdown = False
+
+# Columns with the number of hardware interrupts and SMIs in each repetition, as far as the processor
+# can count them. Given when run_test checks for interrupts
+INTERRUPT_COLUMNS = ["HwIntr", "SMI"]
+
+# Columns with the RAPL energy of each domain in each repetition in millijoules, which are divided by the
+# iterations like counts, and the average power of the package in watts. Given when run_test measures energy
+ENERGY_COLUMNS = ["Pkg mJ", "Core mJ", "DRAM mJ"]
+POWER_COLUMN = "Pkg W"
+
+# RAPL counters are updated about every millisecond, so repetitions that measure energy are calibrated to
+# this many clock cycles instead of TARGET_CLOCKS. Shorter repetitions give a warning
+ENERGY_TARGET_CLOCKS = 30000000
+ENERGY_MIN_SECONDS = 0.005
+
+# Drop repetitions that were interrupted; set by the --keep-interrupted option
+_default_drop_interrupted = True
+
+# Run tests through out/libpmctest.so instead of out/pmctest; set by the --native option
+_default_native = False
+
+# Inputs of the last test run natively and its loaded library
+_native_test: tuple[Any, NativeTest] | None = None
+
+# Module with the test code that the driver runs for kernel=True, relative to the test's directory,
+# and the inputs of the test whose module is loaded
+KERNEL_MODULE = "kmod/MSRrun.ko"
+_kernel_module_test: tuple[Any, ...] | None = None
+
+# Journal that run_test records its results in and replays them from; set by Agner.run_tests
+_journal: Journal | None = None
+
+# Options of run_test whose results are read from files afterwards, so can't be taken from the journal
+UNJOURNALED_OPTIONS = ("lbr", "sample_interval", "pmi_period")
+
+# Clock count that each repetition is calibrated to take when run_test isn't given the number of iterations
+TARGET_CLOCKS = 20000
+
+# Columns of pmctest output that aren't counts, so aren't divided by the number of iterations
+UNSCALED_COLUMNS = {"Thread", "Processor", "CoreType", *TOPDOWN_COLUMNS, *INTERRUPT_COLUMNS, POWER_COLUMN}
+
+
+def core_type_id(core_type: str | None) -> int:
+    """Translate "P"/"E" to the CPUID core type, or 0 for no preference."""
+    if core_type is None:
+        return 0
+    if core_type not in CORE_TYPES:
+        raise ValueError(f"Unknown core type {core_type!r}, expected one of {', '.join(CORE_TYPES)}")
+    return CORE_TYPES[core_type]
+
+
+def set_default_core_type(core_type: str | None) -> None:
+    core_type_id(core_type)  # validate
+    global _default_core_type
+    _default_core_type = core_type
+
+
+def set_default_topdown(topdown: bool) -> None:
+    global _default_topdown
+    _default_topdown = topdown
+
+
+def set_default_drop_interrupted(drop: bool) -> None:
+    global _default_drop_interrupted
+    _default_drop_interrupted = drop
+
+
+def set_default_native(native: bool) -> None:
+    global _default_native
+    _default_native = native
+
+
+def set_native_test(test: tuple[Any, NativeTest] | None) -> None:
+    """Keep the library of the last test run natively, unloading the one before."""
+    global _native_test
+    if _native_test is not None:
+        _native_test[1].close()
+    _native_test = test
+
+
 # Type aliases
-CounterData = dict[str, int]
+CounterData = dict[str, float]  # counts are int, top-down fractions are float
 TestResults = list[CounterData]
 # Allow any JSON-serializable result type for flexibility
 AnyResults = Any
@@ -20,6 +175,87 @@ TestPlotter = Callable[[AnyResults, bool], None]
 PlotCallback = Callable[[str, str], None]
 
 
+@dataclass(frozen=True)
+class LbrRecord:
+    """One last branch record taken inside the test code or the placed code.
+
+    Each address is given by the piece of code it is in and the offset into it: TEST_CODE with offsets
+    from the TestCodeStart label in out/b64.lst, or the index of a CodePlacement with offsets from its
+    address. A branch to OTHER_CODE has the address itself as to_offset. Records are numbered from the
+    oldest within each repetition. cycles is -1 when the processor doesn't report it.
+    """
+
+    thread: int
+    repetition: int
+    record: int
+    from_piece: int
+    from_offset: int
+    to_piece: int
+    to_offset: int
+    mispredicted: bool
+    cycles: int
+
+
+@dataclass(frozen=True)
+class PmiSample:
+    """One instruction pointer sampled on counter overflow.
+
+    piece is the code it is in, like the addresses of an LbrRecord: TEST_CODE with offset from the
+    TestCodeStart label in out/b64.lst, the index of a CodePlacement with offset from its address (the
+    addresses of its listing placed_<n>.lst), or OTHER_CODE with offset -1. Due to skid it is an
+    instruction or a few after the one that overflowed the counter.
+    """
+
+    thread: int
+    piece: int
+    offset: int
+
+
+@dataclass(frozen=True)
+class CounterSamples:
+    """Counts of the first thread in each interval between samples of its counters.
+
+    times are the ends of the intervals in microseconds from the start of the test.
+    The counts also include the harness code between repetitions. Only the last
+    MAX_SAMPLES samples are kept.
+    """
+
+    times: list[float]
+    counts: dict[str, list[int]]
+
+
+@dataclass(frozen=True)
+class CodePlacement:
+    """Test code that pmctest copies to a fixed virtual address before the test runs.
+
+    The code is assembled for its address, so it can jump directly to other placed code within
+    2GB. run_test defines PLACED_CODE_<n> as the address of the n'th piece; the test code enters
+    it with an indirect call or jump, e.g. `mov rax, PLACED_CODE_0` and `call rax`.
+    """
+
+    address: int
+    code: str
+
+
+@dataclass(frozen=True)
+class ThreadCode:
+    """The code of one thread, for tests where threads run different code, e.g. a producer and a consumer.
+
+    role names the thread's rows in results_by_role. Each body runs in its own loop, so labels
+    must differ between the threads. init_once and init_each run after the ones given to run_test.
+
+    A background thread, e.g. an aggressor, runs its body until the other threads have finished
+    all their repetitions, instead of for the inner iterations. Its counts then only tell how much
+    it ran. The first thread can't be a background thread, as it calibrates the inner iterations.
+    """
+
+    role: str
+    test: str
+    init_once: str = ""
+    init_each: str = ""
+    background: bool = False
+
+
 class TestModule(Protocol):
     """Protocol for test modules that can be dynamically loaded."""
 
@@ -68,15 +304,32 @@ class Agner:
         assert self._cur_test is not None  # Always called within add_tests context
         self._tests[self._cur_test][name] = Test(name, runner, plotter)
 
-    def run_tests(self, tests: list[str]) -> AllResults:
+    def run_tests(self, tests: list[str], journal: Journal | None = None) -> AllResults:
+        """Run the tests that match. With a journal, each point and subtest is recorded as it finishes,
+        and the subtests the journal has finished are not run again."""
+        global _journal
         results: AllResults = {}
         for test, subtests in self._tests.items():
             results[test] = {}
             for subtest, tester in subtests.items():
                 if not filter_match(tests, test, subtest):
                     continue
+                finished = journal.finished(test, subtest) if journal else None
+                if finished is not None:
+                    print(f"Skipping {test}.{subtest}, finished in the journal")
+                    results[test][subtest] = finished
+                    continue
                 print(f"Running {test}.{subtest} ...")
-                results[test][subtest] = tester.runner()
+                if journal is None:
+                    results[test][subtest] = tester.runner()
+                    continue
+                journal.begin(test, subtest)
+                _journal = journal
+                try:
+                    results[test][subtest] = tester.runner()
+                finally:
+                    _journal = None
+                journal.finish(results[test][subtest])
         return results
 
     def plot_results(
@@ -96,58 +349,725 @@ class Agner:
                     callback(test, subtest)
 
 
-def run_test(
-    test: str,
+@dataclass(frozen=True)
+class BuiltTest:
+    """A test assembled by build_test in its directory, ready for measure_test."""
+
+    directory: str
+    inputs: dict[str, str]  # generated files in the directory and their contents
+    placements: tuple[CodePlacement, ...]
+    native: bool
+    built: bool  # False if the library of the same code is still loaded, so nothing was built
+    procs: int
+    topdown: bool
+    check_interrupts: bool
+    drop_interrupted: bool
+    energy: bool
+    kernel: bool  # the driver runs kernel.bin from the test's module (KERNEL_MODULE)
+    metrics: tuple[str, ...]  # columns computed by pmctest, which aren't divided by the iterations
+
+    @property
+    def key(self) -> tuple[Any, ...]:
+        return _test_key(self.directory, self.inputs)
+
+    @property
+    def placed_files(self) -> list[str]:
+        return [os.path.join(self.directory, f"placed_{index}.bin") for index in range(len(self.placements))]
+
+
+def _test_key(directory: str, inputs: dict[str, str]) -> tuple[Any, ...]:
+    """What a loaded library is kept for: the same generated files in the same directory."""
+    return (directory, *sorted(inputs.items()))
+
+
+def build_test(
+    test: str | Sequence[ThreadCode],
     counters: list[int | str],
     init_once: str = "",
     init_each: str = "",
     repetitions: int = 3,
     procs: int = 1,
-) -> TestResults:
+    core_type: str | None = None,
+    lbr: bool = False,
+    topdown: bool | None = None,
+    iterations: int | None = None,
+    placements: Sequence[CodePlacement] = (),
+    check_interrupts: bool | None = None,
+    check_smi: bool = False,
+    drop_interrupted: bool | None = None,
+    native: bool | None = None,
+    directory: str = OUT_DIR,
+    cpus: Sequence[int] | None = None,
+    build_cpus: set[int] | None = None,
+    sample_interval: int = 0,
+    pmi_period: int = 0,
+    pmi_counter: int | str | None = None,
+    energy: bool = False,
+    kernel: bool = False,
+    metrics: Mapping[str, str] | None = None,
+) -> BuiltTest:
+    """Generate the files of a test in directory and assemble it. Run it with measure_test.
+
+    Each repetition runs the test code in a loop of `iterations`. By default the number of
+    iterations is calibrated so that a repetition takes about TARGET_CLOCKS clock cycles.
+    Counts are divided by the number of iterations, which is given in the "Iterations" column.
+    ebp is the loop counter, so the test code must not change it.
+
+    placements are copied to their addresses before the test runs, see CodePlacement and jump_chain.
+
+    test is either the code that all threads run, or a ThreadCode for each thread. Thread r15d then
+    runs the code of test[r15d], and procs is the number of ThreadCodes. The counters are the same
+    in all threads. Results of more than one thread have a "Thread" column.
+
+    On hybrid processors, core_type "P" or "E" runs all threads on that type of core and
+    selects the counter definitions for it. Results then have a "CoreType" column.
+    Ignored on other processors.
+
+    With lbr, the last branch records of each repetition are captured; get them with read_lbr().
+
+    With sample_interval, the counters of the first thread are read every sample_interval microseconds
+    while the test runs, to see how the counts change over a long test (e.g. while predictors warm up
+    or the frequency drops); get them with read_samples(). The reads are done from another processor,
+    but each one interrupts the first thread briefly. Use few repetitions with many iterations.
+
+    With pmi_period, each thread's instruction pointer is sampled every pmi_period events of pmi_counter
+    (one of the counters, by default the first); get the samples with read_pmi() and the listing of
+    the test code with the samples of each instruction from annotate_listing(). This finds the
+    expensive instructions of a large test. pmi_counter must use a general purpose counter (not a
+    fixed one like core cycles on Intel), and its own counts are then meaningless. Needs the driver
+    from driver/, and the NMI watchdog (kernel.nmi_watchdog) should be off.
+
+    Uncore counters (those listed with uncore=True by the CounterDB, e.g. "L3 Miss") count events of
+    the whole socket, such as L3 lookups and memory requests, in columns after the core counters.
+    Other processes on the socket add to their counts, so use them on a quiet machine. Up to
+    MAX_UNCORE can be used besides the MAX_COUNTERS core counters. Needs the driver from driver/.
+
+    With energy, the RAPL energy counters (package, and cores or DRAM) are read before and after each
+    repetition, giving the ENERGY_COLUMNS the processor has in millijoules per iteration, and the
+    average package power in POWER_COLUMN. A summary is printed. The counters are updated about every
+    millisecond, so the iterations are calibrated to ENERGY_TARGET_CLOCKS; the energy of the whole
+    package includes everything else running on it. Needs the driver from driver/.
+
+    With topdown, results also have the TOPDOWN_COLUMNS fractions of pipeline slots the processor
+    supports, and a summary is printed. The counters needed take up to five of the MAX_COUNTERS.
+
+    With check_interrupts, hardware interrupts (if a counter is left for them) in each repetition are
+    counted in the INTERRUPT_COLUMNS, and with check_smi also SMIs (Intel, from Nehalem and Silvermont).
+    Reading the SMI count takes two driver calls in each repetition. Interrupted repetitions are dropped unless
+    drop_interrupted is False or all were interrupted, and reported along with the interrupts
+    /proc/interrupts saw on the processors used. By default interrupts are checked with check_smi, or when
+    the processor has the "HwIntr" counter and fewer than MAX_COUNTERS counters are used; only an explicit
+    check_interrupts warns when they can't be counted.
+
+    With native, the test runs in this process through libpmctest.so instead of pmctest.
+    The library stays loaded, so running the same code again skips assembling, linking and setting
+    up the counters and driver.
+
+    With kernel, the driver runs the test code in the kernel on the test's processor, with preemption
+    and interrupts disabled, for near noise free counts of short tests with few repetitions. Only NMIs
+    and SMIs can disturb it. No repetition starts after 100 ms, and the driver refuses iteration counts
+    that make one repetition longer than that. The test code runs in ring 0, so it must only use
+    registers, the stack and the user data at rsi: no system calls or placements. One thread only,
+    without lbr, topdown, sample_interval, pmi_period, energy or uncore counters; the interrupt check
+    is off. The test code is built into a kernel module of its own (driver/MSRrun.c), which needs the
+    kernel headers, the driver from driver/ built with KERNEL_RUN, and sudo to load it.
+
+    metrics are extra columns that pmctest computes from the others in each repetition, by name, e.g.
+    {"IPC": "Instruct / Core cyc", "MPKI": "1000 * L1D Miss / Instruct"}. Expressions have numbers,
+    column names (which may contain spaces), earlier metrics, Iterations, + - * / and parentheses; dividing
+    by zero gives 0. They are computed from the counts of whole repetitions, so are not divided by the
+    iterations like counts are: divide by Iterations in the expression for a value per iteration.
+
+    cpus are the processors to run the threads on, e.g. from smt_siblings. By default pmctest
+    chooses them (see measurement_cpus). build_cpus restricts the assembler and linker to these processors.
+    """
     os.chdir(os.path.join(THIS_DIR, ".."))
-    sys.stdout.flush()
+
+    core_id = core_type_id(core_type if core_type is not None else _default_core_type)
+    if topdown is None:
+        topdown = _default_topdown
+    if drop_interrupted is None:
+        drop_interrupted = _default_drop_interrupted
+    if native is None:
+        native = _default_native
 
     # Convert counter names to IDs and validate
-    db = get_counter_db()
+    db = get_counter_db(core_id)
     counter_ids, errors = db.validate_counters(counters)
     if errors:
         error_msg = "Counter validation failed:\n" + "\n".join(f"  - {err}" for err in errors)
         raise ValueError(error_msg)
+    uncore_ids = [counter for counter in counter_ids if (info := db.get_counter(counter)) and info.uncore]
+    core_ids = [counter for counter in counter_ids if counter not in uncore_ids]
+    if len(core_ids) > MAX_COUNTERS:
+        raise ValueError(f"At most {MAX_COUNTERS} counters can be used, got {len(core_ids)}")
+    if len(uncore_ids) > MAX_UNCORE:
+        raise ValueError(f"At most {MAX_UNCORE} uncore counters can be used, got {len(uncore_ids)}")
+
+    pmi_id = 0
+    if pmi_period:
+        sampled = counters[0] if pmi_counter is None else pmi_counter
+        if sampled not in counters:
+            raise ValueError(f"pmi_counter {sampled!r} is not one of the counters")
+        pmi_id = counter_ids[counters.index(sampled)]
+        if pmi_id in uncore_ids:
+            raise ValueError(f"pmi_counter {sampled!r} is an uncore counter")
+
+    thread_bodies = not isinstance(test, str)
+    if not isinstance(test, str):
+        threads = list(test)
+        if procs not in (1, len(threads)):
+            raise ValueError(f"Test has code for {len(threads)} threads, but procs is {procs}")
+        procs = len(threads)
+        test = thread_loops(threads)
+        init_once += per_thread_code("InitOnce", [thread.init_once for thread in threads])
+        init_each += per_thread_code("InitEach", [thread.init_each for thread in threads])
+
+    # Only an explicit request warns when there is no interrupt counter or no counter register left for it
+    warn_interrupts = bool(check_interrupts)
+    if check_interrupts is None:
+        check_interrupts = check_smi or (db.is_supported("HwIntr") and len(core_ids) < MAX_COUNTERS)
+
+    if kernel:
+        unsupported = lbr or topdown or sample_interval or pmi_period or energy or uncore_ids or placements
+        if procs > 1 or thread_bodies or unsupported:
+            raise ValueError(
+                "Test code in the kernel runs in one thread, without ThreadCode, lbr, topdown, sample_interval,"
+                " pmi_period, energy, uncore counters or placements"
+            )
+        # Interrupts are disabled while it runs
+        check_interrupts = False
+
+    # Leave room for the counters that pmctest adds for top-down analysis and the interrupt check
+    num_counters = MAX_COUNTERS if topdown else min(MAX_COUNTERS, len(core_ids) + int(check_interrupts))
 
     # Generate all .inc files
-    with open("out/params.inc", "w") as f:
-        f.write(f"%define REPETITIONS {repetitions}\n")
-        f.write(f"%define NUM_THREADS {procs}\n")
+    params = [
+        f"%define REPETITIONS {repetitions}",
+        f"%define NUM_THREADS {procs}",
+        f"%define NUM_COUNTERS {num_counters}",
+        f"%define NUM_UNCORE {len(uncore_ids)}",
+        f"%define CORE_TYPE {core_id}",
+        f"%define USE_LBR {int(lbr)}",
+        f"%define TOPDOWN {int(topdown)}",
+        f"%define CHECK_INTERRUPTS {(1 | 2 * check_smi | 4 * warn_interrupts) if check_interrupts else 0}",
+        f"%define SAMPLE_INTERVAL {sample_interval}",
+        f"%define PMI_PERIOD {pmi_period}",
+        f"%define PMI_COUNTER {pmi_id}",
+        f"%define INNER_ITERATIONS {iterations or 0}",
+        f"%define ENERGY {int(energy)}",
+        f"%define TARGET_CLOCKS {ENERGY_TARGET_CLOCKS if energy else TARGET_CLOCKS}",
+        f"%define THREAD_BODIES {int(thread_bodies)}",
+        f"%define KERNEL_MODE {int(kernel)}",
+        *([f"%define PROCESSOR_LIST {', '.join(str(cpu) for cpu in cpus)}"] if cpus else []),
+        *(f"%define PLACED_CODE_{index} {piece.address:#x}" for index, piece in enumerate(placements)),
+    ]
+    metrics = dict(metrics or {})
+    for name, expression in metrics.items():
+        if not name.strip() or any(char in name + expression for char in "=#\n"):
+            raise ValueError(f"Bad metric {name!r}: {expression!r}")
+    inputs = {
+        "params.inc": "".join(f"{line}\n" for line in params),
+        "metrics.txt": "".join(f"{name} = {expression}\n" for name, expression in metrics.items()),
+        "counters.inc": "".join(f"    DD {counter}\n" for counter in core_ids),
+        "uncore.inc": "".join(f"    DD {counter}\n" for counter in uncore_ids),
+        "test.inc": test,
+        "init_once.inc": init_once,
+        "init_each.inc": init_each,
+        **{
+            f"placed_{index}.asm": f"bits 64\norg {piece.address:#x}\n{piece.code}\n"
+            for index, piece in enumerate(placements)
+        },
+    }
+    # The same code is often run again, e.g. by sweeps. Its library is still loaded and set up
+    loaded = native and _native_test is not None and _native_test[0] == _test_key(directory, inputs)
+    built = BuiltTest(
+        directory=directory,
+        inputs=inputs,
+        placements=tuple(placements),
+        native=native,
+        built=not loaded,
+        procs=procs,
+        topdown=topdown,
+        check_interrupts=check_interrupts,
+        drop_interrupted=drop_interrupted,
+        energy=energy,
+        kernel=kernel,
+        metrics=tuple(metrics),
+    )
+    if built.built:
+        _build(built, build_cpus)
+    return built
+
+
+def _build(built: BuiltTest, cpus: set[int] | None = None) -> None:
+    """Write the generated files of a test and let Make handle all compilation and linking."""
+    os.makedirs(built.directory, exist_ok=True)
+    for name, text in built.inputs.items():
+        path = os.path.join(built.directory, name)
+        # Unchanged files keep their time, so Make doesn't rebuild
+        if os.path.exists(path):
+            with open(path) as f:
+                if f.read() == text:
+                    continue
+        with open(path, "w") as f:
+            f.write(text)
+
+    program = "libpmctest.so" if built.native else "pmctest"
+    targets = [program, *([KERNEL_MODULE] if built.kernel else [])]
+    subprocess.check_call(
+        [
+            "make",
+            "-s",
+            f"OUT={built.directory}",
+            *(os.path.join(built.directory, target) for target in targets),
+            *built.placed_files,
+        ],
+        preexec_fn=functools.partial(os.sched_setaffinity, 0, cpus) if cpus else None,
+    )
+
+    placement_file = os.path.join(built.directory, PLACEMENT_FILE)
+    if os.path.exists(placement_file):
+        os.remove(placement_file)
+    if built.placements:
+        write_placement_file(built.placements, built.placed_files, placement_file)
+
+
+def load_kernel_module(built: BuiltTest) -> None:
+    """Load the module with the test code of a kernel=True test for the driver to run, with sudo."""
+    global _kernel_module_test
+    if _kernel_module_test == built.key:
+        return
+    _kernel_module_test = None
+    driver_dir = os.path.join(THIS_DIR, "..", "driver")
+    module = os.path.abspath(os.path.join(built.directory, KERNEL_MODULE))
+    subprocess.check_call(["sudo", "./load_test.sh", module], cwd=driver_dir)
+    _kernel_module_test = built.key
+
+
+def measure_test(built: BuiltTest) -> TestResults:
+    """Run a test built by build_test, returning one dict of counts per iteration for each repetition."""
+    sys.stdout.flush()
+    if built.kernel:
+        load_kernel_module(built)
+    for name in (LBR_FILE, SAMPLES_FILE, PMI_FILE):
+        path = os.path.join(built.directory, name)
+        if os.path.exists(path):
+            os.remove(path)
+    if built.native:
+        if _native_test is not None and _native_test[0] == built.key:
+            native_test = _native_test[1]
+        else:
+            set_native_test(None)
+            if not built.built:
+                _build(built)
+            native_test = NativeTest(os.path.join(built.directory, "libpmctest.so"))
+            set_native_test((built.key, native_test))
+        interrupts_before = read_interrupts()
+        columns = native_test.run()
+        interrupts_after = read_interrupts()
+        names = list(columns)
+        results: TestResults = [dict(zip(names, row)) for row in zip(*(columns[name].tolist() for name in names))]
+        metadata = {
+            "InnerIterations": str(native_test.inner_iterations),
+            "Processors": ",".join(str(p) for p in native_test.processors(built.procs)),
+        }
+    else:
+        interrupts_before = read_interrupts()
+        output = subprocess.check_output([os.path.join(built.directory, "pmctest")], text=True)
+        interrupts_after = read_interrupts()
+        results, metadata = parse_output(output)
+    inner_iterations = int(metadata["InnerIterations"])
+    for row in results:
+        for column in row:
+            if column not in UNSCALED_COLUMNS and column not in built.metrics:
+                row[column] /= inner_iterations
+        row["Iterations"] = inner_iterations
+    if built.check_interrupts:
+        processors = [int(p) for p in metadata.get("Processors", "").split(",") if p]
+        proc_deltas = interrupt_deltas(interrupts_before, interrupts_after, processors)
+        results = handle_interrupts(results, built.drop_interrupted, proc_deltas)
+    if built.topdown:
+        print_topdown(results)
+    if built.energy:
+        print_energy(results)
+    return results
+
+
+def thread_loops(threads: Sequence[ThreadCode]) -> str:
+    """Test code that runs the body of thread r15d in a loop of the inner iterations (ebp), or until
+    the other threads are done (ThreadsDone) for background threads."""
+    if threads and threads[0].background:
+        raise ValueError("The first thread can't be a background thread")
+    foreground = sum(1 for thread in threads if not thread.background)
+    lines = []
+    for index in range(len(threads)):
+        lines += [f"cmp r15d, {index}", f"je ThreadBody{index}"]
+    for index, thread in enumerate(threads):
+        lines += ["align 16", f"ThreadBody{index}:", thread.test]
+        if thread.background:
+            lines += [f"cmp dword [ThreadsDone], {foreground}", f"jb ThreadBody{index}"]
+        else:
+            lines += ["dec ebp", f"jnz ThreadBody{index}"]
+        lines.append("jmp ThreadBodiesEnd")
+    lines.append("ThreadBodiesEnd:")
+    return "\n".join(lines) + "\n"
+
+
+def per_thread_code(name: str, codes: Sequence[str]) -> str:
+    """Code where thread r15d runs codes[r15d]. name makes the labels unique."""
+    lines = []
+    for index, code in enumerate(codes):
+        if code:
+            lines += [f"cmp r15d, {index}", f"jne {name}Skip{index}", code, f"{name}Skip{index}:"]
+    return "\n" + "\n".join(lines) + "\n" if lines else ""
 
-    with open("out/counters.inc", "w") as f:
-        [f.write(f"    DD {counter}\n") for counter in counter_ids]
 
-    with open("out/test.inc", "w") as f:
-        f.write(test)
+def results_by_role(results: TestResults, threads: Sequence[ThreadCode]) -> dict[str, TestResults]:
+    """Split the results of a test with a ThreadCode for each thread by the threads' roles."""
+    by_role: dict[str, TestResults] = {thread.role: [] for thread in threads}
+    for row in results:
+        by_role[threads[int(row["Thread"])].role].append(row)
+    return by_role
+
+
+def journal_key(test: str | Sequence[ThreadCode], counters: list[int | str], options: dict[str, Any]) -> str:
+    """point_key of a run_test, with the defaults set by the command line for the options it leaves out,
+    so that a run resumed with other defaults measures again instead of replaying the journal."""
+    defaults = {
+        "core_type": _default_core_type,
+        "topdown": _default_topdown,
+        "drop_interrupted": _default_drop_interrupted,
+        "native": _default_native,
+    }
+    given = {name: value for name, value in options.items() if value is not None}
+    return point_key(test, counters, {**defaults, **given})
+
+
+def run_test(test: str | Sequence[ThreadCode], counters: list[int | str], **options: Any) -> TestResults:
+    """Assemble and run a test, returning one dict of counts per iteration for each repetition.
+
+    The options are those of build_test. To build further tests while this one runs, use TestPipeline.
+    """
+    if _journal is None or any(options.get(option) for option in UNJOURNALED_OPTIONS):
+        return measure_test(build_test(test, counters, **options))
+    point, journaled = _journal.point(journal_key(test, counters, options))
+    if journaled is not None:
+        return journaled
+    results = measure_test(build_test(test, counters, **options))
+    _journal.record(point, results)
+    return results
 
-    with open("out/init_once.inc", "w") as f:
-        f.write(init_once)
 
-    with open("out/init_each.inc", "w") as f:
-        f.write(init_each)
+class TestPipeline:
+    """Builds tests ahead of measuring them, so that the measurements don't wait for nasm and the linker.
 
-    # Let Make handle all compilation and linking
-    subprocess.check_call(["make", "-s", "out/pmctest"])
+    submit() takes the arguments of run_test and returns a Future of its results. Up to `depth`
+    tests are built at the same time, each in its own directory under out/, on the processors that
+    the measurements don't use. Tests are measured one at a time, in the order submitted. submit()
+    waits while all directories are in use. Tests that the journal has results for aren't built.
+    """
 
-    # Run test
-    result = subprocess.check_output(["out/pmctest"], text=True)
+    def __init__(self, depth: int = 2) -> None:
+        os.chdir(os.path.join(THIS_DIR, ".."))
+        # Parallel builds would race to build the objects they share
+        subprocess.check_call(["make", "-s", *HARNESS_OBJECTS])
+        self._builder = ThreadPoolExecutor(depth)
+        self._measurer = ThreadPoolExecutor(1)
+        self._directories: queue.Queue[str] = queue.Queue()
+        for index in range(depth + 1):
+            self._directories.put(os.path.join(OUT_DIR, f"pipeline_{index}"))
+
+    def submit(
+        self, test: str | Sequence[ThreadCode], counters: list[int | str], **options: Any
+    ) -> Future[TestResults]:
+        if options.get("lbr") or options.get("sample_interval") or options.get("pmi_period"):
+            raise ValueError("The branch records or samples of a pipelined test can't be read; use run_test")
+        if options.get("energy"):
+            raise ValueError("Builds running alongside add to the package energy; use run_test")
+        journal = _journal
+        point = None
+        if journal is not None:
+            point, journaled = journal.point(journal_key(test, counters, options))
+            if journaled is not None:
+                done: Future[TestResults] = Future()
+                done.set_result(journaled)
+                return done
+        core_type = options.get("core_type") or _default_core_type
+        procs = options.get("procs", 1) if isinstance(test, str) else len(test)
+        measuring = options.get("cpus") or measurement_cpus(procs, core_type)
+        others = set(os.sched_getaffinity(0)) - set(measuring)
+        directory = self._directories.get()
+        built = self._builder.submit(
+            build_test, test, counters, directory=directory, build_cpus=others or None, **options
+        )
+
+        def measure() -> TestResults:
+            try:
+                results = measure_test(built.result())
+            finally:
+                self._directories.put(directory)
+            if journal is not None and point is not None:
+                journal.record(point, results)
+            return results
+
+        return self._measurer.submit(measure)
+
+    def close(self) -> None:
+        """Wait for the submitted tests."""
+        self._builder.shutdown()
+        self._measurer.shutdown()
+
+    def __enter__(self) -> TestPipeline:
+        return self
+
+    def __exit__(self, *exc: object) -> None:
+        self.close()
+
+
+def parse_output(output: str) -> tuple[TestResults, dict[str, str]]:
+    """Rows of the CSV output of pmctest, and the "# key: value" lines before them."""
     results: TestResults = []
     header: list[str] | None = None
-    for line in result.split("\n"):
+    metadata: dict[str, str] = {}
+    for line in output.split("\n"):
         line = line.strip()
         if not line:
             continue
+        if line.startswith("#"):
+            key, _, value = line[1:].partition(":")
+            metadata[key.strip()] = value.strip()
+            continue
         split = line.split(",")
         if not header:
             header = split
         else:
-            results.append(dict(zip(header, [int(x) for x in split])))
-    return results
+            # Integers may be hexadecimal (TempOut)
+            results.append(dict(zip(header, [float(x) if "." in x else int(x, 0) for x in split])))
+    return results, metadata
+
+
+def read_interrupts() -> dict[str, list[int]]:
+    """Interrupt counts per processor from /proc/interrupts, by interrupt name. Empty if not available."""
+    try:
+        with open("/proc/interrupts") as f:
+            lines = f.read().splitlines()
+    except OSError:
+        return {}
+    if not lines:
+        return {}
+    num_cpus = len(lines[0].split())
+    counts = {}
+    for line in lines[1:]:
+        name, _, rest = line.partition(":")
+        values = rest.split()[:num_cpus]
+        if values and all(value.isdigit() for value in values):
+            counts[name.strip()] = [int(value) for value in values]
+    return counts
+
+
+def interrupt_deltas(
+    before: dict[str, list[int]], after: dict[str, list[int]], processors: list[int]
+) -> dict[str, int]:
+    """Number of each interrupt on the given processors between two read_interrupts()."""
+    deltas = {}
+    for name, counts in after.items():
+        if name not in before:
+            continue
+        delta = sum(counts[p] - before[name][p] for p in processors if p < len(counts) and p < len(before[name]))
+        if delta:
+            deltas[name] = delta
+    return deltas
+
+
+def handle_interrupts(results: TestResults, drop: bool, proc_deltas: dict[str, int]) -> TestResults:
+    """Report the repetitions that were interrupted and drop them if asked to, unless that would drop all."""
+    columns = [column for column in INTERRUPT_COLUMNS if results and column in results[0]]
+
+    def was_interrupted(row: CounterData) -> bool:
+        return any(row[column] for column in columns)
+
+    interrupted = [row for row in results if was_interrupted(row)]
+    if not interrupted:
+        return results
+    by_column = ", ".join(f"{sum(1 for row in interrupted if row[column])} by {column}" for column in columns)
+    top = sorted(proc_deltas.items(), key=lambda item: -item[1])[:3]
+    proc_summary = ", ".join(f"{name} {count}" for name, count in top)
+    keep = not drop or len(interrupted) == len(results)
+    print(
+        f"  interrupted: {len(interrupted)} of {len(results)} repetitions ({by_column}), "
+        f"{'kept' if keep else 'dropped'}; /proc/interrupts during the run: {sum(proc_deltas.values())}"
+        + (f" ({proc_summary})" if proc_summary else "")
+    )
+    if keep:
+        return results
+    return [row for row in results if not was_interrupted(row)]
+
+
+def write_placement_file(placements: Sequence[CodePlacement], placed_files: list[str], placement_file: str) -> None:
+    """Tell pmctest where to copy the assembled pieces of code, checking that they don't overlap.
+
+    The pieces are listed in the order of placements, which is how lbr.csv and pmi.csv number them.
+    """
+    pieces = sorted(zip(placements, placed_files), key=lambda p: p[0].address)
+    for (piece, placed_file), (next_piece, _) in zip(pieces, pieces[1:]):
+        if piece.address + os.path.getsize(placed_file) > next_piece.address:
+            raise ValueError(f"Code placed at {piece.address:#x} overlaps code placed at {next_piece.address:#x}")
+    with open(placement_file, "w") as f:
+        for piece, placed_file in zip(placements, placed_files):
+            f.write(f"{piece.address:x} {os.path.abspath(placed_file)}\n")
+
+
+def jump_chain(addresses: Sequence[int], max_gap: int = 0x10000) -> list[CodePlacement]:
+    """Code with a jmp at each of the addresses to the next, and a ret after the last.
+
+    Enter it with a call to addresses[0]. Addresses must be increasing, and far enough apart for
+    the jumps. Addresses less than max_gap apart share a piece of code, padded with int3. The
+    jumps are direct unless the next address is out of reach of a rel32 jump.
+    """
+    pieces = []
+    lines: list[str] = []
+    start = 0
+    for index, address in enumerate(addresses):
+        if index and address <= addresses[index - 1]:
+            raise ValueError("Addresses of a jump chain must be increasing")
+        if index and address - addresses[index - 1] >= max_gap:
+            pieces.append(CodePlacement(start, "\n".join(lines)))
+            lines = []
+        if not lines:
+            start = address
+        lines.append(f"times {address - start} - ($ - $$) int3")
+        if index + 1 == len(addresses):
+            lines.append("ret")
+        elif abs(addresses[index + 1] - address) < 1 << 31:
+            lines.append(f"jmp {addresses[index + 1]:#x}")
+        else:
+            lines += [f"mov rax, {addresses[index + 1]:#x}", "jmp rax"]
+    if lines:
+        pieces.append(CodePlacement(start, "\n".join(lines)))
+    return pieces
+
+
+def print_topdown(results: TestResults) -> None:
+    """Print the median top-down fractions of a test as a first look at where the slots go."""
+    columns = [column for column in TOPDOWN_COLUMNS if results and column in results[0]]
+    summary = ", ".join(f"{column} {statistics.median(r[column] for r in results):.1%}" for column in columns)
+    print(f"  top-down: {summary}")
+
+
+def print_energy(results: TestResults) -> None:
+    """Print the median energy per iteration of each RAPL domain and the average package power."""
+    columns = [column for column in ENERGY_COLUMNS if results and column in results[0]]
+    if not columns:
+        return
+    # Millijoules per iteration to nanojoules
+    energy = ", ".join(
+        f"{column.split()[0]} {statistics.median(r[column] for r in results) * 1e6:.4g} nJ" for column in columns
+    )
+    print(f"  energy per iteration: {energy}, package {statistics.median(r[POWER_COLUMN] for r in results):.1f} W")
+    seconds = [r["Pkg mJ"] * r["Iterations"] / 1000 / r[POWER_COLUMN] for r in results if r[POWER_COLUMN]]
+    if not seconds or statistics.median(seconds) < ENERGY_MIN_SECONDS:
+        print("  Warning: repetitions are too short for the energy counters, use more iterations")
+
+
+def read_lbr(directory: str = OUT_DIR) -> list[LbrRecord]:
+    """Read the last branch records written by the last run_test(..., lbr=True)."""
+    with open(os.path.join(THIS_DIR, "..", directory, LBR_FILE)) as f:
+        return [
+            LbrRecord(
+                thread=int(row["Thread"]),
+                repetition=int(row["Repetition"]),
+                record=int(row["Record"]),
+                from_piece=int(row["FromPiece"]),
+                from_offset=int(row["From"]),
+                to_piece=int(row["ToPiece"]),
+                to_offset=int(row["To"]),
+                mispredicted=bool(int(row["Mispredicted"])),
+                cycles=int(row["Cycles"]),
+            )
+            for row in csv.DictReader(f)
+        ]
+
+
+def read_samples(directory: str = OUT_DIR) -> CounterSamples:
+    """Read the counter samples written by the last run_test(..., sample_interval=...)."""
+    with open(os.path.join(THIS_DIR, "..", directory, SAMPLES_FILE)) as f:
+        rows = list(csv.reader(f))
+    names = rows[0][1:]
+    samples = [[int(value) for value in row] for row in rows[1:]]
+    # Counts are cumulative. The first sample is the start of the first interval
+    mask = (1 << COUNTER_BITS) - 1
+    return CounterSamples(
+        times=[row[0] / 1000 for row in samples[1:]],
+        counts={
+            name: [(row[index] - previous[index]) & mask for previous, row in zip(samples, samples[1:])]
+            for index, name in enumerate(names, start=1)
+        },
+    )
+
+
+def read_pmi(directory: str = OUT_DIR) -> list[PmiSample]:
+    """Read the instruction pointer samples written by the last run_test(..., pmi_period=...)."""
+    with open(os.path.join(THIS_DIR, "..", directory, PMI_FILE)) as f:
+        return [
+            PmiSample(thread=int(row["Thread"]), piece=int(row["Piece"]), offset=int(row["Offset"]))
+            for row in csv.DictReader(f)
+        ]
+
+
+def annotate_listing(samples: list[PmiSample], directory: str = OUT_DIR) -> str:
+    """The lines of the test code in the nasm listing, each instruction with its share of the samples,
+    followed by the listings of the placed pieces of code that have samples."""
+    counts: dict[int, dict[int, int]] = {}
+    for sample in samples:
+        piece = counts.setdefault(sample.piece, {})
+        piece[sample.offset] = piece.get(sample.offset, 0) + 1
+    total = max(len(samples), 1)
+    outside = sum(counts.get(OTHER_CODE, {}).values())
+    annotated = [f"{len(samples)} samples, {outside / total:.1%} outside the test code and placed code"]
+    path = os.path.join(THIS_DIR, "..", directory)
+    test_code = counts.get(TEST_CODE, {})
+    annotated += annotate_lines(os.path.join(path, LISTING_FILE), test_code, total, "TestCodeStart:", "TestCodeEnd:")
+    for piece in sorted(piece for piece in counts if piece >= 0):
+        annotated.append(f"\nPlaced code {piece}:")
+        annotated += annotate_lines(os.path.join(path, f"placed_{piece}.lst"), counts[piece], total)
+    return "\n".join(annotated)
+
+
+def annotate_lines(
+    listing: str, counts: dict[int, int], total: int, start_label: str = "", end_label: str = ""
+) -> list[str]:
+    """The lines of a nasm listing, each instruction with its share of the total samples.
+
+    With labels, the lines between them, and counts are the samples at each offset from the first
+    instruction after start_label. Without, the whole listing of a flat binary, with offsets from its start.
+    """
+    lines = []
+    start = None if start_label else 0  # address of the first instruction after the label
+    in_code = not start_label
+    with open(listing) as f:
+        for match in map(LISTING_LINE.match, f):
+            if not match:
+                continue
+            address, code, source = match.groups()
+            if start_label and source.startswith(start_label):
+                in_code = True
+                continue
+            if not in_code:
+                continue
+            if end_label and source.startswith(end_label):
+                break
+            if not source:
+                continue  # continuation of the code bytes of a long instruction
+            count = 0
+            if code:
+                start = int(address, 16) if start is None else start
+                count = counts.get(int(address, 16) - start, 0)
+            share = f"{count:7} {count / total:6.1%}" if count else " " * 14
+            lines.append(f"{share}  {source.rstrip()}")
+    if not in_code:
+        raise ValueError(f"No {start_label.rstrip(':')} label in {os.path.basename(listing)}")
+    return lines
 
 
 class MergeError(RuntimeError):
@@ -163,10 +1083,12 @@ def merge_results(previous: TestResults | None, new: TestResults, threshold: flo
         prev_item = previous[index]
         new_item = new[index]
         for key in prev_item.keys():
-            if key in new_item:
+            # Thread, interrupt counts and the like aren't measurements that have to agree
+            if key in new_item and key not in UNSCALED_COLUMNS and key != "Iterations":
                 delta = abs(prev_item[key] - new_item[key])
-                delta_ratio = delta / float(prev_item[key])
-                print(key, delta_ratio)
+                if delta == 0:
+                    continue
+                delta_ratio = delta / float(prev_item[key]) if prev_item[key] else float("inf")
                 if delta_ratio > threshold:
                     raise MergeError("Unable to get a stable merge for " + key)  # TODO better
         for key in new_item.keys():
@@ -175,6 +1097,118 @@ def merge_results(previous: TestResults | None, new: TestResults, threshold: flo
     return previous
 
 
+# Number of evenly spaced points an adaptive sweep measures before refining
+SWEEP_COARSE_POINTS = 8
+
+T = TypeVar("T")
+
+
+def _refine(
+    count: int, measure: Callable[[int], T], differs: Callable[[T, T], bool], coarse: int
+) -> dict[int, T]:
+    """Measure indices 0..count-1 coarsely, then bisect every interval whose ends differ.
+
+    Flat stretches are left with only their end points measured; each step in the data ends
+    up between two adjacent measured indices.
+    """
+    if count == 0:
+        return {}
+    step = max(1, (count - 1) // max(1, coarse - 1))
+    measured = {i: measure(i) for i in sorted(set(range(0, count, step)) | {count - 1})}
+    pending = sorted(measured)
+    intervals = list(zip(pending, pending[1:]))
+    while intervals:
+        lo, hi = intervals.pop()
+        if hi - lo < 2 or not differs(measured[lo], measured[hi]):
+            continue
+        mid = (lo + hi) // 2
+        measured[mid] = measure(mid)
+        intervals += [(lo, mid), (mid, hi)]
+    return measured
+
+
+def _interpolate(measured: dict[int, T], count: int, blend: Callable[[T, T, float], T]) -> list[T]:
+    """Fill the indices that weren't measured by interpolating between their measured neighbours."""
+    known = sorted(measured)
+    filled = []
+    for lo, hi in zip(known, known[1:]):
+        for i in range(lo, hi):
+            filled.append(measured[lo] if i == lo else blend(measured[lo], measured[hi], (i - lo) / (hi - lo)))
+    filled.append(measured[known[-1]])
+    assert len(filled) == count
+    return filled
+
+
+def _blend_data(a: CounterData, b: CounterData, fraction: float) -> CounterData:
+    return {key: a[key] + (b[key] - a[key]) * fraction for key in a if key in b}
+
+
+def _blend_rows(a: list[CounterData], b: list[CounterData], fraction: float) -> list[CounterData]:
+    return [_blend_data(x, y, fraction) for x, y in zip(a, b)]
+
+
+def _step(metrics: Sequence[str], rel_tol: float, abs_tol: float) -> Callable[[CounterData, CounterData], bool]:
+    """Whether any of the metrics changes by more than rel_tol of its size and more than abs_tol."""
+
+    def differs(a: CounterData, b: CounterData) -> bool:
+        for metric in metrics:
+            delta = abs(a[metric] - b[metric])
+            if delta > abs_tol and delta > rel_tol * max(abs(a[metric]), abs(b[metric])):
+                return True
+        return False
+
+    return differs
+
+
+def adaptive_sweep(
+    xs: Sequence[int],
+    measure: Callable[[int], CounterData],
+    metrics: Sequence[str],
+    coarse: int = SWEEP_COARSE_POINTS,
+    rel_tol: float = 0.1,
+    abs_tol: float = 0.0,
+) -> list[CounterData]:
+    """Sweep measure over xs, only measuring densely where one of the metrics steps.
+
+    A coarse pass measures about `coarse` evenly spaced points of xs, then every interval in
+    which a metric changes by more than rel_tol (relative) and abs_tol (absolute) is bisected
+    until the step lies between neighbouring points of xs. The points in between flat
+    measurements are interpolated, so the result has one entry per point of xs just like
+    [measure(x) for x in xs]. Use coarse >= len(xs) to measure every point.
+    """
+    measured = _refine(len(xs), lambda i: measure(xs[i]), _step(metrics, rel_tol, abs_tol), coarse)
+    print(f"  measured {len(measured)} of {len(xs)} points")
+    return _interpolate(measured, len(xs), _blend_data)
+
+
+def adaptive_grid(
+    xs: Sequence[int],
+    ys: Sequence[int],
+    measure: Callable[[int, int], CounterData],
+    metrics: Sequence[str],
+    coarse: int = SWEEP_COARSE_POINTS,
+    rel_tol: float = 0.1,
+    abs_tol: float = 0.0,
+) -> list[list[CounterData]]:
+    """Two dimensional adaptive_sweep, returning one row per y, each with one entry per x.
+
+    Rows are swept adaptively along x. Rows are refined along y like points are along x: a
+    row is measured between two rows when any of their cells differ.
+    """
+    differs = _step(metrics, rel_tol, abs_tol)
+
+    def measure_row(y: int) -> list[CounterData]:
+        measured = _refine(len(xs), lambda i: measure(xs[i], y), differs, coarse)
+        return _interpolate(measured, len(xs), _blend_data)
+
+    def rows_differ(a: list[CounterData], b: list[CounterData]) -> bool:
+        return any(differs(x, y) for x, y in zip(a, b))
+
+    rows = _refine(len(ys), lambda j: measure_row(ys[j]), rows_differ, coarse)
+    print(f"  measured {len(rows)} of {len(ys)} rows")
+    return _interpolate(rows, len(ys), _blend_rows)
+
+
 def print_test(
     test: str,
     counters: list[int],
@@ -183,6 +1217,8 @@ def print_test(
     repetitions: int = 3,
     procs: int = 1,
 ) -> None:
-    results = run_test(test, counters, init_once, init_each, repetitions, procs)
+    results = run_test(
+        test, counters, init_once=init_once, init_each=init_each, repetitions=repetitions, procs=procs
+    )
     for result in results:
         print(result)
@@ -0,0 +1,221 @@
+"""Statistical comparison of stored runs against a baseline."""
+
+from __future__ import annotations
+
+import math
+import statistics
+from dataclasses import dataclass
+from functools import lru_cache
+from typing import TYPE_CHECKING
+
+if TYPE_CHECKING:
+    from agner.agner import AnyResults
+
+# Columns that identify where a result came from rather than measure anything
+IGNORED_COLUMNS = {"Thread", "Processor", "CoreType", "Iterations", "HwIntr", "SMI"}
+
+# Use the exact distribution of U without ties up to this total sample size
+EXACT_LIMIT = 30
+
+
+@dataclass(frozen=True)
+class Comparison:
+    """Baseline and candidate samples of one metric, with the test statistics."""
+
+    test: str
+    subtest: str
+    metric: str
+    baseline: list[float]
+    candidate: list[float]
+    p_value: float  # NaN for a single point, which isn't tested
+    min_p_value: float  # smallest p-value these sample sizes could give
+    rank_biserial: float  # effect size: +1 if every candidate sample is above every baseline sample
+
+    @property
+    def baseline_median(self) -> float:
+        return statistics.median(self.baseline)
+
+    @property
+    def candidate_median(self) -> float:
+        return statistics.median(self.candidate)
+
+    @property
+    def relative_change(self) -> float:
+        """Relative change of the median. Infinite if the baseline median is 0 and the candidate isn't."""
+        if self.baseline_median == 0:
+            return 0.0 if self.candidate_median == 0 else math.copysign(math.inf, self.candidate_median)
+        return (self.candidate_median - self.baseline_median) / abs(self.baseline_median)
+
+    @property
+    def tested(self) -> bool:
+        """False for a single point, which can only be compared by its change."""
+        return not math.isnan(self.p_value)
+
+    def moved(self, min_effect: float) -> bool:
+        return abs(self.relative_change) >= min_effect
+
+    def significant(self, alpha: float, min_effect: float) -> bool:
+        return self.p_value < alpha and self.moved(min_effect)
+
+    def conclusive(self, alpha: float) -> bool:
+        """False if there are too few samples to ever reach significance at alpha."""
+        return self.min_p_value < alpha
+
+
+def _ranks(values: list[float]) -> tuple[list[float], list[int]]:
+    """Ranks (1-based, ties get the average rank) and the sizes of the groups of ties."""
+    order = sorted(range(len(values)), key=lambda i: values[i])
+    ranks = [0.0] * len(values)
+    ties = []
+    i = 0
+    while i < len(order):
+        j = i
+        while j + 1 < len(order) and values[order[j + 1]] == values[order[i]]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[order[k]] = (i + j) / 2 + 1
+        ties.append(j - i + 1)
+        i = j + 1
+    return ranks, ties
+
+
+@lru_cache(maxsize=None)
+def _u_distribution(n1: int, n2: int) -> tuple[int, ...]:
+    """Number of orderings of two samples without ties giving each value of U.
+
+    U counts the pairs where the first sample is the larger. If the largest value is from
+    the first sample it beats all n2 values of the second: c(n1, n2, u) = c(n1-1, n2, u-n2) + c(n1, n2-1, u).
+    """
+    if n1 == 0 or n2 == 0:
+        return (1,)
+    counts = [0] * (n1 * n2 + 1)
+    for u, c in enumerate(_u_distribution(n1 - 1, n2)):
+        counts[u + n2] += c
+    for u, c in enumerate(_u_distribution(n1, n2 - 1)):
+        counts[u] += c
+    return tuple(counts)
+
+
+def mann_whitney_u(a: list[float], b: list[float]) -> tuple[float, float]:
+    """Two-sided Mann-Whitney U test. Returns (U of a, p-value).
+
+    Exact for small samples without ties, otherwise the normal approximation with tie and
+    continuity corrections.
+    """
+    n1, n2 = len(a), len(b)
+    ranks, ties = _ranks(a + b)
+    u1 = sum(ranks[:n1]) - n1 * (n1 + 1) / 2
+    n = n1 + n2
+    if n <= EXACT_LIMIT and all(t == 1 for t in ties):
+        counts = _u_distribution(n1, n2)
+        total = sum(counts)
+        u = int(round(u1))
+        lower = sum(counts[: u + 1]) / total
+        upper = sum(counts[u:]) / total
+        return u1, min(1.0, 2 * min(lower, upper))
+    mean = n1 * n2 / 2
+    tie_term = sum(t**3 - t for t in ties) / (n * (n - 1))
+    variance = n1 * n2 / 12 * ((n + 1) - tie_term)
+    if variance <= 0:
+        return u1, 1.0  # all values equal
+    z = max(0.0, abs(u1 - mean) - 0.5) / math.sqrt(variance)
+    return u1, math.erfc(z / math.sqrt(2))
+
+
+def min_p_value(n1: int, n2: int) -> float:
+    """The smallest two-sided p-value the exact test can give for these sample sizes."""
+    return min(1.0, 2 / math.comb(n1 + n2, n1))
+
+
+def is_repetitions(data: AnyResults) -> bool:
+    """Whether data is the rows of one run_test, one per repetition.
+
+    All repetitions of a run have the same calibrated "Iterations". Rows that a sweep interpolated have
+    it blended into a float, and rows of different runs usually have different counts.
+    """
+    if not isinstance(data, list) or not data or not all(isinstance(row, dict) for row in data):
+        return False
+    iterations = {row.get("Iterations") for row in data}
+    return len(iterations) == 1 and type(next(iter(iterations))) is int
+
+
+def _number(value: AnyResults) -> float | None:
+    """value as a float, or None if it isn't a measured number (NaN marks points that weren't measured)."""
+    if isinstance(value, bool) or not isinstance(value, (int, float)) or math.isnan(value):
+        return None
+    return float(value)
+
+
+def metric_samples(data: AnyResults, prefix: str = "") -> tuple[dict[str, list[float]], dict[str, float]]:
+    """Collect the samples of each metric in a test result, and the values of single points.
+
+    The rows of a run_test (see is_repetitions) give one sample per repetition of each column. Other
+    structures are walked and each number is a point of its own, named by its keys and indices, e.g.
+    "latency[2][5]" or "[3]/Core cyc" for a sweep, so that points are compared with the same point
+    of the other run. Points may be interpolated and have no repetitions, so they can't be tested.
+    """
+    samples: dict[str, list[float]] = {}
+    points: dict[str, float] = {}
+
+    def walk(value: AnyResults, name: str) -> None:
+        if is_repetitions(value):
+            for row in value:
+                for key, column in row.items():
+                    number = _number(column)
+                    if key not in IGNORED_COLUMNS and number is not None:
+                        samples.setdefault(f"{name}/{key}" if name else key, []).append(number)
+        elif isinstance(value, dict):
+            for key, item in value.items():
+                if key not in IGNORED_COLUMNS:
+                    walk(item, f"{name}/{key}" if name else key)
+        elif isinstance(value, list):
+            for index, item in enumerate(value):
+                walk(item, f"{name}[{index}]")
+        elif (number := _number(value)) is not None:
+            points[name or "value"] = number
+
+    walk(data, prefix)
+    return samples, points
+
+
+def compare_results(
+    baseline: dict[tuple[str, str], AnyResults], candidate: dict[tuple[str, str], AnyResults]
+) -> list[Comparison]:
+    """Compare every metric of every test found in both runs.
+
+    Metrics with repetitions get a Mann-Whitney U test. Single points are compared with the same point
+    of the other run, without a test (their p_value is NaN).
+    """
+    comparisons = []
+    for key in sorted(set(baseline) & set(candidate)):
+        base_samples, base_points = metric_samples(baseline[key])
+        cand_samples, cand_points = metric_samples(candidate[key])
+        for metric in sorted(set(base_samples) & set(cand_samples)):
+            base, cand = base_samples[metric], cand_samples[metric]
+            u, p = mann_whitney_u(cand, base)
+            comparisons.append(
+                Comparison(
+                    test=key[0],
+                    subtest=key[1],
+                    metric=metric,
+                    baseline=base,
+                    candidate=cand,
+                    p_value=p,
+                    min_p_value=min_p_value(len(cand), len(base)),
+                    rank_biserial=2 * u / (len(cand) * len(base)) - 1,
+                )
+            )
+        for metric in sorted(set(base_points) & set(cand_points)):
+            comparisons.append(
+                Comparison(
+                    test=key[0],
+                    subtest=key[1],
+                    metric=metric,
+                    baseline=[base_points[metric]],
+                    candidate=[cand_points[metric]],
+                    p_value=math.nan,
+                    min_p_value=math.nan,
+                    rank_biserial=math.nan,
+                )
+            )
+    return comparisons
@@ -21,13 +21,20 @@ class CounterInfo:
     supported: bool
     scheme: int
     family: int
+    uncore: bool = False  # counts events of the socket (UncoreDefinitions), not of the core
 
 
 class CounterDB:
     """Database of available performance counters for this CPU."""
 
-    def __init__(self) -> None:
-        """Initialize by querying the list-counters tool."""
+    def __init__(self, core_type: int = 0) -> None:
+        """Initialize by querying the list-counters tool.
+
+        Args:
+            core_type: CPUID core type (0x20 = E-core, 0x40 = P-core) to list counters for on hybrid
+                processors, or 0 for the core the tool happens to run on
+        """
+        self._core_type = core_type
         self._counters_by_id: dict[int, list[CounterInfo]] = {}
         self._counters_by_name: dict[str, list[CounterInfo]] = {}
         self._load_counters()
@@ -41,7 +48,10 @@ class CounterDB:
             # Build it
             subprocess.check_call(["make", "out/list-counters"], cwd=str(src_dir), stdout=subprocess.DEVNULL)
 
-        result = subprocess.check_output([str(list_counters)], text=True, stderr=subprocess.DEVNULL)
+        args = [str(list_counters)]
+        if self._core_type:
+            args.append(str(self._core_type))
+        result = subprocess.check_output(args, text=True, stderr=subprocess.DEVNULL)
 
         reader = csv.DictReader(result.splitlines())
         for row in reader:
@@ -51,6 +61,7 @@ class CounterDB:
                 supported=bool(int(row["supported"])),
                 scheme=int(row["scheme"], 16),
                 family=int(row["family"], 16),
+                uncore=row.get("uncore") == "1",
             )
 
             self._counters_by_id.setdefault(counter.counter_id, []).append(counter)
@@ -161,13 +172,12 @@ class CounterDB:
         return sorted(supported, key=lambda c: c.counter_id)
 
 
-# Global instance
-_counter_db: CounterDB | None = None
+# Global instances, one per core type
+_counter_dbs: dict[int, CounterDB] = {}
 
 
-def get_counter_db() -> CounterDB:
-    """Get the global CounterDB instance."""
-    global _counter_db
-    if _counter_db is None:
-        _counter_db = CounterDB()
-    return _counter_db
+def get_counter_db(core_type: int = 0) -> CounterDB:
+    """Get the global CounterDB instance for a core type (0 = any)."""
+    if core_type not in _counter_dbs:
+        _counter_dbs[core_type] = CounterDB(core_type)
+    return _counter_dbs[core_type]
@@ -0,0 +1,107 @@
+"""Description of the machine state that results depend on."""
+
+from __future__ import annotations
+
+import platform
+from dataclasses import asdict, dataclass, field
+from pathlib import Path
+from typing import Any
+
+CPU_SYSFS = Path("/sys/devices/system/cpu")
+
+
+@dataclass(frozen=True)
+class Environment:
+    """CPU, microcode, kernel and frequency settings of this machine."""
+
+    cpu_model: str
+    family: int
+    model: int
+    stepping: int
+    microcode: str
+    kernel: str
+    frequency: dict[str, str] = field(default_factory=dict)
+    isolation: dict[str, str] = field(default_factory=dict)  # what quiet mode applied, empty if not used
+
+    def to_dict(self) -> dict[str, Any]:
+        return asdict(self)
+
+    @staticmethod
+    def from_dict(data: dict[str, Any]) -> Environment:
+        return Environment(**data)
+
+    def differences(self, other: Environment) -> list[str]:
+        """Describe what differs between two environments, for the compare report."""
+        diffs = []
+        mine = self.to_dict()
+        theirs = other.to_dict()
+        for key in mine:
+            if key in ("frequency", "isolation"):
+                continue
+            if mine[key] != theirs[key]:
+                diffs.append(f"{key}: {theirs[key]} -> {mine[key]}")
+        for key in sorted(set(self.frequency) | set(other.frequency)):
+            if self.frequency.get(key) != other.frequency.get(key):
+                diffs.append(f"{key}: {other.frequency.get(key)} -> {self.frequency.get(key)}")
+        for key in sorted(set(self.isolation) | set(other.isolation)):
+            if self.isolation.get(key) != other.isolation.get(key):
+                diffs.append(f"quiet {key}: {other.isolation.get(key)} -> {self.isolation.get(key)}")
+        return diffs
+
+
+def _read(path: Path) -> str | None:
+    try:
+        return path.read_text().strip()
+    except OSError:
+        return None
+
+
+def _cpuinfo() -> dict[str, str]:
+    """Fields of the first processor in /proc/cpuinfo."""
+    info: dict[str, str] = {}
+    text = _read(Path("/proc/cpuinfo")) or ""
+    for line in text.splitlines():
+        if not line.strip():
+            break
+        key, _, value = line.partition(":")
+        info[key.strip()] = value.strip()
+    return info
+
+
+def cpu_flags() -> set[str]:
+    """Instruction set flags of the first processor, as /proc/cpuinfo lists them ("avx", "avx2", ...)."""
+    return set(_cpuinfo().get("flags", "").split())
+
+
+def frequency_settings() -> dict[str, str]:
+    """Frequency scaling and turbo settings. Missing files are left out."""
+    files = {
+        "governor": CPU_SYSFS / "cpu0" / "cpufreq" / "scaling_governor",
+        "scaling_driver": CPU_SYSFS / "cpu0" / "cpufreq" / "scaling_driver",
+        "min_freq_khz": CPU_SYSFS / "cpu0" / "cpufreq" / "scaling_min_freq",
+        "max_freq_khz": CPU_SYSFS / "cpu0" / "cpufreq" / "scaling_max_freq",
+        "epp": CPU_SYSFS / "cpu0" / "cpufreq" / "energy_performance_preference",
+        "intel_no_turbo": CPU_SYSFS / "intel_pstate" / "no_turbo",
+        "boost": CPU_SYSFS / "cpufreq" / "boost",
+        "smt": CPU_SYSFS / "smt" / "control",
+    }
+    settings = {}
+    for name, path in files.items():
+        value = _read(path)
+        if value is not None:
+            settings[name] = value
+    return settings
+
+
+def current_environment(isolation: dict[str, str] | None = None) -> Environment:
+    info = _cpuinfo()
+    return Environment(
+        cpu_model=info.get("model name", platform.processor()),
+        family=int(info.get("cpu family", "0")),
+        model=int(info.get("model", "0")),
+        stepping=int(info.get("stepping", "0")),
+        microcode=info.get("microcode", "unknown"),
+        kernel=platform.release(),
+        frequency=frequency_settings(),
+        isolation=dict(isolation or {}),
+    )
@@ -0,0 +1,196 @@
+"""Quiet machine mode: keep the processors that run tests free of frequency changes and interrupts."""
+
+from __future__ import annotations
+
+import os
+import shutil
+import subprocess
+from pathlib import Path
+from types import TracebackType
+
+from agner.environment import CPU_SYSFS
+
+IRQ_DIR = Path("/proc/irq")
+
+# Must match MAXTHREADS in PMCTest.h
+MAX_THREADS = 8
+
+# sysfs files listing the P-cores and E-cores of hybrid processors, by core type (see agner.CORE_TYPES)
+CORE_TYPE_CPUS = {"P": Path("/sys/devices/cpu_core/cpus"), "E": Path("/sys/devices/cpu_atom/cpus")}
+
+
+def parse_cpu_list(text: str) -> list[int]:
+    """Parse a kernel CPU list such as "0-3,8,10-11"."""
+    cpus = []
+    for part in text.strip().split(","):
+        if not part:
+            continue
+        first, _, last = part.partition("-")
+        cpus += range(int(first), int(last or first) + 1)
+    return cpus
+
+
+def format_cpu_list(cpus: list[int]) -> str:
+    return ",".join(str(cpu) for cpu in sorted(cpus))
+
+
+def measurement_cpus(threads: int = 1, core_type: str | None = None) -> list[int]:
+    """The processors pmctest runs threads on. Must match the choice of ProcNum in PMCTestA.cpp."""
+    allowed = sorted(os.sched_getaffinity(0))
+    if core_type is not None and CORE_TYPE_CPUS[core_type].exists():
+        of_type = set(parse_cpu_list(CORE_TYPE_CPUS[core_type].read_text()))
+        return [cpu for cpu in allowed if cpu in of_type][:threads]
+    procthreads = sum(1 for cpu in allowed if cpu < MAX_THREADS)
+    cpus = []
+    for t in range(threads):
+        i = threads - 1 - t
+        cpus.append(i if procthreads < 4 else (i % 2) * (procthreads // 2) + i // 2)
+    return cpus
+
+
+def smt_siblings(cpu: int) -> list[int]:
+    """The processors that share a core with cpu (hyperthreads), including cpu itself."""
+    path = CPU_SYSFS / f"cpu{cpu}" / "topology" / "thread_siblings_list"
+    return parse_cpu_list(path.read_text()) if path.exists() else [cpu]
+
+
+def sibling_pair(core_type: str | None = None) -> tuple[int, int] | None:
+    """Two hyperthreads of one core that this process may run on, or None without SMT.
+
+    On hybrid processors, core_type "P" or "E" chooses a core of that type.
+    """
+    allowed = set(os.sched_getaffinity(0))
+    if core_type is not None and CORE_TYPE_CPUS[core_type].exists():
+        allowed &= set(parse_cpu_list(CORE_TYPE_CPUS[core_type].read_text()))
+    for cpu in sorted(allowed):
+        siblings = [sibling for sibling in smt_siblings(cpu) if sibling != cpu and sibling in allowed]
+        if siblings:
+            return cpu, siblings[0]
+    return None
+
+
+def isolation_report(cpus: list[int]) -> dict[str, str]:
+    """How well the kernel keeps other work off the processors: isolcpus, nohz_full and irqbalance."""
+
+    def covered(name: str) -> str:
+        path = CPU_SYSFS / name
+        if not path.exists():
+            return "unknown"
+        listed = set(parse_cpu_list(path.read_text()))
+        return "yes" if set(cpus) <= listed else "no"
+
+    pgrep = shutil.which("pgrep")
+    irqbalance = pgrep is not None and subprocess.run([pgrep, "-x", "irqbalance"], capture_output=True).returncode == 0
+    return {
+        "cpus": format_cpu_list(cpus),
+        "isolcpus": covered("isolated"),
+        "nohz_full": covered("nohz_full"),
+        "irqbalance": "running" if irqbalance else "not running",
+    }
+
+
+class QuietMachine:
+    """Context manager that sets up the processors that run tests, and restores everything on exit.
+
+    For the given processors it sets the performance governor and pins the frequency to the base
+    frequency with the cpufreq limits, and it disables turbo. Interrupts that can be moved are moved
+    to the other processors. Settings that can't be changed (e.g. when not root) are reported and
+    left alone. `applied` describes what was done, for storing with the results.
+    """
+
+    def __init__(self, cpus: list[int]) -> None:
+        self.cpus = cpus
+        self.applied: dict[str, str] = {}
+        self._restore: list[tuple[Path, str]] = []
+        self._failed: list[str] = []
+
+    def _write(self, path: Path, value: str) -> bool:
+        """Write a sysfs or procfs file, remembering its old value. False if it can't be written."""
+        try:
+            old = path.read_text().strip()
+            if old != value:
+                path.write_text(value)
+                self._restore.append((path, old))
+            return True
+        except OSError:
+            return False
+
+    def _pin_frequency(self) -> None:
+        governors = set()
+        pinned = set()
+        for cpu in self.cpus:
+            cpufreq = CPU_SYSFS / f"cpu{cpu}" / "cpufreq"
+            if not cpufreq.exists():
+                continue
+            if self._write(cpufreq / "scaling_governor", "performance"):
+                governors.add("performance")
+            else:
+                self._failed.append(f"governor of cpu{cpu}")
+            base = cpufreq / "base_frequency"
+            if not base.exists():
+                base = cpufreq / "cpuinfo_max_freq"  # the base frequency once boost is off
+            # Lower the minimum first, so that the maximum can go below the old minimum
+            if (
+                self._write(cpufreq / "scaling_min_freq", (cpufreq / "cpuinfo_min_freq").read_text().strip())
+                and self._write(cpufreq / "scaling_max_freq", base.read_text().strip())
+                and self._write(cpufreq / "scaling_min_freq", base.read_text().strip())
+            ):
+                pinned.add(base.read_text().strip())
+            else:
+                self._failed.append(f"frequency of cpu{cpu}")
+        if governors:
+            self.applied["governor"] = ",".join(sorted(governors))
+        if pinned:
+            self.applied["pinned_khz"] = ",".join(sorted(pinned))
+
+    def _disable_turbo(self) -> None:
+        for path, value in ((CPU_SYSFS / "intel_pstate" / "no_turbo", "1"), (CPU_SYSFS / "cpufreq" / "boost", "0")):
+            if path.exists():
+                if self._write(path, value):
+                    self.applied["turbo"] = "off"
+                else:
+                    self._failed.append("turbo")
+                return
+
+    def _move_interrupts(self) -> None:
+        online = parse_cpu_list((CPU_SYSFS / "online").read_text())
+        others = format_cpu_list([cpu for cpu in online if cpu not in self.cpus])
+        if not others:
+            self._failed.append("interrupts (no other processors)")
+            return
+        moved = total = 0
+        for affinity in sorted(IRQ_DIR.glob("*/smp_affinity_list")):
+            total += 1
+            # Per-processor and managed interrupts can't be moved
+            if self._write(affinity, others):
+                moved += 1
+        self.applied["irqs_moved"] = f"{moved} of {total}"
+
+    def __enter__(self) -> QuietMachine:
+        try:
+            # Turbo off first, so that the maximum frequency read when pinning is the base frequency
+            self._disable_turbo()
+            self._pin_frequency()
+            self._move_interrupts()
+        except BaseException:
+            self.restore()
+            raise
+        self.applied.update(isolation_report(self.cpus))
+        if self._failed:
+            hint = "" if os.geteuid() == 0 else " (needs root)"
+            print(f"Quiet mode could not set: {', '.join(self._failed)}{hint}")
+        return self
+
+    def __exit__(
+        self, exc_type: type[BaseException] | None, exc: BaseException | None, traceback: TracebackType | None
+    ) -> None:
+        self.restore()
+
+    def restore(self) -> None:
+        """Put back the old values, in reverse order of setting them."""
+        while self._restore:
+            path, old = self._restore.pop()
+            try:
+                path.write_text(old)
+            except OSError:
+                print(f"Warning: could not restore {path} to {old}")
@@ -0,0 +1,125 @@
+"""Journal of a run in progress, so that a run that is interrupted can be resumed without measuring again."""
+
+from __future__ import annotations
+
+import hashlib
+import json
+import os
+import threading
+from dataclasses import dataclass
+from typing import TYPE_CHECKING, Any
+
+if TYPE_CHECKING:
+    from agner.agner import AllResults, AnyResults, TestResults
+
+
+@dataclass(frozen=True)
+class Point:
+    """One measurement of a subtest: its place in the order the subtest measures in, and what was measured."""
+
+    index: int
+    key: str
+
+
+def point_key(test: Any, counters: list[int | str], options: dict[str, Any]) -> str:
+    """Digest of the arguments of run_test. Code, counters and options are all part of the measurement."""
+    text = repr((test, counters, sorted(options.items())))
+    return hashlib.sha1(text.encode()).hexdigest()
+
+
+def read_lines(path: str) -> list[dict[str, Any]]:
+    """The records of a journal. A line cut short by a crash is skipped."""
+    records = []
+    with open(path) as f:
+        for line in f:
+            try:
+                records.append(json.loads(line))
+            except json.JSONDecodeError:
+                continue
+    return records
+
+
+def journal_results(path: str) -> AllResults:
+    """The results of the subtests that a journal has finished, for plotting a run in progress."""
+    results: AllResults = {}
+    for record in read_lines(path):
+        if "point" not in record:
+            results.setdefault(record["test"], {})[record["subtest"]] = record["results"]
+    return results
+
+
+class Journal:
+    """JSON lines file that every measured point and finished subtest is appended to as soon as it's done.
+
+    Each point is the results of one run_test, in the order the subtest runs them. When resuming, the
+    subtests that finished take their results from the journal. The one that was interrupted runs again,
+    with run_test returning the points from the journal for as long as it asks for the same tests in the
+    same order, which it does when the code of the subtest is deterministic. The first point that
+    differs, and everything after it, is measured.
+    """
+
+    def __init__(self, path: str, resume: bool) -> None:
+        self._finished: dict[tuple[str, str], AnyResults] = {}
+        self._points: dict[tuple[str, str], list[tuple[str, TestResults]]] = {}
+        if resume and os.path.exists(path):
+            for record in read_lines(path):
+                subtest = (record["test"], record["subtest"])
+                if "point" in record:
+                    # A point measured again after a resume replaces the one before and those after it
+                    points = self._points.setdefault(subtest, [])
+                    del points[record["point"] :]
+                    if record["point"] == len(points):
+                        points.append((record["key"], record["results"]))
+                else:
+                    self._finished[subtest] = record["results"]
+            print(f"Resuming from {path}: {len(self._finished)} subtests finished")
+        cut_short = False
+        if resume and os.path.exists(path) and os.path.getsize(path):
+            with open(path, "rb") as f:
+                f.seek(-1, os.SEEK_END)
+                cut_short = f.read(1) != b"\n"
+        self._file = open(path, "a" if resume else "w")
+        # A crash may have cut the last line short; start on a line of our own
+        if cut_short:
+            self._file.write("\n")
+        self._lock = threading.Lock()
+        self._subtest: tuple[str, str] = ("", "")
+        self._replay: list[tuple[str, TestResults]] = []
+        self._next = 0
+
+    def finished(self, test: str, subtest: str) -> AnyResults | None:
+        return self._finished.get((test, subtest))
+
+    def begin(self, test: str, subtest: str) -> None:
+        self._subtest = (test, subtest)
+        self._replay = self._points.pop(self._subtest, [])
+        self._next = 0
+
+    def point(self, key: str) -> tuple[Point, TestResults | None]:
+        """The next point of the subtest, and its results if the journal has them."""
+        with self._lock:
+            point = Point(self._next, key)
+            self._next += 1
+            if point.index < len(self._replay) and self._replay[point.index][0] == key:
+                return point, self._replay[point.index][1]
+            # The subtest went another way from here, so nothing after this point can be replayed
+            del self._replay[point.index :]
+            return point, None
+
+    def record(self, point: Point, results: TestResults) -> None:
+        test, subtest = self._subtest
+        self._write({"test": test, "subtest": subtest, "point": point.index, "key": point.key, "results": results})
+
+    def finish(self, results: AnyResults) -> None:
+        test, subtest = self._subtest
+        self._write({"test": test, "subtest": subtest, "results": results})
+
+    def _write(self, record: dict[str, Any]) -> None:
+        with self._lock:
+            self._file.write(json.dumps(record) + "\n")
+            # Synced for every point, so that it survives a crash of the process or of the machine
+            self._file.flush()
+            os.fsync(self._file.fileno())
+
+    def close(self) -> None:
+        self._file.close()
@@ -10,13 +10,30 @@ import shutil
 import subprocess
 import sys
 from argparse import ArgumentParser, Namespace
+from collections.abc import Iterator
+from contextlib import contextmanager
 from typing import Callable
 
 import matplotlib.pyplot as plt
 from matplotlib.backends.backend_pdf import PdfPages
 
-from agner.agner import Agner
+from agner.agner import (
+    CORE_TYPES,
+    Agner,
+    AllResults,
+    core_type_id,
+    filter_match,
+    set_default_core_type,
+    set_default_drop_interrupted,
+    set_default_native,
+    set_default_topdown,
+)
+from agner.compare import compare_results
 from agner.counters import get_counter_db
+from agner.environment import Environment, current_environment, frequency_settings
+from agner.isolation import QuietMachine, isolation_report, measurement_cpus, parse_cpu_list
+from agner.journal import Journal, journal_results
+from agner.results_db import ResultsDB
 
 ROOT = os.path.dirname(os.path.dirname(os.path.dirname(os.path.realpath(__file__))))
 TEST_PYS = sorted([os.path.splitext(os.path.basename(x))[0] for x in glob.glob(os.path.join(ROOT, "tests", "*.py"))])
@@ -60,9 +77,55 @@ def check_prerequisites() -> None:
         sys.exit(1)
 
 
+def store_results(args: Namespace, results: AllResults, environment: Environment) -> None:
+    """Keep the results in the results database, unless --db is empty"""
+    if not args.db:
+        return
+    db = ResultsDB(args.db)
+    run_id = db.add_run(results, environment, args.label)
+    db.close()
+    print(f"Stored results as run {run_id} in {args.db}")
+
+
+def quiet_cpus(args: Namespace) -> list[int]:
+    """The processors that --quiet and isolate work on: --cpus, or the one pmctest runs a test on"""
+    if args.cpus:
+        return parse_cpu_list(args.cpus)
+    return measurement_cpus(1, args.core_type)
+
+
+@contextmanager
+def open_journal(args: Namespace) -> Iterator[Journal | None]:
+    """The journal of the run, unless --journal is empty. Without --resume, an old journal is replaced"""
+    if not args.journal:
+        if args.resume:
+            print("Error: --resume needs a --journal")
+            sys.exit(1)
+        yield None
+        return
+    journal = Journal(args.journal, args.resume)
+    try:
+        yield journal
+    finally:
+        journal.close()
+
+
+@contextmanager
+def test_environment(args: Namespace) -> Iterator[dict[str, str]]:
+    """Quiet the machine during the tests if --quiet. Yields what was applied"""
+    if not args.quiet:
+        yield {}
+        return
+    with QuietMachine(quiet_cpus(args)) as quiet:
+        yield quiet.applied
+
+
 def run_tests(args: Namespace) -> None:
     check_prerequisites()
-    results = AGNER.run_tests(args.test)
+    with open_journal(args) as journal, test_environment(args) as applied:
+        results = AGNER.run_tests(args.test, journal)
+        environment = current_environment(applied)
+    store_results(args, results, environment)
     AGNER.plot_results(results, args.test, args.alternative)
     plt.show()
 
@@ -70,9 +133,89 @@ def run_tests(args: Namespace) -> None:
 def test_only(args: Namespace) -> None:
     check_prerequisites()
     print(args.results_file)
+    with open_journal(args) as journal, test_environment(args) as applied:
+        results = AGNER.run_tests(args.test, journal)
+        environment = current_environment(applied)
     with open(args.results_file, "w") as out:
-        results = AGNER.run_tests(args.test)
         json.dump(results, out)
+    store_results(args, results, environment)
+
+
+def isolate(args: Namespace) -> None:
+    """Show how isolated the processors that run tests are, and what --quiet would change"""
+    cpus = quiet_cpus(args)
+    report = isolation_report(cpus)
+    for key, value in {**report, **frequency_settings()}.items():
+        print(f"{key:<16} {value}")
+    if report["isolcpus"] != "yes" or report["nohz_full"] != "yes":
+        cpu_list = report["cpus"]
+        print(f"\nFor full isolation boot with: isolcpus={cpu_list} nohz_full={cpu_list} rcu_nocbs={cpu_list}")
+    if report["irqbalance"] == "running":
+        print("irqbalance is running and may move interrupts back during a run: systemctl stop irqbalance")
+    print("\nWith --quiet, run and test_only set the performance governor, pin the frequency, disable turbo")
+    print("and move interrupts off these processors, then restore everything afterwards (needs root)")
+
+
+def list_runs(args: Namespace) -> None:
+    db = ResultsDB(args.db)
+    print(f"{'Run':<5} {'Time':<20} {'Label':<16} {'Model':<10} {'Microcode':<12} {'Kernel':<24} {'Governor'}")
+    for run in db.runs():
+        env = run.environment
+        model = f"{env.family:x}-{env.model:x}-{env.stepping:x}"
+        governor = env.frequency.get("governor", "-")
+        print(f"{run.id:<5} {run.time:<20} {run.label:<16} {model:<10} {env.microcode:<12} {env.kernel:<24} {governor}")
+
+
+def compare(args: Namespace) -> None:
+    """Compare a run against a baseline run. Exit code 1 if anything changed significantly"""
+    if args.baseline is None:
+        print("Error: compare needs --baseline RUN (see 'agner runs')")
+        sys.exit(1)
+    db = ResultsDB(args.db)
+    baseline = db.run(args.baseline)
+    candidate = db.run(args.candidate) if args.candidate is not None else db.latest_run()
+    print(
+        f"Baseline run {baseline.id} ({baseline.time} {baseline.label}), "
+        f"candidate run {candidate.id} ({candidate.time} {candidate.label})"
+    )
+    for diff in candidate.environment.differences(baseline.environment):
+        print(f"  {diff}")
+
+    comparisons = [
+        c
+        for c in compare_results(db.results(baseline.id), db.results(candidate.id))
+        if not args.test or filter_match(args.test, c.test, c.subtest)
+    ]
+    tested = [c for c in comparisons if c.tested]
+    significant = [c for c in tested if c.significant(args.alpha, args.min_effect)]
+    inconclusive = [c for c in tested if not c.conclusive(args.alpha)]
+    moved_points = [c for c in comparisons if not c.tested and c.moved(args.min_effect)]
+
+    if significant:
+        print(f"\n{'Test':<40} {'Metric':<16} {'Baseline':>12} {'Candidate':>12} {'Change':>8} {'Effect':>7} {'p':>9}")
+        for c in significant:
+            print(
+                f"{c.test + '.' + c.subtest:<40} {c.metric:<16} {c.baseline_median:>12.6g} {c.candidate_median:>12.6g}"
+                f" {c.relative_change:>+8.1%} {c.rank_biserial:>+7.2f} {c.p_value:>9.2g}"
+            )
+    if moved_points:
+        print(f"\n{'Test':<40} {'Point':<16} {'Baseline':>12} {'Candidate':>12} {'Change':>8}")
+        for c in moved_points:
+            print(
+                f"{c.test + '.' + c.subtest:<40} {c.metric:<16} {c.baseline_median:>12.6g} {c.candidate_median:>12.6g}"
+                f" {c.relative_change:>+8.1%}"
+            )
+    print(
+        f"\n{len(significant)} of {len(tested)} metrics changed significantly "
+        f"(p < {args.alpha}, change >= {args.min_effect:.0%})"
+    )
+    if moved_points:
+        points = len(comparisons) - len(tested)
+        print(f"{len(moved_points)} of {points} sweep points changed by >= {args.min_effect:.0%} (not tested)")
+    if inconclusive:
+        print(f"{len(inconclusive)} metrics have too few samples to reach p < {args.alpha}; use more repetitions")
+    if significant:
+        sys.exit(1)
 
 
 def safe_name(name: str) -> str:
@@ -80,8 +223,12 @@ def safe_name(name: str) -> str:
 
 
 def plot(args: Namespace) -> None:
-    with open(args.results_file) as inp:
-        results = json.load(inp)
+    if args.partial:
+        # The subtests that a run in progress, or one that was interrupted, has finished
+        results = journal_results(args.journal)
+    else:
+        with open(args.results_file) as inp:
+            results = json.load(inp)
     if args.pdf:
         with PdfPages(args.pdf) as pdf:
             AGNER.plot_results(results, args.test, args.alternative, lambda x, y: pdf.savefig())
@@ -117,7 +264,7 @@ def counters_command(args: Namespace) -> None:
         sys.exit(1)
 
     subcommand = args.test[0]
-    db = get_counter_db()
+    db = get_counter_db(core_type_id(args.core_type))
 
     if subcommand == "list":
         print("Supported counters on this CPU:")
@@ -164,6 +311,9 @@ COMMANDS: dict[str, Callable[[Namespace], None]] = {
     "plot": plot,
     "list": list_tests,
     "counters": counters_command,
+    "runs": list_runs,
+    "compare": compare,
+    "isolate": isolate,
 }
 
 
@@ -178,10 +328,67 @@ def main() -> None:
     parser.add_argument("--alternative", help="output alternative graph", default=False, action="store_true")
     parser.add_argument("--pdf", help="output plot as PDF", metavar="PDF")
     parser.add_argument("--png", help="output plots as template formatted with {test} {subtest}", metavar="template")
+    parser.add_argument(
+        "--core-type", choices=CORE_TYPES.keys(), help="run tests on P-cores or E-cores of hybrid processors"
+    )
+    parser.add_argument(
+        "--topdown",
+        help="add top-down analysis (frontend/bad speculation/backend/retiring) to every test",
+        default=False,
+        action="store_true",
+    )
+    parser.add_argument(
+        "--native",
+        help="run tests in this process through a shared library instead of starting pmctest for each",
+        default=False,
+        action="store_true",
+    )
+    parser.add_argument(
+        "--keep-interrupted",
+        help="keep repetitions that hardware interrupts or SMIs landed in",
+        default=False,
+        action="store_true",
+    )
+    parser.add_argument(
+        "--quiet",
+        help="pin the frequency, disable turbo and move interrupts away from the test processors during the run",
+        default=False,
+        action="store_true",
+    )
+    parser.add_argument("--cpus", help="processors for --quiet and isolate (default: the one tests run on)")
+    parser.add_argument(
+        "--db", default="results.db", help="store runs in and compare runs from FILE ('' to not store)", metavar="FILE"
+    )
+    parser.add_argument(
+        "--journal",
+        default="journal.jsonl",
+        help="record each measurement in FILE as it finishes, for --resume ('' to not keep one)",
+        metavar="FILE",
+    )
+    parser.add_argument(
+        "--resume",
+        help="continue an interrupted run from the journal, skipping what it has measured",
+        default=False,
+        action="store_true",
+    )
+    parser.add_argument(
+        "--partial", help="plot the subtests finished so far, from the journal", default=False, action="store_true"
+    )
+    parser.add_argument("--label", default="", help="label for the stored run, e.g. 'new microcode'")
+    parser.add_argument("--baseline", type=int, help="compare against stored run RUN", metavar="RUN")
+    parser.add_argument("--candidate", type=int, help="compare stored run RUN (default: latest)", metavar="RUN")
+    parser.add_argument("--alpha", type=float, default=0.01, help="significance level for compare (default 0.01)")
+    parser.add_argument(
+        "--min-effect", type=float, default=0.02, help="smallest relative change of the median to flag (default 0.02)"
+    )
     parser.add_argument("command", nargs=1, choices=COMMANDS.keys())
     parser.add_argument("test", nargs="*", help="run test TEST", metavar="TEST")
 
     args = parser.parse_args()
+    set_default_core_type(args.core_type)
+    set_default_topdown(args.topdown)
+    set_default_drop_interrupted(not args.keep_interrupted)
+    set_default_native(args.native)
 
     COMMANDS[args.command[0]](args)
 
@@ -0,0 +1,95 @@
+"""Running tests in this process through out/libpmctest.so, instead of starting out/pmctest for each run."""
+
+from __future__ import annotations
+
+import ctypes
+import os
+import shutil
+import tempfile
+from typing import TYPE_CHECKING
+
+if TYPE_CHECKING:
+    import numpy as np
+
+LIBRARY = "out/libpmctest.so"
+
+
+class NativeTest:
+    """The harness with one test's code, loaded as a shared library.
+
+    Setting up selects the processors, queues the counters, places code and opens the driver.
+    That is done once, and the test can then be run any number of times. The library is copied
+    before loading, because the dynamic loader would return an earlier library of the same name.
+    """
+
+    def __init__(self, library: str = LIBRARY) -> None:
+        self._lib: ctypes.CDLL | None = None
+        fd, self._path = tempfile.mkstemp(suffix=".so", dir=os.path.dirname(os.path.abspath(library)))
+        os.close(fd)
+        shutil.copyfile(library, self._path)
+        try:
+            self._lib = ctypes.CDLL(self._path)
+        finally:
+            os.remove(self._path)
+        lib = self._lib
+        lib.PMCTestSetup.argtypes = [ctypes.c_char_p]
+        lib.PMCTestColumnName.restype = ctypes.c_char_p
+        lib.PMCTestColumnName.argtypes = [ctypes.c_int]
+        lib.PMCTestColumnIsFraction.argtypes = [ctypes.c_int]
+        lib.PMCTestProcessor.argtypes = [ctypes.c_int]
+        lib.PMCTestValues.argtypes = [ctypes.c_void_p]
+        # placement.txt and lbr.csv are in the directory of the library, as they are next to pmctest
+        directory = os.path.dirname(os.path.abspath(library)) + "/"
+        self._call("PMCTestSetup", directory.encode())
+
+    def _call(self, name: str, *args: object) -> None:
+        """Call a function that returns an error code. The harness locks the calling thread to the
+        processors it uses, so restore the affinity afterwards."""
+        assert self._lib is not None, "NativeTest is closed"
+        affinity = os.sched_getaffinity(0)
+        try:
+            error = getattr(self._lib, name)(*args)
+        finally:
+            os.sched_setaffinity(0, affinity)
+        if error:
+            raise RuntimeError(f"{name} failed with error {error}")
+
+    def run(self) -> dict[str, np.ndarray]:
+        """Run the test code in all threads. Returns each column of results, with one value per
+        repetition of each thread: thread 0's repetitions first."""
+        import numpy as np
+
+        self._call("PMCTestRun")
+        lib = self._lib
+        assert lib is not None
+        columns = lib.PMCTestColumns()
+        values = np.empty((lib.PMCTestRows(), columns), dtype=np.float64)
+        lib.PMCTestValues(values.ctypes.data)
+        results = {}
+        for c in range(columns):
+            column = values[:, c]
+            if not lib.PMCTestColumnIsFraction(c):
+                column = column.astype(np.int64)
+            results[lib.PMCTestColumnName(c).decode()] = column
+        return results
+
+    @property
+    def inner_iterations(self) -> int:
+        assert self._lib is not None
+        return int(self._lib.PMCTestInnerIterations())
+
+    def processors(self, threads: int) -> list[int]:
+        assert self._lib is not None
+        return [int(self._lib.PMCTestProcessor(t)) for t in range(threads)]
+
+    def close(self) -> None:
+        """Unload the library. This closes the driver and unmaps placed code."""
+        if self._lib is None:
+            return
+        import _ctypes
+
+        _ctypes.dlclose(self._lib._handle)
+        self._lib = None
+
+    def __del__(self) -> None:
+        self.close()
@@ -0,0 +1,63 @@
+"""Heatmaps of a result over a grid of two test parameters, as the sweep tests plot them."""
+
+from __future__ import annotations
+
+from typing import TYPE_CHECKING, Literal
+
+import matplotlib.pyplot as plt
+import numpy as np
+
+if TYPE_CHECKING:
+    from collections.abc import Sequence
+
+    from matplotlib.axes import Axes
+
+# How the parameter values of an axis are laid out: evenly spaced numbers, powers of two on a log2 scale,
+# or one equal cell per value, labelled with it (the values may then be names)
+Scale = Literal["linear", "log", "category"]
+
+
+def cell_edges(values: Sequence[float] | Sequence[str], scale: Scale) -> np.ndarray:
+    """Edges of the cells of values: each cell starts at its value and the last gets the size of the one before."""
+    if scale == "category":
+        return np.arange(len(values) + 1)
+    numbers = [float(value) for value in values]
+    if scale == "log":
+        return np.array([*numbers, numbers[-1] * 2])
+    step = numbers[-1] - numbers[-2] if len(numbers) > 1 else 1
+    return np.array([*numbers, numbers[-1] + step])
+
+
+def heatmap(
+    xs: Sequence[float] | Sequence[str],
+    ys: Sequence[float] | Sequence[str],
+    values: Sequence[Sequence[float]],
+    title: str,
+    index: int = 0,
+    rows: int = 2,
+    cols: int = 2,
+    x_scale: Scale = "linear",
+    y_scale: Scale = "linear",
+    xlabel: str = "",
+    ylabel: str = "",
+) -> Axes:
+    """Plot values[y][x] in subplot index of a rows x cols grid, or in the whole figure if index is 0.
+
+    Cells that weren't measured (NaN) are left blank. Returns the axes for further decoration.
+    """
+    ax = plt.subplot(rows, cols, index) if index else plt.subplot(1, 1, 1)
+    plt.title(title)
+    plt.xlabel(xlabel)
+    plt.ylabel(ylabel)
+    xx, yy = np.meshgrid(cell_edges(xs, x_scale), cell_edges(ys, y_scale))
+    plt.pcolor(xx, yy, np.ma.masked_invalid(np.array(values, dtype=float)))
+    plt.colorbar()
+    if x_scale == "log":
+        ax.set_xscale("log", base=2)
+    if y_scale == "log":
+        ax.set_yscale("log", base=2)
+    for axis, scale, ticks in ((ax.xaxis, x_scale, xs), (ax.yaxis, y_scale, ys)):
+        if scale == "category":
+            axis.set_ticks(np.arange(len(ticks)) + 0.5)
+            axis.set_ticklabels([t if isinstance(t, str) else f"{t:.0f}" for t in ticks], fontsize="small")
+    return ax
@@ -0,0 +1,134 @@
+"""Local store of test results, so that runs on different setups can be compared."""
+
+from __future__ import annotations
+
+import datetime
+import json
+import sqlite3
+from dataclasses import dataclass
+from typing import TYPE_CHECKING
+
+from agner.environment import Environment
+
+if TYPE_CHECKING:
+    from agner.agner import AllResults, AnyResults
+
+SCHEMA = """
+CREATE TABLE IF NOT EXISTS runs (
+    id INTEGER PRIMARY KEY AUTOINCREMENT,
+    time TEXT NOT NULL,
+    label TEXT NOT NULL,
+    cpu_model TEXT NOT NULL,
+    family INTEGER NOT NULL,
+    model INTEGER NOT NULL,
+    stepping INTEGER NOT NULL,
+    microcode TEXT NOT NULL,
+    kernel TEXT NOT NULL,
+    frequency TEXT NOT NULL,
+    isolation TEXT NOT NULL DEFAULT '{}'
+);
+CREATE TABLE IF NOT EXISTS results (
+    run_id INTEGER NOT NULL REFERENCES runs(id),
+    test TEXT NOT NULL,
+    subtest TEXT NOT NULL,
+    data TEXT NOT NULL,
+    PRIMARY KEY (run_id, test, subtest)
+);
+"""
+
+
+@dataclass(frozen=True)
+class Run:
+    """One invocation of the test suite and the environment it ran in."""
+
+    id: int
+    time: str
+    label: str
+    environment: Environment
+
+
+class ResultsDB:
+    """SQLite store of runs. Each run holds the results of the tests it ran."""
+
+    def __init__(self, path: str) -> None:
+        self._conn = sqlite3.connect(path)
+        self._conn.executescript(SCHEMA)
+        # Databases from before quiet mode don't have the isolation column
+        columns = [row[1] for row in self._conn.execute("PRAGMA table_info(runs)")]
+        if "isolation" not in columns:
+            with self._conn:
+                self._conn.execute("ALTER TABLE runs ADD COLUMN isolation TEXT NOT NULL DEFAULT '{}'")
+
+    def close(self) -> None:
+        self._conn.close()
+
+    def add_run(self, results: AllResults, environment: Environment, label: str = "") -> int:
+        """Store the results of a run, returning its id."""
+        with self._conn:
+            cursor = self._conn.execute(
+                "INSERT INTO runs"
+                " (time, label, cpu_model, family, model, stepping, microcode, kernel, frequency, isolation)"
+                " VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+                (
+                    datetime.datetime.now().isoformat(timespec="seconds"),
+                    label,
+                    environment.cpu_model,
+                    environment.family,
+                    environment.model,
+                    environment.stepping,
+                    environment.microcode,
+                    environment.kernel,
+                    json.dumps(environment.frequency, sort_keys=True),
+                    json.dumps(environment.isolation, sort_keys=True),
+                ),
+            )
+            run_id = cursor.lastrowid
+            assert run_id is not None
+            for test, subtests in results.items():
+                for subtest, data in subtests.items():
+                    self._conn.execute(
+                        "INSERT INTO results (run_id, test, subtest, data) VALUES (?, ?, ?, ?)",
+                        (run_id, test, subtest, json.dumps(data)),
+                    )
+        return run_id
+
+    def runs(self) -> list[Run]:
+        rows = self._conn.execute(
+            "SELECT id, time, label, cpu_model, family, model, stepping, microcode, kernel, frequency, isolation"
+            " FROM runs ORDER BY id"
+        )
+        return [
+            Run(
+                id=row[0],
+                time=row[1],
+                label=row[2],
+                environment=Environment(
+                    cpu_model=row[3],
+                    family=row[4],
+                    model=row[5],
+                    stepping=row[6],
+                    microcode=row[7],
+                    kernel=row[8],
+                    frequency=json.loads(row[9]),
+                    isolation=json.loads(row[10]),
+                ),
+            )
+            for row in rows
+        ]
+
+    def run(self, run_id: int) -> Run:
+        for run in self.runs():
+            if run.id == run_id:
+                return run
+        raise KeyError(f"No run with id {run_id}")
+
+    def latest_run(self) -> Run:
+        runs = self.runs()
+        if not runs:
+            raise KeyError("No runs stored")
+        return runs[-1]
+
+    def results(self, run_id: int) -> dict[tuple[str, str], AnyResults]:
+        """Results of a run, keyed by (test, subtest)."""
+        rows = self._conn.execute("SELECT test, subtest, data FROM results WHERE run_id = ?", (run_id,))
+        return {(row[0], row[1]): json.loads(row[2]) for row in rows}
@@ -9,6 +9,12 @@
 
 // list of input/output data structures for MSR driver
 #define MAX_QUE_ENTRIES 32                  // maximum number of entries in queue
+#define MAX_PMI_SAMPLES 16384               // maximum number of PMI_START samples kept for each processor
+#define MAX_KERNEL_CODE 0x40000             // maximum size of KERNEL_RUN test code (bytes)
+#define MAX_KERNEL_COUNTERS 6               // counters read by KERNEL_RUN test code, as MAXCOUNTERS in PMCTest.h
+#define MAX_KERNEL_REPETITIONS 1000         // maximum number of KERNEL_RUN repetitions
+#define MAX_KERNEL_MILLISECONDS 100         // no KERNEL_RUN repetition starts after or takes longer than this time
+#define KERNEL_USER_DATA 0x10000            // user data of KERNEL_RUN test code (bytes), as UserData in PMCTestB64
 
 // commands for MSR driver. Shared with application program
 enum EMSR_COMMAND {
@@ -22,6 +28,10 @@ enum EMSR_COMMAND {
     PMC_DISABLE= 7,                // Disable RDPMC instruction (RDTSC remains enabled)
     PROC_GET   = 8,                // Get processor number (In multiprocessor systems. 0-based)
     PROC_SET   = 9,                // Set processor number (In multiprocessor systems. 0-based)
+    PMI_START  = 10,               // Sample instruction pointer each time counter register_number has counted value events
+    PMI_STOP   = 11,               // Stop sampling on this processor. Returns number of samples
+    PMI_READ   = 12,               // Copy samples of processor register_number to application memory at value. Returns number of samples
+    KERNEL_RUN = 13,               // Run test code with interrupts disabled. value = address of SKernelRun. Returns repetitions done, -2 if too long
     UNUSED1    = 0x7fffffff        // make sure this enum takes 32 bits
 };
 
@@ -35,3 +45,20 @@ struct SMSRInOut {
         unsigned int val[2];        // lower and upper 32 bits
     };
 };
+
+
+// Test code for KERNEL_RUN and its results. The test code is a flat binary assembled
+// from PMCTestK64.nasm, which reads and writes the fields at the offsets defined there
+struct SKernelRun {
+    long long code;                 // address of test code in application memory. Must be the code of MSRrun
+    long long deadline;             // time stamp counter value after which no repetition starts. Set by driver
+    long long rsp;                  // stack pointer. Saved by test code
+    int code_size;                  // size of test code (bytes)
+    int repetitions;                // number of repetitions of test code
+    int iterations;                 // iterations of test code in each repetition
+    int counters[MAX_KERNEL_COUNTERS];     // counter register numbers for rdpmc
+    int temp[MAX_KERNEL_COUNTERS + 1];     // clock and counter values of one repetition. Used by test code
+    int overhead[MAX_KERNEL_COUNTERS + 1]; // clock and counter values of empty code. Used by test code
+    int clocks[MAX_KERNEL_REPETITIONS];    // clock count of each repetition
+    int counts[MAX_KERNEL_COUNTERS][MAX_KERNEL_REPETITIONS]; // count of each counter in each repetition
+};
@@ -5,6 +5,9 @@
 
 // Modified 2011-06-08 for changed IOCTL
 // Modified 2015-11-27 for using copy_from_user to access application memory space
+// Modified for PROC_SET: the rest of a command list is done on another processor
+// Modified for PMI_START: sampling of instruction pointer on counter overflow
+// Modified for KERNEL_RUN: running test code with interrupts disabled
 
 // � 2010-2015 GNU General Public License www.gnu.org/licences
 
@@ -13,7 +16,16 @@
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
 #include <asm/uaccess.h>
+#include <asm/nmi.h>
+#include <asm/apic.h>
+#include <asm/processor.h>
+#include <asm/fpu/api.h>
+#include <asm/tsc.h>
 
 #include "MSRdrvL.h"
 
@@ -108,12 +120,276 @@ static void WriteMSR(int num, int low, int high) {
     __asm__ __volatile__("wrmsr" : : "c"(num), "a"(low), "d"(high));
 }
 
+// Sampling of the instruction pointer on counter overflow interrupts, for each processor
+struct SPmiState {
+    int active;                     // sampling on this processor
+    unsigned int counter;           // counter register that interrupts on overflow
+    int period;                     // number of events between samples
+    int n;                          // number of samples taken. may exceed MAX_PMI_SAMPLES
+    unsigned long long *samples;    // instruction pointers of first MAX_PMI_SAMPLES samples
+};
+static DEFINE_PER_CPU(struct SPmiState, PmiState);
+
+static void PmiResetCounter(struct SPmiState *s) {
+    // Counter overflows after period events. Intel sign extends bit 31 of the value written
+    WriteMSR(s->counter, -s->period, 0xFFFF);
+}
+
+// NMI handler. Counter overflow interrupts come as NMIs
+static int PmiHandler(unsigned int type, struct pt_regs *regs) {
+    struct SPmiState *s = raw_cpu_ptr(&PmiState);
+    long long status;
+
+    if (!s->active) return NMI_DONE;
+    // The counter counts up from -period. Bit 47 is clear when it has overflowed
+    if (ReadMSR(s->counter) & (1LL << 47)) return NMI_DONE;   // not our interrupt
+    if (s->n < MAX_PMI_SAMPLES) s->samples[s->n] = regs->ip;
+    s->n++;
+    PmiResetCounter(s);
+    if (boot_cpu_data.x86_vendor == X86_VENDOR_INTEL) {
+        // Clear IA32_PERF_GLOBAL_STATUS through IA32_PERF_GLOBAL_OVF_CTRL
+        status = ReadMSR(0x38E);
+        if (status) WriteMSR(0x390, (int)status, (int)(status >> 32));
+    }
+    // Intel masks the interrupt after each overflow
+    apic_write(APIC_LVTPC, APIC_DM_NMI);
+    return NMI_HANDLED;
+}
+
+// Test code of the MSRrun module of the current test (see MSRrun.c), which KERNEL_RUN runs.
+// Memory that a driver allocates can't be made executable in recent kernels, so the test
+// code comes as the code of a module of its own. NULL if none is loaded
+static const char *KernelRunCode;
+static int KernelRunSize;
+// Largest number of iterations that a repetition of the test code was found to do
+// within MAX_KERNEL_MILLISECONDS
+static int KernelRunSafeIterations;
+
+// The test code is shared by all processors
+static DEFINE_MUTEX(KernelRunLock);
+
+// Called by MSRrun when it is loaded, and with NULL when it is unloaded
+int MSRdrvSetKernelRun(const char *code, int size) {
+    mutex_lock(&KernelRunLock);
+    KernelRunCode = code;
+    KernelRunSize = size;
+    KernelRunSafeIterations = 0;
+    mutex_unlock(&KernelRunLock);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(MSRdrvSetKernelRun);
+
+// Run the test code once on this processor with preemption and interrupts disabled, so that
+// only NMIs and SMIs can disturb it. No repetition starts after MAX_KERNEL_MILLISECONDS.
+// Returns number of repetitions done
+static long long KernelRunOnce(struct SKernelRun *run, char *data) {
+    int (*entry)(struct SKernelRun *run, char *data) = (void*)KernelRunCode;
+    unsigned long flags;
+    long long done;
+
+    memset(data, 0, KERNEL_USER_DATA);
+    kernel_fpu_begin();               // test code may use vector registers. Disables preemption
+    local_irq_save(flags);
+    run->deadline = rdtsc() + (long long)tsc_khz * MAX_KERNEL_MILLISECONDS;
+    done = entry(run, data);
+    local_irq_restore(flags);
+    kernel_fpu_end();
+    return done;
+}
+
+// Check that a repetition of run->iterations takes less than MAX_KERNEL_MILLISECONDS, as the
+// deadline is only checked between repetitions. Iteration counts above the largest that has been
+// checked are tried with one repetition first, doubling from that. A count is refused without
+// being tried when the time of the count before shows it would take too long.
+// Returns 0 if ok, -2 if too long, -1 on error
+static int KernelRunCheckTime(struct SKernelRun *run, char *data) {
+    struct SKernelRun *probe;
+    long long clocks, limit = (long long)tsc_khz * MAX_KERNEL_MILLISECONDS;
+    int iterations = KernelRunSafeIterations, result = 0;
+
+    if (run->iterations <= iterations) return 0;
+    probe = kmemdup(run, sizeof(*run), GFP_KERNEL);
+    if (!probe) return -1;
+    while (iterations < run->iterations) {
+        iterations = iterations > run->iterations / 2 ? run->iterations : (iterations ? iterations * 2 : 1);
+        probe->repetitions = 1;
+        probe->iterations = iterations;
+        if (KernelRunOnce(probe, data) != 1) {
+            result = -1;
+            break;
+        }
+        // clocks are time stamp counter ticks, less the overhead. Scale to the iterations asked for
+        clocks = probe->clocks[0] > 0 ? probe->clocks[0] : 0;
+        if (clocks * run->iterations / iterations > limit) {
+            result = -2;
+            break;
+        }
+        KernelRunSafeIterations = iterations;
+    }
+    kfree(probe);
+    return result;
+}
+
+// Run test code with interrupts disabled (KernelRunOnce), after checking that it is the test
+// code of the loaded MSRrun module and that each repetition takes less than MAX_KERNEL_MILLISECONDS.
+// run is the SKernelRun in application memory. Returns number of repetitions done,
+// -2 if a repetition takes too long, -1 on error
+static long long KernelRun(struct SKernelRun __user *userrun) {
+    struct SKernelRun *run;
+    char *code = NULL, *data;
+    long long done = -1;
+
+    run = kmalloc(sizeof(*run), GFP_KERNEL);
+    data = kzalloc(KERNEL_USER_DATA, GFP_KERNEL);
+    if (!run || !data || copy_from_user(run, userrun, sizeof(*run))) goto out;
+    if (run->code_size <= 0 || run->code_size > MAX_KERNEL_CODE
+    || run->repetitions <= 0 || run->repetitions > MAX_KERNEL_REPETITIONS || run->iterations <= 0) goto out;
+    code = vmalloc(run->code_size);
+    if (!code || copy_from_user(code, (void __user*)run->code, run->code_size)) goto out;
+
+    mutex_lock(&KernelRunLock);
+    // The module may be left from another test
+    if (KernelRunCode && run->code_size == KernelRunSize && !memcmp(code, KernelRunCode, KernelRunSize)) {
+        done = KernelRunCheckTime(run, data);
+        if (done == 0) done = KernelRunOnce(run, data);
+    }
+    mutex_unlock(&KernelRunLock);
+
+    if (done > 0 && copy_to_user(userrun, run, sizeof(*run))) done = -1;
+out:
+    vfree(code);
+    kfree(data);
+    kfree(run);
+    return done;
+}
+
+static void ProcessCommands(struct SMSRInOut *commands, int first);
+
+// Arguments for doing the rest of a command list on another processor
+struct SProcessArgs {
+    struct SMSRInOut *commands;
+    int first;
+};
+
+static void ProcessCommandsOnCpu(void *info) {
+    struct SProcessArgs *args = (struct SProcessArgs*)info;
+    ProcessCommands(args->commands, args->first);
+}
+
+// Do the commands in a list from index first
+static void ProcessCommands(struct SMSRInOut *commands, int first) {
+    int i, n;
+    long int cr4val;
+    struct SProcessArgs args;
+    struct SPmiState *s;
+
+    for (i = first; i <= MAX_QUE_ENTRIES; i++) {
+        switch (commands[i].msr_command) {
+        case MSR_IGNORE:
+            break;
+
+        case MSR_STOP: default:       // end of command list
+            i = MAX_QUE_ENTRIES + 1;
+            break;
+
+        case MSR_READ:                // read model specific register
+            commands[i].value = ReadMSR(commands[i].register_number);
+            break;
+
+        case MSR_WRITE:               // write model specific register
+            WriteMSR(commands[i].register_number, commands[i].val[0], commands[i].val[1]);
+            break;
+
+        case CR_READ:                 // read control register
+            commands[i].value = (long long)ReadCR(commands[i].register_number);
+            break;
+
+        case CR_WRITE:                // write control register
+            WriteCR(commands[i].register_number, (long int)commands[i].value);
+            break;
+
+        case PMC_ENABLE:              // Enable RDPMC and RDTSC instructions
+            cr4val = ReadCR(4);        // Read CR4
+            cr4val |= 0x100;           // Enable RDPMC
+            cr4val &= ~4;              // Enable RDTSC
+            WriteCR(4, cr4val);        // Write CR4
+            break;
+
+        case PMC_DISABLE:             // Disable RDPMC instruction (RDTSC remains enabled)
+            cr4val = ReadCR(4);        // Read CR4
+            cr4val &= ~0x100;          // Disable RDPMC
+            //cr4val |= 4;             // Disable RDTSC
+            WriteCR(4, cr4val);        // Write CR4
+            break;
+
+        case PROC_GET:                // get processor number. 
+            commands[i].value = raw_smp_processor_id();
+            break;
+
+        case PROC_SET:                // set processor number. 
+            // Do the rest of the list on processor number value, e.g. to read the counters of a
+            // processor that is running a test. Value is set to -1 if the processor is offline
+            args.commands = commands;
+            args.first = i + 1;
+            if (smp_call_function_single((int)commands[i].value, ProcessCommandsOnCpu, &args, 1)) {
+                commands[i].value = -1;
+            }
+            i = MAX_QUE_ENTRIES + 1;
+            break;
+
+        case PMI_START:               // sample instruction pointer on counter overflow
+            // The event select register must enable the interrupt (bit 20)
+            s = raw_cpu_ptr(&PmiState);
+            if (!s->samples) {
+                s->samples = kmalloc_array(MAX_PMI_SAMPLES, sizeof(*s->samples), GFP_ATOMIC);
+                if (!s->samples) {
+                    commands[i].value = -1;
+                    break;
+                }
+            }
+            s->counter = commands[i].register_number;
+            s->period = commands[i].val[0];
+            s->n = 0;
+            PmiResetCounter(s);
+            apic_write(APIC_LVTPC, APIC_DM_NMI);
+            s->active = 1;
+            break;
+
+        case PMI_STOP:                // stop sampling
+            s = raw_cpu_ptr(&PmiState);
+            s->active = 0;
+            commands[i].value = s->n;
+            break;
+
+        case PMI_READ:                // copy samples of a processor to application memory
+            // Must not come after PROC_SET, as the application memory is only accessible here
+            if (commands[i].register_number >= nr_cpu_ids) {
+                commands[i].value = -1;
+                break;
+            }
+            s = per_cpu_ptr(&PmiState, commands[i].register_number);
+            n = s->n < MAX_PMI_SAMPLES ? s->n : MAX_PMI_SAMPLES;
+            if (s->samples && n > 0
+            && copy_to_user((void __user*)commands[i].value, s->samples, n * sizeof(*s->samples))) {
+                commands[i].value = -1;
+                break;
+            }
+            commands[i].value = s->n;
+            break;
+
+        case KERNEL_RUN:              // run test code with interrupts disabled
+            // Must not come after PROC_SET, as it sleeps. Runs on the processor that the
+            // calling thread is locked to
+            commands[i].value = in_task() ? KernelRun((struct SKernelRun __user*)commands[i].value) : -1;
+            break;
+        }
+    }
+}
+
 // This is the main in/out control function
 static long MSRdrv_ioctl(struct file *file, unsigned int ioctl_num, unsigned long ioctl_param) {
 
     struct SMSRInOut *commandp = (struct SMSRInOut*)ioctl_param;
-    int i;
-    long int cr4val;
 
 #ifdef ACCESSPROBLEM   // use this if driver cannot access user memory. this occurs rarely
 
@@ -127,54 +403,7 @@ static long MSRdrv_ioctl(struct file *file, unsigned int ioctl_num, unsigned lon
 #endif
 
     if (ioctl_num == IOCTL_PROCESS_LIST) {
-        for (i = 0; i <= MAX_QUE_ENTRIES; i++) {
-            switch (commands[i].msr_command) {
-            case MSR_IGNORE:
-                break;
-
-            case MSR_STOP: default:       // end of command list
-                i = MAX_QUE_ENTRIES + 1;
-                break;
-
-            case MSR_READ:                // read model specific register
-                commands[i].value = ReadMSR(commands[i].register_number);
-                break;
-
-            case MSR_WRITE:               // write model specific register
-                WriteMSR(commands[i].register_number, commands[i].val[0], commands[i].val[1]);
-                break;
-
-            case CR_READ:                 // read control register
-                commands[i].value = (long long)ReadCR(commands[i].register_number);
-                break;
-
-            case CR_WRITE:                // write control register
-                WriteCR(commands[i].register_number, (long int)commands[i].value);
-                break;
-
-            case PMC_ENABLE:              // Enable RDPMC and RDTSC instructions
-                cr4val = ReadCR(4);        // Read CR4
-                cr4val |= 0x100;           // Enable RDPMC
-                cr4val &= ~4;              // Enable RDTSC
-                WriteCR(4, cr4val);        // Write CR4
-                break;
-
-            case PMC_DISABLE:             // Disable RDPMC instruction (RDTSC remains enabled)
-                cr4val = ReadCR(4);        // Read CR4
-                cr4val &= ~0x100;          // Disable RDPMC
-                //cr4val |= 4;             // Disable RDTSC
-                WriteCR(4, cr4val);        // Write CR4
-                break;
-
-            case PROC_GET:                // get processor number. 
-                // not implemented in Linux version
-                break;
-
-            case PROC_SET:                // set processor number. 
-                // not implemented in Linux version
-                break;
-            }
-        }
+        ProcessCommands(commands, 0);
 
 #ifdef ACCESSPROBLEM   // use this if driver cannot access user memory. this occurs rarely
 
@@ -274,10 +503,18 @@ static int MSRdrv_init(void) {
     cdev_init( MSRdrv_cdev, &MSRdrv_fops );
     cdev_add( MSRdrv_cdev, MSRdrv_dev, 1 );
 
+    register_nmi_handler(NMI_LOCAL, PmiHandler, 0, DEV_NAME);
+
     return 0;
 }
 
 static void MSRdrv_exit(void) {
+    int cpu;
+
+    unregister_nmi_handler(NMI_LOCAL, DEV_NAME);
+    for_each_possible_cpu(cpu) {
+        kfree(per_cpu(PmiState, cpu).samples);
+    }
     cdev_del( MSRdrv_cdev );
     unregister_chrdev_region( MSRdrv_dev, 1 );
 }
@@ -18,4 +18,7 @@
 #define IOCTL_NOACTION _IO(DEV_MAJOR, 0)
 #define IOCTL_PROCESS_LIST _IO(DEV_MAJOR, 1)
 
+// Give the test code of the MSRrun module to the driver for KERNEL_RUN, or NULL when it unloads
+int MSRdrvSetKernelRun(const char *code, int size);
+
 #endif
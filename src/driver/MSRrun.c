@@ -0,0 +1,36 @@
+//                       MSRrun.c
+
+// Kernel module holding the test code that MSRdrv runs with interrupts disabled (KERNEL_RUN).
+// It is built for each test with kernel.bin, the test loop assembled from PMCTestK64.nasm,
+// as part of its code, so the kernel maps the test code read-only and executable like the
+// code of any module. When loaded it gives the test code to MSRdrv, which must be loaded first.
+// Build with make out/kmod/MSRrun.ko in the directory above, load with load_test.sh
+
+// GNU General Public License www.gnu.org/licences
+
+#include <linux/init.h>
+#include <linux/module.h>
+
+#include "MSRdrvL.h"
+
+MODULE_LICENSE("GPL");
+
+// The test code. It starts with endbr64, as indirect calls must land on one when IBT is enabled
+asm(".pushsection .text.kernel_run, \"ax\"\n"
+    ".balign 4096\n"
+    "KernelRunCode:\n"
+    ".incbin \"kernel.bin\"\n"
+    "KernelRunCodeEnd:\n"
+    ".popsection\n");
+extern char KernelRunCode[], KernelRunCodeEnd[];
+
+static int __init MSRrun_init(void) {
+    return MSRdrvSetKernelRun(KernelRunCode, (int)(KernelRunCodeEnd - KernelRunCode));
+}
+
+static void __exit MSRrun_exit(void) {
+    MSRdrvSetKernelRun(NULL, 0);
+}
+
+module_init(MSRrun_init);
+module_exit(MSRrun_exit);
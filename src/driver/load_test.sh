@@ -0,0 +1,5 @@
+#!/bin/bash
+
+# Load the test code module of a test (MSRrun.ko, see MSRrun.c), replacing the one before
+rmmod MSRrun 2>/dev/null
+insmod "$1"
@@ -1,2 +1,3 @@
 rm -f /dev/MSRdrv
+rmmod MSRrun 2>/dev/null
 rmmod MSRdrv
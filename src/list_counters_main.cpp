@@ -3,28 +3,51 @@
 // This tool has minimal dependencies - it only needs:
 // 1. CPU detection code (vendor/family/scheme)
 // 2. Access to CounterDefinitions array
+//
+// Usage: list-counters [coretype]
+// On hybrid processors the counters depend on the core type. Give the core type
+// (32 = E-core, 64 = P-core) to list the counters for that type of core.
+// The argument is ignored on other processors.
 
 #include "PMCTest.h"
 #include "CPUDetection.h"
 #include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && CPUDetection().IsHybrid()) {
+        // Run on a processor of the requested core type
+        int coreType = (int)strtol(argv[1], NULL, 0);
+        SyS::ProcMaskType mask = SyS::GetProcessMask();
+        int p, nproc = SyS::NumProcessors();
+        for (p = 0; p < nproc; p++) {
+            if (!SyS::TestProcessMask(p, &mask)) continue;
+            SyS::SetProcessMask(p);
+            if (CPUDetection::CurrentCoreType() == coreType) break;
+        }
+        if (p == nproc) {
+            fprintf(stderr, "No processor of core type 0x%x available\n", coreType);
+            return 1;
+        }
+    }
 
-int main() {
     CPUDetection cpu;
     EPMCScheme scheme = cpu.GetScheme();
     EProcFamily family = cpu.GetFamily();
     int model = cpu.GetModel();
 
     // Debug output (to stderr so it doesn't interfere with CSV)
-    fprintf(stderr, "Detected CPU - Model: 0x%x, Scheme: 0x%x, Family: 0x%x\n", model, scheme, family);
+    fprintf(stderr, "Detected CPU - Model: 0x%x, Scheme: 0x%x, Family: 0x%x, Core type: 0x%x\n",
+        model, scheme, family, cpu.GetCoreType());
 
     // Print CSV header
-    printf("counter_id,name,supported,scheme,family\n");
+    printf("counter_id,name,supported,scheme,family,uncore\n");
 
     // List all counters
     for (int i = 0; CounterDefinitions[i].CounterType || CounterDefinitions[i].ProcessorFamily; i++) {
         SCounterDefinition* def = &CounterDefinitions[i];
         int supported = (def->PMCScheme & scheme) && (def->ProcessorFamily & family);
-        printf("%d,%s,%d,0x%x,0x%x\n",
+        printf("%d,%s,%d,0x%x,0x%x,0\n",
             def->CounterType,
             def->Description,
             supported,
@@ -32,5 +55,16 @@ int main() {
             def->ProcessorFamily);
     }
 
+    // List uncore counters. Family is 0, as the uncore scheme decides
+    EUncoreScheme uncoreScheme = cpu.GetUncoreScheme();
+    for (int i = 0; UncoreDefinitions[i].CounterType; i++) {
+        SUncoreDefinition* def = &UncoreDefinitions[i];
+        printf("%d,%s,%d,0x%x,0x0,1\n",
+            def->CounterType,
+            def->Description,
+            (def->UncoreScheme & uncoreScheme) != 0,
+            def->UncoreScheme);
+    }
+
     return 0;
 }
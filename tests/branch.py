@@ -6,7 +6,15 @@ import matplotlib.pyplot as plt
 import numpy as np
 from matplotlib.pyplot import cm
 
-from agner.agner import Agner, MergeError, TestResults, merge_results, run_test
+from agner.agner import (
+    INTERRUPT_COLUMNS,
+    TOPDOWN_COLUMNS,
+    Agner,
+    MergeError,
+    TestPipeline,
+    TestResults,
+    merge_results,
+)
 
 SCRAMBLE_BTB = """
 ; Proven effective at "scrambling" the BTB/BPU for an Arrendale M520
@@ -36,6 +44,11 @@ ScrambleBTB:
 """
 
 
+# The BTB is scrambled before each repetition, so the number of iterations sets how often
+# the branches are seen cold. Keep it fixed so that runs can be merged
+ITERATIONS = 100
+
+
 def branch_test(name: str, instr: str, backwards: bool = False) -> TestResults:
     extra_begin = ""
     extra_end = ""
@@ -72,12 +85,21 @@ align 16
     for _attempt in range(10):
         results: TestResults | None = None
         try:
-            for counters in (
-                ["Core cyc", "Instruct", "BrMispred", "BaClrFIq"],
-                ["Core cyc", "Instruct", "BaClrClr", "BaClrBad"],
-                ["Core cyc", "Instruct", "BaClrL8"],
-            ):
-                results = merge_results(results, run_test(test_code, counters, init_each=SCRAMBLE_BTB))
+            # The counter sets are built while the first is measured
+            with TestPipeline() as pipeline:
+                runs = [
+                    # Runs are merged by repetition, so keep interrupted ones
+                    pipeline.submit(
+                        test_code, counters, init_each=SCRAMBLE_BTB, iterations=ITERATIONS, drop_interrupted=False
+                    )
+                    for counters in (
+                        ["Core cyc", "Instruct", "BrMispred", "BaClrFIq"],
+                        ["Core cyc", "Instruct", "BaClrClr", "BaClrBad"],
+                        ["Core cyc", "Instruct", "BaClrL8"],
+                    )
+                ]
+                for run in runs:
+                    results = merge_results(results, run.result())
             assert results is not None  # Should have results from the loop above
             return results
         except (MergeError, ValueError) as e:
@@ -95,6 +117,10 @@ def branch_plot(name: str, results: TestResults) -> None:
         del res["Clock"]
         del res["Instruct"]
         del res["Core cyc"]
+        res.pop("CoreType", None)
+        res.pop("Iterations", None)
+        for column in TOPDOWN_COLUMNS + INTERRUPT_COLUMNS:
+            res.pop(column, None)
 
     fig, ax = plt.subplots()
     fig.canvas.set_window_title(name)  # type: ignore[attr-defined]
@@ -3,74 +3,58 @@
 from __future__ import annotations
 
 import matplotlib.pyplot as plt
-import numpy as np
 
-from agner.agner import Agner, CounterData, run_test
+from agner.agner import Agner, CounterData, adaptive_grid, jump_chain, run_test
+from agner.plot import heatmap
 
 # Type alias for BTB test results
 BTBResults = dict[str, list[list[float]]]
 
 
+# Branches are placed from here. Aligned to 4GB, so that the branch addresses only differ in
+# the bits set by the alignment
+BTB_BASE = 1 << 32
+
+
 def btb_size_test(name: str, num_branches: int, align: int) -> CounterData:
-    test_code = f"""
-%macro OneJump 0
-jmp %%next
-align {align}
-%%next:
-%endmacro
-
-jmp BtbLoop
-align 4 * 1024 * 1024; align to a 4MB boundary
-BtbLoop:
-%rep {num_branches}
-OneJump
-%endrep
+    test_code = """
+mov rax, PLACED_CODE_0
+call rax
 
 %rep 64
 nop
 %endrep
 """
-    r = run_test(test_code, ["Core cyc", "BaClrAny", "BaClrEly", "BaClrL8"], repetitions=100)
+    chain = jump_chain([BTB_BASE + align * index for index in range(num_branches)])
+    # Enough iterations that the first, when the branches aren't in the BTB yet, doesn't matter
+    r = run_test(
+        test_code,
+        ["Core cyc", "BaClrAny", "BaClrEly", "BaClrL8"],
+        repetitions=100,
+        iterations=100,
+        placements=chain,
+    )
     return min(r, key=lambda x: x["BaClrAny"])
 
 
-def plot(xs: list[int], ys: list[int], result: list[list[float]], name: str, index: int | None) -> None:
-    if index:
-        ax = plt.subplot(2, 2, index)
-    else:
-        ax = plt.subplot(1, 1, 1)
-    ax.set_yscale("log", basey=2)
-    plt.title(name)
-
-    plt.xlabel("Branch count")
-    plt.ylabel("Branch alignment")
+def plot(xs: list[int], ys: list[int], result: list[list[float]], name: str, index: int) -> None:
+    ax = heatmap(xs, ys, result, name, index, y_scale="log", xlabel="Branch count", ylabel="Branch alignment")
     ax.xaxis.set_ticks(xs)
-    xs = np.array(xs + [xs[-1] + 1])
-    ys = np.array(ys + [ys[-1] * 2])
-    xx, yy = np.meshgrid(xs, ys)
-    result = np.array(result)
-    plt.pcolor(xx, yy, result)
-    plt.colorbar()
 
 
 def btb_test(nums: list[int] | range, aligns: list[int], name: str) -> BTBResults:
-    resteer: list[list[float]] = []
-    early: list[list[float]] = []
-    late: list[list[float]] = []
-    core: list[list[float]] = []
-    for align in aligns:
-        resteer.append([])
-        early.append([])
-        late.append([])
-        core.append([])
-        for num in nums:
-            res = btb_size_test(f"BTB size test {num} branches aligned on {align}", num, align)
-            exp = num * 100.0  # number of branches under test
-            resteer[-1].append(res["BaClrAny"] / exp)
-            early[-1].append(res["BaClrEly"] / exp)
-            late[-1].append(res["BaClrL8"] / exp)
-            core[-1].append(res["Core cyc"] / exp)
-    return {"resteer": resteer, "early": early, "late": late, "core": core}
+    def measure(num: int, align: int) -> CounterData:
+        res = btb_size_test(f"BTB size test {num} branches aligned on {align}", num, align)
+        return {
+            "resteer": res["BaClrAny"] / num,
+            "early": res["BaClrEly"] / num,
+            "late": res["BaClrL8"] / num,
+            "core": res["Core cyc"] / num,
+        }
+
+    # Only the steps in re-steers and cycles per branch are of interest, so measure densely around those
+    grid = adaptive_grid(list(nums), aligns, measure, ["resteer", "core"], abs_tol=0.05)
+    return {key: [[cell[key] for cell in row] for row in grid] for key in ("resteer", "early", "late", "core")}
 
 
 def btb_plot(nums: list[int] | range, aligns: list[int], name: str, results: BTBResults, alt: bool) -> None:
@@ -109,4 +93,4 @@ def add_tests(agner: Agner) -> None:
     add_test(agner, range(1, 12), [2**x for x in range(1, 21)], "Number of ways")
 
     # attempt to find number of addr bits : two branches very spread
-    add_test(agner, [2], [2**x for x in range(6, 28)], "Number of address bits for set")
+    add_test(agner, [2], [2**x for x in range(6, 32)], "Number of address bits for set")
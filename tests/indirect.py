@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+
+from __future__ import annotations
+
+import random
+from typing import Callable
+
+import matplotlib.pyplot as plt
+
+from agner.agner import Agner, CounterData, adaptive_sweep, run_test
+from agner.counters import get_counter_db
+
+# Per series, one value per point of the x axis. "x" holds the x axis
+IndirectResults = dict[str, list[float]]
+
+# Length of the random target sequences. Long enough that the predictors can't learn it by heart
+SEQUENCE_LENGTH = 1024
+
+ITERATIONS = 2000
+
+
+def mispredict_counter(name: str) -> str:
+    """name if this processor counts it, otherwise all mispredicted branches. The tests have no
+    other mispredicted branches than the ones measured, apart from the loop exit."""
+    return name if get_counter_db().is_supported(name) else "BrMispred"
+
+
+def rsb_code(depth: int) -> tuple[str, str]:
+    """init_once with a chain of depth functions, and test code that calls the first.
+
+    Each function calls the next from its own call site, then all of them return through the same ret,
+    so that the return has depth targets. Only the return stack buffer can predict it.
+    """
+    lines = ["jmp RsbEnd", "align 16"]
+    for level in range(1, depth):
+        lines += [f"RsbLevel{level}:", f"call RsbLevel{level + 1}", "jmp RsbReturn"]
+    lines += [f"RsbLevel{depth}:", "RsbReturn:", "ret", "RsbEnd:"]
+    return "\n".join(lines) + "\n", "call RsbLevel1\n"
+
+
+def rsb_measure(depth: int) -> CounterData:
+    counter = mispredict_counter("RetMisp")
+    init, test = rsb_code(depth)
+    results = run_test(test, ["Core cyc", counter], init_once=init, repetitions=10, iterations=ITERATIONS)
+    r = min(results, key=lambda x: x[counter])
+    return {"mispredicted": r[counter] / depth, "cycles": r["Core cyc"] / depth}
+
+
+def rsb_test() -> IndirectResults:
+    depths = list(range(1, 65))
+    points = adaptive_sweep(depths, rsb_measure, ["mispredicted"], abs_tol=0.05)
+    below = [depth for depth, point in zip(depths, points) if point["mispredicted"] < 0.05]
+    print(f"  returns predicted up to a call depth of {max(below, default=0)}")
+    return {
+        "x": [float(depth) for depth in depths],
+        "mispredicted": [point["mispredicted"] for point in points],
+        "cycles": [point["cycles"] for point in points],
+    }
+
+
+def indirect_code(
+    sequence: list[int], targets: int, hints: list[int] | None = None, bits: int = 0
+) -> tuple[str, str]:
+    """init_once with a table of the targets to jump to in turn, and test code with one indirect jump.
+
+    With hints, `bits` conditional branches on the bits of each hint come before the jump, so that
+    the global history holds them. r8d is the position in the table and r9 its address.
+    """
+    lines = ["jmp IndTableEnd", "align 8", "IndTable:"]
+    lines += [f"dd IndTarget{target} - IndTable" for target in sequence]
+    if hints is not None:
+        lines.append("IndHints:")
+        lines += [f"db {hint}" for hint in hints]
+    lines += ["IndTableEnd:", "lea r9, [rel IndTable]", "xor r8d, r8d"]
+    init = "\n".join(lines) + "\n"
+
+    test = []
+    if hints is not None:
+        test.append("movzx eax, byte [r9 + r8 + IndHints - IndTable]")
+        for bit in range(bits):
+            test += [f"test eax, {1 << bit}", f"jz IndHint{bit}", "nop", f"IndHint{bit}:"]
+    test += [
+        "movsxd rax, dword [r9 + r8*4]",
+        "add rax, r9",
+        "inc r8d",
+        f"cmp r8d, {len(sequence)}",
+        "jb IndJump",
+        "xor r8d, r8d",
+        "IndJump:",
+        "jmp rax",
+        "align 16",
+    ]
+    for target in range(targets):
+        test += [f"IndTarget{target}:", "jmp IndDone", "align 16"]
+    test.append("IndDone:")
+    return init, "\n".join(test) + "\n"
+
+
+def indirect_measure(init: str, test: str) -> CounterData:
+    counter = mispredict_counter("IndirMisp")
+    results = run_test(test, ["Core cyc", counter], init_once=init, repetitions=10, iterations=ITERATIONS)
+    r = min(results, key=lambda x: x[counter])
+    return {"mispredicted": r[counter], "cycles": r["Core cyc"]}
+
+
+def targets_test() -> IndirectResults:
+    """Targets of one jump taken in a fixed cycle, against in random order."""
+    counts = list(range(1, 129))
+
+    def cyclic(targets: int) -> CounterData:
+        return indirect_measure(*indirect_code(list(range(targets)), targets))
+
+    def shuffled(targets: int) -> CounterData:
+        # The same sequence for the same number of targets, whichever points the sweep measures
+        rng = random.Random(targets)
+        sequence = [rng.randrange(targets) for _ in range(SEQUENCE_LENGTH)]
+        return indirect_measure(*indirect_code(sequence, targets))
+
+    cycle = adaptive_sweep(counts, cyclic, ["mispredicted"], abs_tol=0.05)
+    rand = adaptive_sweep(counts, shuffled, ["mispredicted"], abs_tol=0.05)
+    below = [targets for targets, point in zip(counts, cycle) if point["mispredicted"] < 0.05]
+    print(f"  up to {max(below, default=0)} targets of one jump predicted in a cycle")
+    return {
+        "x": [float(targets) for targets in counts],
+        "cyclic": [point["mispredicted"] for point in cycle],
+        "random": [point["mispredicted"] for point in rand],
+    }
+
+
+def history_test() -> IndirectResults:
+    """Random targets of one jump, after conditional branches on the bits of the target number
+    (correlated) or on independent random bits (uncorrelated)."""
+    if not get_counter_db().is_supported("IndirMisp"):
+        print("  mispredicted indirect branches are not counted on this processor, skipping")
+        return {}
+    rng = random.Random(2)
+    results: IndirectResults = {"x": [], "correlated": [], "uncorrelated": []}
+    for bits in range(1, 6):
+        targets = 1 << bits
+        sequence = [rng.randrange(targets) for _ in range(SEQUENCE_LENGTH)]
+        noise = [rng.randrange(targets) for _ in range(SEQUENCE_LENGTH)]
+        correlated = indirect_measure(*indirect_code(sequence, targets, sequence, bits))
+        uncorrelated = indirect_measure(*indirect_code(sequence, targets, noise, bits))
+        results["x"].append(float(targets))
+        results["correlated"].append(correlated["mispredicted"])
+        results["uncorrelated"].append(uncorrelated["mispredicted"])
+        print(
+            f"  {targets} targets: {correlated['mispredicted']:.2f} mispredicted per jump with the history,"
+            f" {uncorrelated['mispredicted']:.2f} without"
+        )
+    return results
+
+
+def indirect_plot(name: str, xlabel: str, ylabel: str, results: IndirectResults, alt: bool) -> None:
+    if not results:
+        return
+    fig = plt.figure()
+    fig.canvas.set_window_title(name)  # type: ignore[attr-defined]
+    plt.title(name)
+    # The alternative plot shows the clock cycles, where measured
+    if alt and "cycles" in results:
+        series = ["cycles"]
+        ylabel = "Core cycles"
+    else:
+        series = [key for key in results if key not in ("x", "cycles")]
+    for key in series:
+        plt.plot(results["x"], results[key], marker=".", label=key)
+    plt.xlabel(xlabel)
+    plt.ylabel(ylabel)
+    plt.legend()
+
+
+def add_test(agner: Agner, name: str, test: Callable[[], IndirectResults], xlabel: str, ylabel: str) -> None:
+    def plot(results: IndirectResults, alt: bool) -> None:
+        return indirect_plot(name, xlabel, ylabel, results, alt)
+
+    agner.add_test(name, test, plot)
+
+
+def add_tests(agner: Agner) -> None:
+    add_test(agner, "Return stack depth", rsb_test, "Call depth", "Mispredicted per return")
+    add_test(agner, "Indirect targets", targets_test, "Targets", "Mispredicted per jump")
+    add_test(agner, "Indirect history", history_test, "Targets", "Mispredicted per jump")
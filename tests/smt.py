@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+
+from __future__ import annotations
+
+import statistics
+from typing import NamedTuple
+
+import matplotlib.pyplot as plt
+import numpy as np
+
+from agner.agner import Agner, CounterData, TestResults, ThreadCode, results_by_role, run_test
+from agner.isolation import sibling_pair
+
+# Results of each measured kernel: "solo" and each aggressor, with the slowdown and counter deltas against solo
+SMTResults = dict[str, dict[str, CounterData]]
+
+COUNTERS = ["Core cyc", "Instruct", "Uops", "L1D Miss"]
+
+# Buffer for the memory-bound mixes, larger than the last level cache. Each thread maps its own
+# the first time it runs, and keeps its address at MEMORY_POINTER in its part of UserData
+MEMORY_SIZE = 1 << 26
+MEMORY_POINTER = 0x2000
+
+# Thread number n maps its buffer at MEMORY_BASE + n * MEMORY_STRIDE. Each run maps over the last one,
+# so native runs don't use up memory, and the threads of a run don't share a buffer
+MEMORY_BASE = 4 << 40
+MEMORY_STRIDE = 1 << 32
+
+
+def memory_init(label: str, thread: int) -> str:
+    """Point r12 at the buffer of thread number thread, mapping it first if needed. label makes the labels unique."""
+    lines = MEMORY_SIZE // 64
+    return f"""
+mov r12, [rsi + {MEMORY_POINTER:#x}]
+test r12, r12
+jnz {label}Ready
+push rsi
+push rdi
+mov eax, 9                      ; mmap
+mov rdi, {MEMORY_BASE + thread * MEMORY_STRIDE:#x}
+mov esi, {MEMORY_SIZE:#x}
+mov edx, 3                      ; PROT_READ | PROT_WRITE
+mov r10d, 32h                   ; MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED
+mov r8, -1
+xor r9d, r9d
+syscall
+pop rdi
+pop rsi
+mov r12, rax
+mov [rsi + {MEMORY_POINTER:#x}], r12
+; Chain of pointers through all cache lines, each 4097 lines on from the last, for the latency kernel
+xor ecx, ecx
+mov ebx, {lines}
+{label}Link:
+lea edx, [ecx + 4097]
+and edx, {lines - 1}
+mov rax, rdx
+shl rax, 6
+add rax, r12
+mov r8, rcx
+shl r8, 6
+mov [r12 + r8], rax
+mov ecx, edx
+dec ebx
+jnz {label}Link
+{label}Ready:
+xor r9d, r9d                    ; offset of the bandwidth kernel. TestLoop's cpuid changes ebx
+"""
+
+
+class Mix(NamedTuple):
+    """Code that is either measured, or run as the aggressor on the sibling hyperthread.
+
+    Registers are the thread's own, so both threads may use the same ones.
+    """
+
+    body: str
+    init: str = ""
+    memory: bool = False  # uses the buffer at r12
+
+    def init_code(self, label: str, thread: int) -> str:
+        return self.init + (memory_init(label, thread) if self.memory else "")
+
+
+# Port-heavy and memory-bound mixes
+MIXES = {
+    "ALU": Mix(
+        """
+%rep 4
+add eax, ecx
+add ebx, ecx
+add edx, ecx
+add r8d, ecx
+%endrep
+"""
+    ),
+    "Load": Mix(
+        """
+%rep 4
+mov eax, [rsi]
+mov ebx, [rsi + 64]
+mov edx, [rsi + 128]
+mov r8d, [rsi + 192]
+%endrep
+"""
+    ),
+    "Store": Mix(
+        """
+%rep 4
+mov [rdi], eax
+mov [rdi + 64], ebx
+mov [rdi + 128], edx
+mov [rdi + 192], r8d
+%endrep
+"""
+    ),
+    "FP": Mix(
+        """
+%rep 4
+addps xmm0, xmm4
+mulps xmm1, xmm4
+addps xmm2, xmm4
+mulps xmm3, xmm4
+%endrep
+"""
+    ),
+    "Branch": Mix(
+        """
+%rep 16
+jmp $+2
+%endrep
+"""
+    ),
+    # Dependent loads that miss the caches: latency bound
+    "Memory latency": Mix(
+        """
+%rep 4
+mov r12, [r12]
+%endrep
+""",
+        memory=True,
+    ),
+    # Independent loads that miss the caches: bandwidth bound
+    "Memory bandwidth": Mix(
+        f"""
+%rep 4
+mov eax, [r12 + r9]
+add r9d, 4160
+and r9d, {MEMORY_SIZE - 1}
+%endrep
+""",
+        memory=True,
+    ),
+}
+
+
+def median_row(results: TestResults) -> CounterData:
+    counters = [counter for counter in COUNTERS if counter in results[0]]
+    return {counter: statistics.median(row[counter] for row in results) for counter in counters}
+
+
+def smt_test(kernel: str) -> SMTResults:
+    pair = sibling_pair()
+    if pair is None:
+        print("  no SMT siblings available, skipping")
+        return {}
+    mix = MIXES[kernel]
+    solo_results = run_test(mix.body, COUNTERS, init_once=mix.init_code("Solo", 0), repetitions=20, cpus=[pair[0]])
+    solo = median_row(solo_results)
+    results: SMTResults = {"solo": solo}
+    for aggressor, aggressor_mix in MIXES.items():
+        # The aggressor runs on the sibling until the measured kernel is done, so it overlaps every repetition
+        threads = [
+            ThreadCode("kernel", mix.body, init_once=mix.init_code("Kernel", 0)),
+            ThreadCode(
+                "aggressor", aggressor_mix.body, init_once=aggressor_mix.init_code("Aggressor", 1), background=True
+            ),
+        ]
+        shared = run_test(threads, COUNTERS, repetitions=20, cpus=list(pair))
+        measured = median_row(results_by_role(shared, threads)["kernel"])
+        row = {"slowdown": measured["Core cyc"] / solo["Core cyc"]}
+        for counter in measured:
+            row[counter] = measured[counter]
+            row[f"{counter} delta"] = measured[counter] - solo[counter]
+        results[aggressor] = row
+        print(f"  {kernel} with {aggressor} on the sibling: {row['slowdown']:.2f}x")
+    return results
+
+
+def smt_plot(kernel: str, results: SMTResults, alt: bool) -> None:
+    if not results:
+        return
+    aggressors = [name for name in results if name != "solo"]
+    fig, ax = plt.subplots()
+    fig.canvas.set_window_title(f"SMT {kernel}")  # type: ignore[attr-defined]
+    if alt:
+        # Counter deltas per iteration against the solo run
+        counters = [counter for counter in COUNTERS if f"{counter} delta" in results[aggressors[0]]]
+        width = 1.0 / (len(counters) + 1)
+        for index, counter in enumerate(counters):
+            xs = np.arange(len(aggressors)) + width * index
+            ax.bar(xs, [results[name][f"{counter} delta"] for name in aggressors], width, label=counter)
+        ax.set_ylabel("Change per iteration")
+        ax.legend()
+    else:
+        ax.bar(np.arange(len(aggressors)), [results[name]["slowdown"] for name in aggressors])
+        ax.axhline(1.0, color="black", linewidth=0.5)
+        ax.set_ylabel("Slowdown against solo")
+    ax.set_xticks(np.arange(len(aggressors)))
+    ax.set_xticklabels(aggressors, rotation=45, ha="right")
+    ax.set_xlabel("Aggressor on sibling hyperthread")
+    ax.set_title(f"{kernel} kernel")
+    fig.tight_layout()
+
+
+def add_test(agner: Agner, kernel: str) -> None:
+    def test() -> SMTResults:
+        return smt_test(kernel)
+
+    def plot(results: SMTResults, alt: bool) -> None:
+        return smt_plot(kernel, results, alt)
+
+    agner.add_test(kernel, test, plot)
+
+
+def add_tests(agner: Agner) -> None:
+    for kernel in MIXES:
+        add_test(agner, kernel)
@@ -0,0 +1,289 @@
+#!/usr/bin/env python3
+
+from __future__ import annotations
+
+from concurrent.futures import Future
+
+import matplotlib.pyplot as plt
+
+from agner.agner import Agner, CounterData, TestPipeline, TestResults, run_test
+from agner.counters import get_counter_db
+from agner.environment import cpu_flags
+from agner.plot import heatmap
+
+# Per metric, one row per (store size, load size) pair with one value per offset. "pairs" holds the
+# sizes of each row and "offsets" the offsets, in one row
+ForwardResults = dict[str, list[list[float]]]
+
+# Store and load pairs in each iteration, each taking its data from the one before
+PAIRS = 8
+
+# Store and load sizes in bytes. 16 and 32 byte accesses use xmm0 and ymm0, and need AVX
+SIZES = [1, 2, 4, 8, 16, 32]
+
+# Disambiguation tests alias the load with the store once in this many iterations. 0 is never
+PERIODS = [0, 1024, 256, 64, 16, 4, 1]
+
+COUNTERS = ["Forwfail", "4K alias", "MemOrdClr"]
+
+# r12 points at a page aligned buffer in UserData, with room for loads one page on from the stores
+BUFFER_INIT = """
+lea r12, [rsi + 1000h]
+and r12, -1000h
+"""
+
+
+def counters() -> list[int | str]:
+    """Core cycles and the counters of COUNTERS that this processor has."""
+    db = get_counter_db()
+    return ["Core cyc", *(name for name in COUNTERS if db.is_supported(name))]
+
+
+def usable_sizes(sizes: list[int]) -> list[int]:
+    """The sizes of sizes that this processor can access: without AVX, only those in general registers."""
+    if "avx" in cpu_flags():
+        return sizes
+    return [size for size in sizes if size <= 8]
+
+
+def store(size: int, address: str) -> list[str]:
+    """Store the low size bytes of rax."""
+    if size > 8:
+        # vmovq clears the rest of ymm0, so the store has the same data at every size
+        register = "ymm0" if size == 32 else "xmm0"
+        return ["vmovq xmm0, rax", f"vmovdqu [{address}], {register}"]
+    register = {1: "al", 2: "ax", 4: "eax", 8: "rax"}[size]
+    return [f"mov [{address}], {register}"]
+
+
+def load(size: int, address: str) -> list[str]:
+    """Load size bytes into rax, zero extended."""
+    if size > 8:
+        register = "ymm0" if size == 32 else "xmm0"
+        return [f"vmovdqu {register}, [{address}]", "vmovq rax, xmm0"]
+    return {
+        1: [f"movzx eax, byte [{address}]"],
+        2: [f"movzx eax, word [{address}]"],
+        4: [f"mov eax, [{address}]"],
+        8: [f"mov rax, [{address}]"],
+    }[size]
+
+
+def pair_code(store_size: int, load_size: int, base: int, offset: int) -> str:
+    """PAIRS stores to r12 + base, each followed by a load at offset from the store. The next store
+    stores what the load loaded, so the pairs form one dependency chain through memory."""
+    lines = store(store_size, f"r12 + {base}") + load(load_size, f"r12 + {base + offset}")
+    code = f"%rep {PAIRS}\n" + "\n".join(lines) + "\n%endrep\n"
+    if store_size > 8 or load_size > 8:
+        code += "vzeroupper\n"
+    return code
+
+
+def transfer_cycles() -> float:
+    """Latency of moving rax to xmm0 and back, which the vector stores and loads add to the chain."""
+    test = f"%rep {PAIRS}\nvmovq xmm0, rax\nvmovq rax, xmm0\n%endrep\n"
+    results = run_test(test, ["Core cyc"], repetitions=10)
+    return min(r["Core cyc"] for r in results) / PAIRS
+
+
+def pair_result(r: CounterData, store_size: int, load_size: int, transfer: float) -> CounterData:
+    """Latency of a store and load through memory, and the counts of each pair."""
+    # Each side that goes through xmm0 takes about half the round trip
+    vector_sides = (store_size > 8) + (load_size > 8)
+    result = {"latency": r["Core cyc"] / PAIRS - vector_sides * transfer / 2}
+    for name in COUNTERS:
+        if name in r:
+            result[name] = r[name] / PAIRS
+    return result
+
+
+def forwarded(results: ForwardResults) -> list[list[float]]:
+    """1 where the load went ahead, 0 where it waited for the store to be written.
+
+    With "Forwfail" that is whether the loads were blocked. Without it, loads that take more than
+    twice as long as an aligned 8 byte load after an 8 byte store are taken to have failed.
+    """
+    if "Forwfail" in results:
+        return [[float(blocked < 0.5) for blocked in row] for row in results["Forwfail"]]
+    reference = min(latency for row in results["latency"] for latency in row if latency == latency)
+    pairs = [tuple(pair) for pair in results["pairs"]]
+    if (8, 8) in pairs and results["offsets"][0][0] == 0:
+        reference = results["latency"][pairs.index((8, 8))][0]
+    return [[float(latency < 2 * reference) for latency in row] for row in results["latency"]]
+
+
+def print_matrix(results: ForwardResults) -> None:
+    """One line per store and load size: the latency at each offset, marked x where forwarding failed."""
+    offsets = [int(offset) for offset in results["offsets"][0]]
+    print("  store load " + "".join(f"{offset:>6}" for offset in offsets))
+    for (store_size, load_size), latencies, success in zip(results["pairs"], results["latency"], results["success"]):
+        cells = "".join(
+            f"{latency:5.1f}{' ' if ok else 'x'}" if latency == latency else "     -"
+            for latency, ok in zip(latencies, success)
+        )
+        print(f"  {store_size:5.0f} {load_size:4.0f} {cells}")
+
+
+def forward_test(
+    store_sizes: list[int], load_sizes: list[int], offsets: list[int], base: int, split: bool
+) -> ForwardResults:
+    """Measure every store size, load size and offset of the load from the store.
+
+    base is the offset of the stores from the page aligned buffer, for misaligned stores. With
+    split, each store straddles the end of a cache line instead, with half its bytes on either side.
+    Loads that start past the end of the store in the same line are skipped, as they don't overlap.
+    """
+    all_sizes = set(store_sizes + load_sizes)
+    store_sizes, load_sizes = usable_sizes(store_sizes), usable_sizes(load_sizes)
+    if set(store_sizes + load_sizes) != all_sizes:
+        print("  No AVX: skipping 16 and 32 byte accesses")
+    # Only vector accesses go through xmm0
+    transfer = transfer_cycles() if max(store_sizes + load_sizes) > 8 else 0.0
+    counter_list = counters()
+    runs: dict[tuple[int, int, int], Future[TestResults]] = {}
+    with TestPipeline() as pipeline:
+        for store_size in store_sizes:
+            for load_size in load_sizes:
+                for offset in offsets:
+                    if store_size <= offset < 64:
+                        continue
+                    store_base = 64 - store_size // 2 if split else base
+                    runs[store_size, load_size, offset] = pipeline.submit(
+                        pair_code(store_size, load_size, store_base, offset),
+                        counter_list,
+                        init_once=BUFFER_INIT,
+                        repetitions=10,
+                    )
+    results: ForwardResults = {"pairs": [], "offsets": [list(map(float, offsets))]}
+    for store_size in store_sizes:
+        for load_size in load_sizes:
+            results["pairs"].append([float(store_size), float(load_size)])
+            row: dict[str, list[float]] = {}
+            for offset in offsets:
+                run = runs.get((store_size, load_size, offset))
+                cell = (
+                    pair_result(min(run.result(), key=lambda x: x["Core cyc"]), store_size, load_size, transfer)
+                    if run is not None
+                    else {}
+                )
+                for key in ["latency", *COUNTERS]:
+                    if key == "latency" or key in counter_list:
+                        row.setdefault(key, []).append(cell.get(key, float("nan")))
+            for key, values in row.items():
+                results.setdefault(key, []).append(values)
+    results["success"] = forwarded(results)
+    print_matrix(results)
+    return results
+
+
+def disambiguation_code(period: int) -> str:
+    """A store whose address takes three multiplications to compute, then a load that the processor
+    may run ahead of it. The load reads the stored address once in period iterations (ebp counts them)."""
+    if period:
+        alias = f"""
+mov ecx, ebp
+and ecx, {period - 1}
+cmp ecx, 1
+sbb edx, edx                    ; -1 when aliasing
+not edx
+and edx, 64                     ; 0 when aliasing, else the next line
+"""
+    else:
+        alias = "mov edx, 64\n"
+    return (
+        alias
+        + """
+imul r10, r11, 1                ; r11 is 0
+imul r10, r10, 1
+imul r10, r10, 1
+mov [r12 + r10], eax
+mov eax, [r12 + rdx]
+"""
+    )
+
+
+def disambiguation_test() -> ForwardResults:
+    """Machine clears and cycles per iteration when a load runs ahead of a store to the same address."""
+    counter_list = counters()
+    results: ForwardResults = {"x": [], "cycles": [], "clears": []}
+    for period in PERIODS:
+        runs = run_test(
+            disambiguation_code(period),
+            counter_list,
+            init_once=BUFFER_INIT + "xor r11d, r11d\n",
+            repetitions=10,
+            iterations=10000,
+        )
+        r = min(runs, key=lambda x: x["Core cyc"])
+        clears = r.get("MemOrdClr", float("nan"))
+        results["x"].append([1.0 / period if period else 0.0])
+        results["cycles"].append([r["Core cyc"]])
+        results["clears"].append([clears])
+        name = f"1 in {period}" if period else "never"
+        print(f"  aliasing {name}: {r['Core cyc']:.1f} clocks, {clears:.3f} memory ordering clears per iteration")
+    return results
+
+
+def forward_plot(name: str, results: ForwardResults, alt: bool) -> None:
+    fig = plt.figure()
+    fig.canvas.set_window_title(name)  # type: ignore[attr-defined]
+    if "pairs" not in results:
+        # Disambiguation: clears (or with alt, cycles) against the fraction of loads that alias
+        plt.title(name)
+        key = "cycles" if alt else "clears"
+        plt.plot([x[0] for x in results["x"]], [y[0] for y in results[key]], marker=".")
+        plt.xscale("symlog", linthresh=1 / 1024)
+        plt.xlabel("Fraction of loads that alias the store")
+        plt.ylabel("Core cycles per iteration" if alt else "Memory ordering clears per iteration")
+        return
+    fig.suptitle(name)
+    offsets = results["offsets"][0]
+    labels = [f"{store:.0f}>{load:.0f}" for store, load in results["pairs"]]
+    maps = [("latency", "Latency (clocks)"), ("success", "Forwarded")]
+    if alt:
+        maps = [(key, f"{key} per pair") for key in COUNTERS if key in results]
+    for index, (key, title) in enumerate(maps, 1):
+        heatmap(
+            offsets,
+            labels,
+            results[key],
+            title,
+            index,
+            rows=len(maps),
+            cols=1,
+            x_scale="category",
+            y_scale="category",
+            xlabel="Load offset from store (bytes)",
+            ylabel="Store > load size",
+        )
+
+
+def add_test(
+    agner: Agner,
+    name: str,
+    store_sizes: list[int],
+    load_sizes: list[int],
+    offsets: list[int],
+    base: int = 0,
+    split: bool = False,
+) -> None:
+    def test() -> ForwardResults:
+        return forward_test(store_sizes, load_sizes, offsets, base, split)
+
+    def plot(results: ForwardResults, alt: bool) -> None:
+        return forward_plot(name, results, alt)
+
+    agner.add_test(name, test, plot)
+
+
+def add_tests(agner: Agner) -> None:
+    add_test(agner, "Forwarding aligned", SIZES, SIZES, list(range(32)))
+    add_test(agner, "Forwarding misaligned", SIZES[1:], SIZES, list(range(32)), base=3)
+    add_test(agner, "Forwarding line split", SIZES[1:], SIZES, list(range(32)), split=True)
+    # Loads about a page on from an 8 byte store, and a line further as the control
+    add_test(agner, "4K aliasing", [8], SIZES, list(range(4088, 4105)) + [4160])
+
+    def plot(results: ForwardResults, alt: bool) -> None:
+        return forward_plot("Memory disambiguation", results, alt)
+
+    agner.add_test("Memory disambiguation", disambiguation_test, plot)
@@ -0,0 +1,268 @@
+#!/usr/bin/env python3
+
+from __future__ import annotations
+
+import statistics
+from pathlib import Path
+from typing import NamedTuple
+
+import matplotlib.pyplot as plt
+
+from agner.agner import Agner, CounterData, adaptive_grid, jump_chain, run_test
+from agner.counters import get_counter_db
+from agner.plot import heatmap
+
+# Per metric, one row per stride with one value per page count. "summary" has one row with the
+# first level entries and ways, the second level entries and the page walk latency (0 if unknown)
+TLBResults = dict[str, list[list[float]]]
+
+# Loads through the pages in each iteration of the DTLB test code. The ITLB test code jumps through all pages
+ACCESSES = 16
+
+# Code pages for the ITLB tests are placed from here, away from the test program
+ITLB_BASE = 1 << 33
+
+HUGEPAGES_DIR = Path("/sys/kernel/mm/hugepages")
+
+
+class PageSize(NamedTuple):
+    size: int
+    mmap_flags: int  # MAP_HUGETLB and the page size for huge pages
+    address: int  # of the buffer. Each run maps over the last one, so native runs don't use up memory
+
+
+PAGE_SIZES = {
+    "4K": PageSize(1 << 12, 0, 1 << 40),
+    "2M": PageSize(1 << 21, 0x40000 | 21 << 26, 2 << 40),
+    "1G": PageSize(1 << 30, 0x40000 | 30 << 26, 3 << 40),
+}
+
+
+def free_huge_pages(page: PageSize) -> int:
+    path = HUGEPAGES_DIR / f"hugepages-{page.size // 1024}kB" / "free_hugepages"
+    return int(path.read_text()) if path.exists() else 0
+
+
+def line(index: int) -> int:
+    """Offset of the line touched in page number index, different so that they don't compete for cache sets."""
+    return index % 64 * 64
+
+
+def chase_init(page: PageSize, pages: int, stride: int) -> str:
+    """Map the buffer and make r12 point at a cyclic chain of pointers with one line in every stride'th page."""
+    span = page.size * stride
+    # MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE: only the pages touched are allocated
+    flags = 0x4032 | page.mmap_flags
+    # Small pages must not be merged into transparent huge pages
+    no_huge = (
+        ""
+        if page.mmap_flags
+        else f"""
+mov rdi, rax
+mov eax, 28                     ; madvise
+mov rsi, {pages * span:#x}
+mov edx, 15                     ; MADV_NOHUGEPAGE
+syscall
+"""
+    )
+    return f"""
+push rsi
+push rdi
+mov eax, 9                      ; mmap
+mov rdi, {page.address:#x}
+mov rsi, {pages * span:#x}
+mov edx, 3                      ; PROT_READ | PROT_WRITE
+mov r10d, {flags:#x}
+mov r8, -1
+xor r9d, r9d
+syscall
+mov r12, rax
+{no_huge}
+pop rdi
+pop rsi
+xor ecx, ecx
+TlbLink:
+lea edx, [ecx + 1]              ; next page, the first after the last
+cmp edx, {pages}
+jb TlbNext
+xor edx, edx
+TlbNext:
+mov rax, rdx
+imul rax, rax, {span}
+and edx, 63
+shl edx, 6
+add rax, rdx
+add rax, r12
+mov rbx, rcx
+imul rbx, rbx, {span}
+mov edx, ecx
+and edx, 63
+shl edx, 6
+add rbx, rdx
+mov [r12 + rbx], rax
+inc ecx
+cmp ecx, {pages}
+jb TlbLink
+"""
+
+
+CHASE = f"""
+%rep {ACCESSES}
+mov r12, [r12]
+%endrep
+"""
+
+
+def counters(names: list[str]) -> list[int | str]:
+    """The counters of names that this processor has, with core cycles first."""
+    db = get_counter_db()
+    return ["Core cyc", *(name for name in names if db.is_supported(name))]
+
+
+def per_access(r: CounterData, hit: str, walk: str, accesses: int) -> CounterData:
+    result = {
+        "cycles": r["Core cyc"] / accesses,
+        "misses": (r.get(hit, 0) + r.get(walk, 0)) / accesses,
+        "walks": r.get(walk, 0) / accesses,
+    }
+    if "Walk cyc" in r:
+        result["walk cycles"] = r["Walk cyc"] / r[walk] if r[walk] else 0
+    return result
+
+
+def dtlb_measure(page: PageSize, pages: int, stride: int) -> CounterData:
+    # Enough iterations that every page is touched a few times in each repetition
+    results = run_test(
+        CHASE,
+        counters(["STLB Hit", "DTLB Walk", "Walk cyc"]),
+        init_once=chase_init(page, pages, stride),
+        repetitions=10,
+        iterations=max(100, 4 * pages // ACCESSES),
+    )
+    return per_access(min(results, key=lambda x: x["Core cyc"]), "STLB Hit", "DTLB Walk", ACCESSES)
+
+
+def itlb_measure(pages: int, stride: int) -> CounterData:
+    chain = jump_chain([ITLB_BASE + index * stride * 4096 + line(index) for index in range(pages)])
+    test_code = """
+mov rax, PLACED_CODE_0
+call rax
+"""
+    results = run_test(
+        test_code,
+        counters(["ITLB Hit", "ITLB Walk"]),
+        repetitions=10,
+        iterations=100,
+        placements=chain,
+    )
+    return per_access(min(results, key=lambda x: x["Core cyc"]), "ITLB Hit", "ITLB Walk", pages)
+
+
+def threshold(pages: list[int], row: list[float]) -> int:
+    """The most pages that are accessed with less than one miss in two accesses."""
+    last = 0
+    for num, value in zip(pages, row):
+        if value >= 0.5:
+            break
+        last = num
+    return last
+
+
+def summary(pages: list[int], results: TLBResults) -> list[float]:
+    """First level entries and ways, second level entries and walk latency in clock cycles.
+
+    Strides that are a multiple of the number of sets put all pages in one set, so the fewest
+    pages that miss at any stride is the number of ways.
+    """
+    entries = threshold(pages, results["misses"][0])
+    ways = min((threshold(pages, row) for row in results["misses"] if threshold(pages, row)), default=0)
+    second = threshold(pages, results["walks"][0])
+    walking = [
+        (row_index, index)
+        for row_index, row in enumerate(results["walks"])
+        for index, walks in enumerate(row)
+        if walks >= 0.5
+    ]
+    latency = 0.0
+    if walking and "walk cycles" in results:
+        latency = statistics.median(results["walk cycles"][y][x] for y, x in walking)
+    elif walking:
+        # Extra cycles per walk over accesses that hit the first level TLB
+        base = results["cycles"][0][0]
+        latency = statistics.median(
+            (results["cycles"][y][x] - base) / results["walks"][y][x] for y, x in walking
+        )
+    return [entries, ways, second, latency]
+
+
+def tlb_test(name: str, page_size: str, pages: list[int], strides: list[int]) -> TLBResults:
+    if name.startswith("ITLB"):
+
+        def measure(num: int, stride: int) -> CounterData:
+            return itlb_measure(num, stride)
+
+    else:
+        page = PAGE_SIZES[page_size]
+        if page.mmap_flags:
+            free = free_huge_pages(page)
+            pages = [num for num in pages if num <= free]
+            if not pages:
+                print(f"  no free {page_size} huge pages, skipping (see /proc/sys/vm/nr_hugepages)")
+                return {}
+
+        def measure(num: int, stride: int) -> CounterData:
+            return dtlb_measure(page, num, stride)
+
+    grid = adaptive_grid(pages, strides, measure, ["misses", "walks"], abs_tol=0.05)
+    results = {key: [[cell[key] for cell in row] for row in grid] for key in grid[0][0]}
+    results["summary"] = [summary(pages, results)]
+    entries, ways, second, latency = results["summary"][0]
+    print(f"  {name}: {entries} entries, {ways} ways; second level {second} entries; walk {latency:.0f} clocks")
+    # The page counts measured, for the plot
+    results["pages"] = [list(map(float, pages))]
+    return results
+
+
+def tlb_heatmap(pages: list[int], strides: list[int], result: list[list[float]], title: str, index: int) -> None:
+    heatmap(
+        pages, strides, result, title, index, x_scale="log", y_scale="log", xlabel="Pages", ylabel="Stride (pages)"
+    )
+
+
+def tlb_plot(name: str, strides: list[int], results: TLBResults, alt: bool) -> None:
+    if not results:
+        return
+    pages = [int(num) for num in results["pages"][0]]
+    entries, ways, second, latency = results["summary"][0]
+    fig = plt.figure()
+    fig.canvas.set_window_title(name)  # type: ignore[attr-defined]
+    fig.suptitle(f"{name}: {entries:.0f} entries, {ways:.0f} ways, second level {second:.0f}, walk {latency:.0f} clk")
+    if alt:
+        tlb_heatmap(pages, strides, results["cycles"], "Core cycles/access", 0)
+        return
+    tlb_heatmap(pages, strides, results["misses"], "First level misses/access", 1)
+    tlb_heatmap(pages, strides, results["walks"], "Page walks/access", 2)
+    tlb_heatmap(pages, strides, results["cycles"], "Core cycles/access", 3)
+    if "walk cycles" in results:
+        tlb_heatmap(pages, strides, results["walk cycles"], "Cycles/walk", 4)
+
+
+def add_test(agner: Agner, name: str, page_size: str, pages: list[int], strides: list[int]) -> None:
+    def test() -> TLBResults:
+        return tlb_test(name, page_size, pages, strides)
+
+    def plot(results: TLBResults, alt: bool) -> None:
+        return tlb_plot(name, strides, results, alt)
+
+    agner.add_test(name, test, plot)
+
+
+def add_tests(agner: Agner) -> None:
+    # First level DTLB of tens of entries, second level of a few thousand shared with other page sizes
+    add_test(agner, "DTLB 4K", "4K", [2**x for x in range(2, 14)], [2**x for x in range(0, 9)])
+    # Huge pages must be reserved, e.g. echo 128 > /proc/sys/vm/nr_hugepages
+    add_test(agner, "DTLB 2M", "2M", [2**x for x in range(1, 8)], [2**x for x in range(0, 6)])
+    # Every page is a gigabyte of memory, so only a few and no strides
+    add_test(agner, "DTLB 1G", "1G", list(range(1, 17)), [1])
+    # Pages more than 64KB apart are placed one by one, so keep to the first level ITLB
+    add_test(agner, "ITLB 4K", "4K", [2**x for x in range(2, 10)], [2**x for x in range(0, 7)])
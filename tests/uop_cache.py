@@ -0,0 +1,231 @@
+#!/usr/bin/env python3
+
+from __future__ import annotations
+
+from typing import Callable
+
+import matplotlib.pyplot as plt
+
+from agner.agner import SWEEP_COARSE_POINTS, Agner, CounterData, adaptive_grid, run_test
+from agner.counters import get_counter_db
+from agner.plot import heatmap
+
+# Per metric, one row per y with one value per x. "xs" and "ys" hold the axes, in one row each
+UopResults = dict[str, list[list[float]]]
+
+# Iterations of the measured loop in each iteration of the harness loop
+LOOP_COUNT = 100
+
+# Intel's recommended long NOPs by length. Each is one uop that needs no execution port
+NOPS = {
+    1: "90",
+    2: "66 90",
+    3: "0F 1F 00",
+    4: "0F 1F 40 00",
+    5: "0F 1F 44 00 00",
+    6: "66 0F 1F 44 00 00",
+    7: "0F 1F 80 00 00 00 00",
+    8: "0F 1F 84 00 00 00 00 00",
+    9: "66 0F 1F 84 00 00 00 00 00",
+}
+
+# Where the front end delivers uops from: the uop cache (DSB), the decoders (MITE) and the loop stream detector
+SOURCES = {"dsb": "Cach uops", "mite": "Dec uops", "lsd": "Loop uops"}
+
+
+def nops(count: int, length: int) -> str:
+    data = ", ".join(f"0{byte}h" for byte in NOPS[length].split())
+    return f"%rep {count}\ndb {data}\n%endrep\n"
+
+
+def loop_code(uops: int, length: int, offset: int) -> str:
+    """A loop of uops NOPs of length bytes, starting offset bytes into a 64 byte line.
+
+    The loop branch is one more uop, as dec and jnz fuse. The padding is jumped over.
+    """
+    return f"""
+mov ecx, {LOOP_COUNT}
+jmp UopLoop
+align 64
+times {offset} db 0CCh
+UopLoop:
+{nops(uops, length)}
+dec ecx
+jnz UopLoop
+"""
+
+
+def window_code(uops: int, window: int, windows: int = 8) -> str:
+    """A loop through windows aligned windows of window bytes, each with uops one byte NOPs
+    and a jump to the next. The bytes after the jump are padding."""
+    lines = [f"mov ecx, {LOOP_COUNT}", "jmp UopWindow0", f"align {window}, db 0CCh"]
+    for index in range(windows):
+        lines += [f"UopWindow{index}:", nops(uops, 1), f"jmp short UopWindow{index + 1}", f"align {window}, db 0CCh"]
+    lines += [f"UopWindow{windows}:", "dec ecx", "jnz UopWindow0"]
+    return "\n".join(lines) + "\n"
+
+
+def counters() -> list[int | str]:
+    db = get_counter_db()
+    return ["Core cyc", *(name for name in [*SOURCES.values(), "DSB2MITE"] if db.is_supported(name))]
+
+
+def measure(test_code: str) -> CounterData:
+    """The fraction of uops from each source, and cycles and switch penalty cycles per loop iteration."""
+    results = run_test(test_code, counters(), repetitions=10)
+    r = min(results, key=lambda x: x["Core cyc"])
+    delivered = sum(r.get(name, 0) for name in SOURCES.values())
+    result = {key: r.get(name, 0) / delivered if delivered else 0 for key, name in SOURCES.items()}
+    result["cycles"] = r["Core cyc"] / LOOP_COUNT
+    result["switch"] = r.get("DSB2MITE", 0) / LOOP_COUNT
+    return result
+
+
+def limit(xs: list[int], row: list[float], threshold: float = 0.5) -> int:
+    """The largest x before the row first reaches threshold. The xs count the loop branch too."""
+    last = 0
+    for x, value in zip(xs, row):
+        if value >= threshold:
+            break
+        last = x
+    return last
+
+
+class UopTest:
+    """A grid of loops, with code(x, y) the test code of each. The grid is refined where metric, the
+    fraction of uops from one source, steps. summary describes the limits that the grid shows.
+    With dense, every point is measured, for axes where a step can show at one point only."""
+
+    def __init__(
+        self,
+        xs: list[int],
+        ys: list[int],
+        code: Callable[[int, int], str],
+        metric: str,
+        summary: Callable[[list[int], list[int], UopResults], str],
+        labels: tuple[str, str],
+        dense: bool = False,
+    ) -> None:
+        self.xs = xs
+        self.ys = ys
+        self.code = code
+        self.metric = metric
+        self.summary = summary
+        self.labels = labels
+        self.dense = dense
+
+    def run(self) -> UopResults:
+        db = get_counter_db()
+        if not db.is_supported(SOURCES[self.metric]):
+            print(f"  {SOURCES[self.metric]} is not counted on this processor, skipping")
+            return {}
+        grid = adaptive_grid(
+            self.xs,
+            self.ys,
+            lambda x, y: measure(self.code(x, y)),
+            [self.metric, "cycles"],
+            coarse=max(len(self.xs), len(self.ys)) if self.dense else SWEEP_COARSE_POINTS,
+            abs_tol=0.05,
+        )
+        results = {key: [[cell[key] for cell in row] for row in grid] for key in grid[0][0]}
+        results["xs"] = [list(map(float, self.xs))]
+        results["ys"] = [list(map(float, self.ys))]
+        print(f"  {self.summary(self.xs, self.ys, results)}")
+        return results
+
+
+def capacity_summary(xs: list[int], ys: list[int], results: UopResults) -> str:
+    # Loops of long NOPs aren't limited by the uops per window, only by the capacity
+    row = results["mite"][-1]
+    return f"uop cache holds loops of up to {limit(xs, row)} uops of {ys[-1]} byte instructions"
+
+
+def window_summary(xs: list[int], ys: list[int], results: UopResults) -> str:
+    limits = [f"{limit(xs, row)} uops per {window} bytes" for window, row in zip(ys, results["mite"])]
+    return "uop cache holds up to " + ", ".join(limits)
+
+
+def lsd_summary(xs: list[int], ys: list[int], results: UopResults) -> str:
+    # The loop is fed from the LSD while most of its uops come from it
+    row = [1 - value for value in results["lsd"][0]]
+    below = limit(xs, row)
+    return f"loop stream detector holds loops of up to {below} uops" if below else "loop stream detector not used"
+
+
+def alignment_summary(xs: list[int], ys: list[int], results: UopResults) -> str:
+    worst = [max(row) for row in results["cycles"]]
+    best = [min(row) for row in results["cycles"]]
+    spans = [f"{uops} uops {low:.1f}-{high:.1f}" for uops, low, high in zip(ys, best, worst)]
+    return "clocks per iteration over all offsets: " + ", ".join(spans)
+
+
+TESTS = {
+    # Uop counts against instruction lengths. Short instructions pack more uops into each window
+    "Uop cache capacity": UopTest(
+        list(range(256, 8193, 256)),
+        [1, 2, 3, 4, 6, 9],
+        lambda uops, length: loop_code(uops - 1, length, 0),
+        "mite",
+        capacity_summary,
+        ("Uops in loop", "Bytes per instruction"),
+    ),
+    "Uop cache window": UopTest(
+        list(range(1, 31)),
+        [32, 64],
+        lambda uops, window: window_code(uops - 1, window),
+        "mite",
+        window_summary,
+        ("Uops per window", "Window bytes"),
+    ),
+    "Loop stream detector": UopTest(
+        list(range(4, 257, 4)),
+        [4],
+        lambda uops, length: loop_code(uops - 1, length, 0),
+        "lsd",
+        lsd_summary,
+        ("Uops in loop", "Bytes per instruction"),
+    ),
+    # Small loops of 4 byte NOPs at each offset in a line, crossing 32 and 64 byte boundaries. The offsets
+    # are periodic, and a loop may fit its windows at a single offset, so all are measured
+    "Loop alignment": UopTest(
+        list(range(64)),
+        [4, 8, 16, 32],
+        lambda offset, uops: loop_code(uops - 1, 4, offset),
+        "mite",
+        alignment_summary,
+        ("Offset in line", "Uops in loop"),
+        dense=True,
+    ),
+}
+
+
+def plot(xs: list[float], ys: list[float], result: list[list[float]], title: str, index: int, test: UopTest) -> None:
+    heatmap(xs, ys, result, title, index, y_scale="category", xlabel=test.labels[0], ylabel=test.labels[1])
+
+
+def uop_plot(name: str, test: UopTest, results: UopResults, alt: bool) -> None:
+    if not results:
+        return
+    fig = plt.figure()
+    fig.canvas.set_window_title(name)  # type: ignore[attr-defined]
+    fig.suptitle(name)
+    xs, ys = results["xs"][0], results["ys"][0]
+    if alt:
+        plot(xs, ys, results["cycles"], "Core cycles/iteration", 0, test)
+        return
+    plot(xs, ys, results["dsb"], "Uops from uop cache", 1, test)
+    plot(xs, ys, results["mite"], "Uops from decoders", 2, test)
+    plot(xs, ys, results["lsd"], "Uops from loop stream detector", 3, test)
+    plot(xs, ys, results["switch"], "Switch penalty cycles/iteration", 4, test)
+
+
+def add_test(agner: Agner, name: str, test: UopTest) -> None:
+    def plot_fn(results: UopResults, alt: bool) -> None:
+        return uop_plot(name, test, results, alt)
+
+    agner.add_test(name, test.run, plot_fn)
+
+
+def add_tests(agner: Agner) -> None:
+    for name, test in TESTS.items():
+        add_test(agner, name, test)